@@ -37,5 +37,5 @@ macx {
 }
 
 # Input
-HEADERS += ProgramGuiWindow.h
-SOURCES += ProgramGuiWindow.cpp PulseGeneratorGui.cpp PulseStateMachine/pulseStateMachine.cpp
+HEADERS += ProgramGuiWindow.h SessionWindow.h
+SOURCES += ProgramGuiWindow.cpp SessionWindow.cpp PulseGeneratorGui.cpp PulseStateMachine/pulseStateMachine.cpp
@@ -4,14 +4,30 @@
 #include <QApplication>
 #include <QDesktopServices>
 #include <QUrl>
+#include <QCryptographicHash>
+#include <QRegExp>
+#include <QTextBlock>
 #include <qextserialport.h>
 #include <qextserialenumerator.h>
 
 #include "pulseStateMachine.h"
 #include "ProgramGuiWindow.h"
+#include "SessionWindow.h"
 
 const QString runButtonText = "Run on Device";
 const QString interruptButtonText = "Interrupt Program";
+const QString forceStopButtonText = "Force Stop";
+
+// Telemetry frames from the device (see PulseGeneratorFirmware.pde): how
+// often to ask for them, and how long without one before a run is
+// considered stalled.
+// N.B.: these must be kept in sync with PulseGeneratorFirmware.pde
+const char telemetrySeparator = 0x1E;
+const int telemetryInterval = 250;                  // ms
+const int telemetryTimeout = 4 * telemetryInterval;
+
+QextSerialPort* ProgramGuiWindow::s_port = NULL;
+ProgramGuiWindow* ProgramGuiWindow::s_portWindow = NULL;
 
 // the default Qwt minimum plot size is far too large, so we need to
 // subclass the plot.
@@ -58,7 +74,6 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     for (unsigned int i = 0; i < numChannels; ++i) {
         m_curves.push_back(new QwtPlotCurve("Channel " + QString::number(i)));
         m_curves.back()->attach(m_plot);
-        m_points.push_back(QVector<QPointF>());
     }
 
     // then the status box
@@ -76,6 +91,13 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     m_texteditStatus->setPalette(p);
 #endif
 
+    // the board selection combo box (for the expected timing)...
+    m_labelBoard = new QLabel("Board");
+    m_comboBoard = new QComboBox();
+    for (int i = 0; i < numBoardTimingCosts; ++i) {
+        m_comboBoard->addItem(boardTimingCosts[i].boardName);
+    }
+
     // the port selection combo box...
     m_labelPort = new QLabel("Port");
     m_comboPort = new QComboBox();
@@ -103,7 +125,9 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     m_buttonOpen = new QPushButton("Open");
     m_buttonSave = new QPushButton("Save");
     m_buttonSimulate = new QPushButton("Simulate");
+    m_buttonSession = new QPushButton("Session");
     m_buttonRun = new QPushButton(runButtonText);
+    m_labelProgress = new QLabel();
 
     m_checkboxLock = new QCheckBox("Lock");
 
@@ -114,7 +138,12 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     buttonLayout->addWidget(m_buttonOpen);
     buttonLayout->addWidget(m_buttonSave);
     buttonLayout->addWidget(m_buttonSimulate);
+    buttonLayout->addWidget(m_buttonSession);
+    buttonLayout->addStretch();
+    buttonLayout->addWidget(m_labelProgress);
     buttonLayout->addStretch();
+    buttonLayout->addWidget(m_labelBoard);
+    buttonLayout->addWidget(m_comboBoard);
     buttonLayout->addWidget(m_labelPort);
     buttonLayout->addWidget(m_comboPort);
     buttonLayout->addStretch();
@@ -266,8 +295,21 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     mainLayout->addLayout(buttonLayout);
     setLayout(mainLayout);
 
+    // keep a few dozen parsed programs, and simulations of up to a few
+    // million points in total
+    m_compiledPrograms.setMaxCost(32);
+    m_simulations.setMaxCost(4000000);
+
     // set up the serial port support
-    m_port = NULL;
+    m_running = false;
+    m_abortSent = false;
+    m_runningProgramHash = 0;
+    m_storedProgramHash = 0;
+    m_storedDeviceHash = 0;
+    m_runningEditor = NULL;
+    m_telemetryTimer = new QTimer(this);
+    m_telemetryTimer->setSingleShot(true);
+    m_telemetryTimer->setInterval(telemetryTimeout);
     m_portEnumerator = new QextSerialEnumerator(this);
     m_portEnumerator->setUpNotifications();
 
@@ -277,7 +319,9 @@ ProgramGuiWindow::ProgramGuiWindow(QWidget* parent) :
     QObject::connect(m_buttonOpen, SIGNAL(clicked()), this, SLOT(open()));
     QObject::connect(m_buttonSave, SIGNAL(clicked()), this, SLOT(save()));
     QObject::connect(m_buttonSimulate, SIGNAL(clicked()), this, SLOT(simulate()));
+    QObject::connect(m_buttonSession, SIGNAL(clicked()), this, SLOT(openSession()));
     QObject::connect(m_buttonRun, SIGNAL(clicked()), this, SLOT(run()));
+    QObject::connect(m_telemetryTimer, SIGNAL(timeout()), SLOT(onTelemetryTimeout()));
     QObject::connect(m_checkboxLock, SIGNAL(stateChanged(int)), SLOT(onLockStateChanged(int)));
     QObject::connect(m_portEnumerator, SIGNAL(deviceDiscovered(QextPortInfo)),
             SLOT(repopulatePortComboBox()));
@@ -376,24 +420,124 @@ QSize ProgramGuiWindow::sizeHint() const {
 }
 
 
+ProgramGuiWindow::~ProgramGuiWindow() {
+    if (s_portWindow == this) {
+        QObject::disconnect(s_port, 0, this, 0);
+        s_portWindow = NULL;
+    }
+}
+
+
+bool ProgramGuiWindow::releasePort(const QString& portName) {
+    if (!s_port || s_port->portName() != portName) {
+        return true;
+    }
+    if (s_portWindow && s_portWindow->m_running) {
+        return false;
+    }
+    closePort();
+    return true;
+}
+
+
+bool ProgramGuiWindow::openPort() {
+    if (s_port && s_port->portName() != m_comboPort->currentText()) {
+        closePort();
+    }
+
+    bool wasOpen = (s_port != NULL);
+    if (!s_port) {
+        PortSettings settings = {BAUD9600, DATA_8, PAR_NONE, STOP_1, FLOW_OFF, 10};
+        s_port = new QextSerialPort(m_comboPort->currentText(), settings, QextSerialPort::EventDriven);
+        s_port->open(QIODevice::ReadWrite);
+    } else if (s_portWindow) {
+        QObject::disconnect(s_port, 0, s_portWindow, 0);
+    }
+
+    QObject::connect(s_port, SIGNAL(readyRead()), this, SLOT(onNewSerialData()));
+    s_portWindow = this;
+    return wasOpen;
+}
+
+
+void ProgramGuiWindow::closePort() {
+    if (s_port) {
+        s_port->close();
+        delete s_port;
+        s_port = NULL;
+    }
+    s_portWindow = NULL;
+}
+
+
 void ProgramGuiWindow::onNewSerialData() {
-    if (m_port->bytesAvailable()) {
-        QString newData = QString::fromUtf8(m_port->readAll()).replace("\n","");
+    if (s_port->bytesAvailable()) {
+        m_serialBuffer += s_port->readAll();
+
+        // separate the telemetry frames from the text, keeping any
+        // incomplete frame for next time
+        QByteArray text;
+        for (;;) {
+            int start = m_serialBuffer.indexOf(telemetrySeparator);
+            if (start == -1) {
+                text += m_serialBuffer;
+                m_serialBuffer.clear();
+                break;
+            }
+            text += m_serialBuffer.left(start);
+            m_serialBuffer.remove(0, start);
+
+            if (m_serialBuffer.size() < 2) {
+                break;
+            }
+            int frameSize = 3 + (unsigned char)m_serialBuffer[1];
+            if (m_serialBuffer.size() < frameSize) {
+                break;
+            }
+            showTelemetry(m_serialBuffer.left(frameSize));
+            m_serialBuffer.remove(0, frameSize);
+        }
+
+        QString newData = QString::fromUtf8(text).replace("\n","");
+        if (newData.contains("Running program")) {
+            m_telemetryTimer->start();
+        }
 
-        // If we're done, close the serial port.  The bell character (ascii
-        // character 7) signals the end of the transmission or an error.
+        // remember the hash the device gave the program it stored
         // N.B.: this message must be kept in sync with
         // PulseGeneratorFirmware.pde
-        if (newData.contains('\07')) {
-            m_port->close();
-            delete m_port;
-            m_port = NULL;
+        m_receivedText += newData;
+        QRegExp storedMessage("stored in slot 0 \\(hash ([0-9A-Fa-f]+)\\)");
+        int storedAt = storedMessage.indexIn(m_receivedText);
+        if (storedAt != -1) {
+            m_storedProgramHash = m_runningProgramHash;
+            m_storedDeviceHash = storedMessage.cap(1).toUInt(NULL, 16);
+            m_receivedText.remove(0, storedAt + storedMessage.matchedLength());
+        }
+
+        // The bell character (ascii character 7) signals the end of the
+        // transmission or an error.  The port is left open for the next
+        // run, unless the device reported an error: it is then still
+        // receiving the program, and closing the port resets it.
+        // N.B.: these messages must be kept in sync with
+        // PulseGeneratorFirmware.pde
+        if (!m_running) {
+            // (e.g. the prompt for the next program)
+        } else if (newData.contains('\07')) {
+            if (!m_receivedText.contains("done.") &&
+                    !m_receivedText.contains("aborted.")) {
+                closePort();
+            }
+            m_running = false;
             m_buttonRun->setText(runButtonText);
+            m_telemetryTimer->stop();
+            m_labelProgress->clear();
+            highlightRunningLine(-1);
         } else {
             // queue up one additional line per prompt
             int numPrompts = newData.count(':');
             while (numPrompts > 0 && !m_sendBuffer.isEmpty()) {
-                m_port->write((m_sendBuffer.front() + "\n").toUtf8());
+                s_port->write((m_sendBuffer.front() + "\n").toUtf8());
                 m_sendBuffer.pop_front();
                 --numPrompts;
             }
@@ -402,7 +546,101 @@ void ProgramGuiWindow::onNewSerialData() {
         // display the new data
         m_texteditStatus->moveCursor(QTextCursor::End);
         m_texteditStatus->insertPlainText(newData);
+        translateErrorCodes();
+
+    }
+}
+
+
+void ProgramGuiWindow::translateErrorCodes() {
+    // N.B.: this message must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    QRegExp errorCode(" \\(code (\\d+)\\)");
+    QTextDocument* document = m_texteditStatus->document();
+
+    for (QTextCursor cursor = document->find(errorCode); !cursor.isNull();
+            cursor = document->find(errorCode, cursor)) {
+        errorCode.indexIn(cursor.selectedText());
+        const char* message =
+            parseErrorMessage(ParseError(errorCode.cap(1).toInt()));
+        cursor.insertText(": " +
+                QString::fromUtf8(message ? message : "unknown error"));
+    }
+}
+
+
+void ProgramGuiWindow::showTelemetry(const QByteArray& frame) {
+    // the frame's fields (see PulseGeneratorFirmware.pde)
+    const unsigned char* bytes = (const unsigned char*)frame.constData();
+    int length = bytes[1];
+    const unsigned char* payload = bytes + 2;
+
+    unsigned char checksum = 0;
+    for (int i = 0; i < length; ++i) {
+        checksum += payload[i];
+    }
+    if (length < 11 || checksum != bytes[2 + length]) {
+        return;
+    }
+
+    uint32_t values[4 + 4] = { 0 };
+    const int sizes[] = { 2, 4, 4, 1, 4, 4, 4, 4 };
+    int numValues = 0;
+    for (int offset = 0; numValues < 8 &&
+            offset + sizes[numValues] <= length; ++numValues) {
+        for (int i = sizes[numValues] - 1; i >= 0; --i) {
+            values[numValues] = (values[numValues] << 8) | payload[offset + i];
+        }
+        offset += sizes[numValues];
+    }
+
+    // the device's command index is into the optimized program, which
+    // the source map relates to the program's lines
+    int line = -1;
+    if ((int)values[0] < m_runningSourceLines.size()) {
+        line = m_runningSourceLines[values[0]];
+    }
+    highlightRunningLine(line);
+
+    QString progress = QString("%1, %2 s, precision %3 \xB5s")
+        .arg(line >= 0 ? "line " + QString::number(line + 1) :
+                "command " + QString::number(values[0]))
+        .arg(values[1] / 1e6, 0, 'f', 1)
+        .arg(values[2]);
+    if (values[3] > 0) {
+        QStringList repeats;
+        for (int i = 4; i < numValues; ++i) {
+            repeats.push_back(QString::number(values[i]));
+        }
+        progress += ", repeats left: " + repeats.join("/");
+    }
+    m_labelProgress->setText(progress);
+
+    m_telemetryTimer->start();
+}
+
+
+void ProgramGuiWindow::highlightRunningLine(int line) {
+    if (!m_runningEditor) {
+        return;
+    }
+
+    QList<QTextEdit::ExtraSelection> selections;
+    if (line >= 0) {
+        QTextEdit::ExtraSelection selection;
+        selection.format.setBackground(QColor(255, 255, 160));
+        selection.format.setProperty(QTextFormat::FullWidthSelection, true);
+        selection.cursor = QTextCursor(
+                m_runningEditor->document()->findBlockByNumber(line));
+        selections.append(selection);
+    }
+    m_runningEditor->setExtraSelections(selections);
+}
+
 
+void ProgramGuiWindow::onTelemetryTimeout() {
+    if (m_running) {
+        m_labelProgress->setText("no progress reported (stalled?)");
     }
 }
 
@@ -414,11 +652,19 @@ void ProgramGuiWindow::help() {
 
 void ProgramGuiWindow::newDocument() {
     ProgramGuiWindow* newWindow = new ProgramGuiWindow();
+    newWindow->m_comboBoard->setCurrentIndex(m_comboBoard->currentIndex());
     newWindow->m_comboPort->setCurrentIndex(m_comboPort->currentIndex());
     newWindow->show();
 }
 
 
+void ProgramGuiWindow::openSession() {
+    SessionWindow* sessionWindow = new SessionWindow();
+    sessionWindow->setAttribute(Qt::WA_DeleteOnClose);
+    sessionWindow->show();
+}
+
+
 void ProgramGuiWindow::open() {
     QString fileName = QFileDialog::getOpenFileName(this,
             tr("Open Pulse Sequence"), "",
@@ -436,6 +682,7 @@ void ProgramGuiWindow::open() {
         ProgramGuiWindow* newWindow = new ProgramGuiWindow();
 
         newWindow->updateProgramName(QFileInfo(fileName).baseName());
+        newWindow->m_comboBoard->setCurrentIndex(m_comboBoard->currentIndex());
         newWindow->m_comboPort->setCurrentIndex(m_comboPort->currentIndex());
         newWindow->m_texteditProgram->setText(in.readAll());
         newWindow->show();
@@ -469,150 +716,235 @@ void ProgramGuiWindow::save() {
 }
 
 
-void ProgramGuiWindow::simulate() {
-    // disable the old simulation results and switch to the status tab
-    m_tabsOutput->setCurrentIndex(m_tabsOutput->indexOf(m_texteditStatus));
-    m_tabsOutput->setTabEnabled(m_tabsOutput->indexOf(m_plot), false);
-
-    // clear any previous plot points
-    for (unsigned int i = 0; i < numChannels; ++i) {
-        m_points[i].clear();
+QStringList ProgramGuiWindow::programLines() const {
+    // read the program from the appropriate tab
+    if (m_tabsProgram->currentIndex() == m_tabsProgram->indexOf(m_texteditProgram)) {
+        return m_texteditProgram->toPlainText().split('\n');
+    } else {
+        return m_texteditTraditionalProgram->toPlainText().split('\n');
     }
+}
 
 
-    m_texteditStatus->moveCursor(QTextCursor::End);
-    m_texteditStatus->insertPlainText("\n\nParsing...\n");
-
+QByteArray ProgramGuiWindow::programText() const {
     // read the program from the appropriate tab
-    QStringList lines;
     if (m_tabsProgram->currentIndex() == m_tabsProgram->indexOf(m_texteditProgram)) {
-        lines = m_texteditProgram->toPlainText().split('\n');
+        return m_texteditProgram->toPlainText().toUtf8();
     } else {
-        lines = m_texteditTraditionalProgram->toPlainText().split('\n');
+        return m_texteditTraditionalProgram->toPlainText().toUtf8();
     }
+}
 
-    // Parse the program
-    QVector<PulseStateCommand> commands;
-    const char* error = NULL;
-    unsigned repeatDepth = 0;
-    bool endProgramFound = 0;
 
-    for (int i = 0; i < lines.size(); ++i) {
-        m_texteditStatus->moveCursor(QTextCursor::End);
-        m_texteditStatus->insertPlainText(QString::number(i+1) + "> " + lines[i] + "\n");
-        if (lines[i].size() != 0) {
-            commands.push_back(PulseStateCommand());
-            commands.back().parseFromString(lines[i].toUtf8(), &error, &repeatDepth);
-
-            if (!error) {
-                if (commands.back().type == PulseStateCommand::endProgram) {
-                    endProgramFound = true;
-                } else if (endProgramFound &&
-                        commands.back().type != PulseStateCommand::noOp) {
-                    error = "unexpected command found after end of program";
-                }
-            }
+QByteArray ProgramGuiWindow::programKey(const QByteArray& text) {
+    return QCryptographicHash::hash(text, QCryptographicHash::Sha1);
+}
 
-            if (error) {
-                m_texteditStatus->moveCursor(QTextCursor::End);
-                m_texteditStatus->insertPlainText(QString::fromUtf8(error) + "\n");
-                return;
-            }
+
+void ProgramGuiWindow::echoProgram(const QByteArray& text, int lastLine) {
+    QString echo;
+    int start = 0;
+    for (int i = 0; i <= lastLine && start <= text.size(); ++i) {
+        int end = text.indexOf('\n', start);
+        if (end == -1) {
+            end = text.size();
         }
+        echo += QString::number(i+1) + "> " +
+            QString::fromUtf8(text.constData() + start, end - start) + "\n";
+        start = end + 1;
     }
 
-    if (!endProgramFound) {
-        m_texteditStatus->moveCursor(QTextCursor::End);
-        m_texteditStatus->insertPlainText("missing \"end program\"\n");
+    m_texteditStatus->moveCursor(QTextCursor::End);
+    m_texteditStatus->insertPlainText(echo);
+}
+
+
+CompiledProgram* ProgramGuiWindow::compileProgram(const QByteArray& text,
+        bool echo) {
+    QByteArray key = programKey(text);
+    CompiledProgram* program = m_compiledPrograms.object(key);
+    if (program) {
+        if (echo) {
+            m_texteditStatus->moveCursor(QTextCursor::End);
+            m_texteditStatus->insertPlainText("(unchanged since it was last parsed)\n");
+        }
+        return program;
+    }
+
+    // parse the whole text at once, into the program's single block of
+    // memory
+    int numLines = countProgramLines(text.constData(), text.size());
+    program = new CompiledProgram(numLines);
+    int errorLine;
+    ParseError error = parseProgram(text.constData(), text.size(),
+            program->commands, program->sourceLines, &program->numCommands,
+            &errorLine);
+
+    if (echo) {
+        echoProgram(text, error == parseOk ? numLines - 1 : errorLine);
+        if (error != parseOk) {
+            m_texteditStatus->moveCursor(QTextCursor::End);
+            m_texteditStatus->insertPlainText(
+                    QString::fromUtf8(parseErrorMessage(error)) + "\n");
+        }
+    }
+    if (error != parseOk) {
+        delete program;
+        return NULL;
+    }
+
+    // optimize the program, as the device will, so that the command
+    // indices the device reports match these
+    program->numCommands = optimizeProgram(program->commands,
+            program->numCommands, program->sourceLines);
+    program->hash = hashProgram(program->commands, program->numCommands);
+    m_compiledPrograms.insert(key, program);
+    return program;
+}
+
+
+QString ProgramGuiWindow::reportTiming(const PulseStateCommand* commands,
+        int numCommands, const TimingCosts& costs) {
+    const uint32_t maxChanges = 1000000;
+
+    TimingAnalysis analysis;
+    analyzeTiming(commands, numCommands, costs, maxChanges,
+            &analysis);
+
+    QString report = "Estimated timing on an " + QString(costs.boardName) +
+        ": " + QString::number(analysis.numChanges) + " output changes, ";
+    if (analysis.minChangeSpacing != forever) {
+        report += "at least " + QString::number(analysis.minChangeSpacing) +
+            " \xB5s apart, ";
+    }
+    report += "precision about " + QString::number(analysis.maxError) +
+        " \xB5s";
+    if (analysis.truncated) {
+        report += " (first " + QString::number(maxChanges) +
+            " changes only)";
+    }
+    report += ".\n";
+
+    if (analysis.lateChanges > 0) {
+        report += "Warning: " + QString::number(analysis.lateChanges) +
+            " changes are closer together than the device can keep up"
+            " with; the worst should be about " +
+            QString::number(analysis.maxError) + " \xB5s late (at " +
+            QString::number(analysis.maxErrorAt * 1e-6) + " s).\n";
+    }
+
+    return report;
+}
+
+
+const QString& ProgramGuiWindow::timingReport(CompiledProgram* program) {
+    const TimingCosts* costs = &boardTimingCosts[
+        qMax(0, m_comboBoard->currentIndex())];
+    if (program->timingCosts != costs) {
+        program->timingReport = reportTiming(program->commands,
+                program->numCommands, *costs);
+        program->timingCosts = costs;
+    }
+    return program->timingReport;
+}
+
+
+void ProgramGuiWindow::simulate() {
+    // disable the old simulation results and switch to the status tab
+    m_tabsOutput->setCurrentIndex(m_tabsOutput->indexOf(m_texteditStatus));
+    m_tabsOutput->setTabEnabled(m_tabsOutput->indexOf(m_plot), false);
+
+    m_texteditStatus->moveCursor(QTextCursor::End);
+    m_texteditStatus->insertPlainText("\n\nParsing...\n");
+
+    QByteArray text = programText();
+    CompiledProgram* program = compileProgram(text, true);
+    if (!program) {
         return;
     }
+    m_texteditStatus->moveCursor(QTextCursor::End);
+    m_texteditStatus->insertPlainText(timingReport(program));
 
+    // reuse the last simulation of the same program, if we still have it
+    QByteArray key = programKey(text);
+    SimulationResult* cachedSimulation = m_simulations.object(key);
+    if (cachedSimulation) {
+        showSimulation(*cachedSimulation);
+        return;
+    }
 
     // run the program
     const float low = -0.4;
     const float high = 0.4;
 
-    PulseChannel channels[numChannels];
-    RepeatStack stack;
-    int runningLine = 0;
+    SimulationResult simulation;
+    simulation.points.resize(numChannels);
+    QVector<QVector<QPointF> >& points = simulation.points;
+
+    ProgramStepper stepper(program->commands, program->numCommands);
+    ChannelMask state = 0;
+    ChannelMask setChannels;
     Microseconds time = 0;
-    Microseconds timeInState = 0;
     int steps = 0;
     int maxSteps = 1000000;
     const float us = 1e-6f;
 
     // mark the starting state
     for (unsigned int i = 0; i < numChannels; ++i) {
-        m_points[i].append(QPointF(time * us,
-                    (channels[i].on() ? high : low) - i - 1));
+        points[i].append(QPointF(time * us, low - i - 1));
     }
 
-    while (commands[runningLine].type != PulseStateCommand::endProgram &&
-            steps < maxSteps) {
+    // step through the changes in the outputs, exactly as the firmware
+    // works them out
+    ChannelMask newState;
+    bool running = true;
+    while (running && steps < maxSteps) {
         ++steps;
 
-        // calculate the maximum amount of time before a channel changes
-        Microseconds timeStep = forever;
-        for (unsigned int i = 0; i < numChannels; ++i) {
-            timeStep = std::min(timeStep, channels[i].timeUntilNextStateChange());
-        }
+        running = stepper.step(&time, &newState, &setChannels);
 
-        Microseconds commandTimeAvailable = timeStep;
-
-        // if the command finishes, advance to the next command
-        int step = commands[runningLine].execute(
-                    channels, &stack, runningLine,
-                    timeInState, &commandTimeAvailable);
-        if (step != 0) {
-            runningLine += step;
-            timeInState = 0;
-            timeStep -= commandTimeAvailable;
-        } else {
-            timeInState += timeStep;
-        }
-
-        time += timeStep;
-
-        // mark the channel on/off state before the change
         for (unsigned int i = 0; i < numChannels; ++i) {
-            m_points[i].append(QPointF(time * us,
-                        (channels[i].on() ? high : low) - i - 1));
-        }
+            ChannelMask bit = ChannelMask(1) << i;
 
-        // update the channel states
-        for (unsigned int i = 0; i < numChannels; ++i) {
-            channels[i].advanceTime(timeStep);
-        }
-
-        // mark the channel on/off state after the change
-        for (unsigned int i = 0; i < numChannels; ++i) {
-            m_points[i].append(QPointF(time * us,
-                        (channels[i].on() ? high : low) - i - 1));
+            // mark the channel on/off state before and after the change
+            points[i].append(QPointF(time * us,
+                        ((state & bit) ? high : low) - i - 1));
+            points[i].append(QPointF(time * us,
+                        ((newState & bit) ? high : low) - i - 1));
         }
+        state = newState;
     }
 
     // add some extra time before and after the simulation to bracket
     // things nicely
-    float timeStart = std::min(-0.025f * time * us, -1 * us);
-    float timeEnd = std::max(((steps < maxSteps) ? 1.025f : 1) * time * us, 1 * us);
-    m_plot->setAxisScale(QwtPlot::xBottom,  timeStart, timeEnd);
+    simulation.timeStart = std::min(-0.025f * time * us, -1 * us);
+    simulation.timeEnd = std::max(((steps < maxSteps) ? 1.025f : 1) * time * us, 1 * us);
     for (unsigned int i = 0; i < numChannels; ++i) {
-        m_points[i].prepend(QPointF(timeStart, low - i - 1));
-        m_points[i].append(QPointF(time * us, low - i - 1));
-        m_points[i].append(QPointF(timeEnd, low - i - 1));
+        points[i].prepend(QPointF(simulation.timeStart, low - i - 1));
+        points[i].append(QPointF(time * us, low - i - 1));
+        points[i].append(QPointF(simulation.timeEnd, low - i - 1));
     }
 
+    showSimulation(simulation);
+
+    // the cost of a simulation is its number of points
+    m_simulations.insert(key, new SimulationResult(simulation),
+            numChannels * points[0].size());
+}
+
 
+void ProgramGuiWindow::showSimulation(const SimulationResult& simulation) {
     // update the plot
+    m_plot->setAxisScale(QwtPlot::xBottom, simulation.timeStart,
+            simulation.timeEnd);
     for (unsigned int i = 0; i < numChannels; ++i) {
-        m_curves[i]->setSamples(m_points[i]);
+        m_curves[i]->setSamples(simulation.points[i]);
     }
     m_plot->replot();
 
     // display the results in the simulation tab
     m_tabsOutput->setTabEnabled(m_tabsOutput->indexOf(m_plot), true);
     m_tabsOutput->setCurrentIndex(m_tabsOutput->indexOf(m_plot));
-
 }
 
 
@@ -668,6 +1000,59 @@ void ProgramGuiWindow::updateFrequencyControlsRange() {
 
 
 void ProgramGuiWindow::updateEquivalentProgram() {
+    // Each kind of program is a fixed template that refers to the settings
+    // by name, so only the "let" lines giving their values change with the
+    // controls.
+    static const char singlePulseTemplate[] =
+        "# generate a single pulse\n"
+        "turn on channel ch\n"
+        "wait width\n"
+        "turn off channel ch\n"
+        "\n"
+        "end program";
+    static const char oneTrainTemplate[] =
+        "# generate a pulse train\n"
+        "set channel ch to width pulses at rate\n"
+        "wait length\n"
+        "turn off channel ch\n"
+        "\n"
+        "end program";
+    static const char twoTrainsTemplate[] =
+        "# generate the first pulse train\n"
+        "set channel ch to width pulses at rate\n"
+        "wait length\n"
+        "turn off channel ch\n"
+        "\n"
+        "# delay between pulse trains\n"
+        "wait delay\n"
+        "\n"
+        "# generate the second pulse train\n"
+        "set channel ch to width pulses at rate\n"
+        "wait length\n"
+        "turn off channel ch\n"
+        "\n"
+        "end program";
+    static const char trainsTemplate[] =
+        "# The last pulse train isn't followed by a delay, so we use\n"
+        "# a loop to generate all but the last pulse train and the\n"
+        "# delay after each of these pulse trains.\n"
+        "repeat trains - 1 times:\n"
+        "\t# generate a pulse train\n"
+        "\tset channel ch to width pulses at rate\n"
+        "\twait length\n"
+        "\tturn off channel ch\n"
+        "\t\n"
+        "\t# delay between pulse trains\n"
+        "\twait delay\n"
+        "end repeat\n"
+        "\n"
+        "# generate the last pulse train (with no delay after it)\n"
+        "set channel ch to width pulses at rate\n"
+        "wait length\n"
+        "turn off channel ch\n"
+        "\n"
+        "end program";
+
     bool bEnableTrains = m_checkboxPulseTrain->isChecked();
     int channel = m_spinChannel->value();
     double pulseWidth = m_spinPulseWidth->value();
@@ -680,101 +1065,63 @@ void ProgramGuiWindow::updateEquivalentProgram() {
     QString unitsTrainDelay = m_comboTrainDelay->currentText();
     int numTrains = m_spinNumTrains->value();
 
+    QString values =
+        "let ch = " + QString::number(channel) + "\n"
+        "let width = " + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth + "\n";
+    const char* body;
     if (!bEnableTrains) {
-        m_texteditTraditionalProgram->setText(
-                "# generate a single pulse\n"
-                "turn on channel " + QString::number(channel) + "\n"
-                "wait " + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth + "\n"
-                "turn off channel " + QString::number(channel) + "\n"
-                "\n"
-                "end program"
-            );
-    } else if (numTrains == 1) {
-        m_texteditTraditionalProgram->setText(
-                "# generate a pulse train\n"
-                "set channel " + QString::number(channel) + " to "
-                    + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth +
-                    " pulses at "
-                    + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency +
-                    + "\n"
-                "wait " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n"
-                "turn off channel " + QString::number(channel) + "\n"
-                "\n"
-                "end program"
-            );
-    } else if (numTrains == 2) {
-        m_texteditTraditionalProgram->setText(
-                "# generate the first pulse train\n"
-                "set channel " + QString::number(channel) + " to "
-                    + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth +
-                    " pulses at "
-                    + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency +
-                    + "\n"
-                "wait " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n"
-                "turn off channel " + QString::number(channel) + "\n"
-                "\n"
-                "# delay between pulse trains\n"
-                "wait " + QString::number(trainDelay, 'f', 2) + " " + unitsTrainDelay + "\n"
-                "\n"
-                "# generate the second pulse train\n"
-                "set channel " + QString::number(channel) + " to "
-                    + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth +
-                    " pulses at "
-                    + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency +
-                    + "\n"
-                "wait " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n"
-                "turn off channel " + QString::number(channel) + "\n"
-                "\n"
-                "end program"
-            );
+        body = singlePulseTemplate;
     } else {
-        m_texteditTraditionalProgram->setText(
-                "# The last pulse train isn't followed by a delay, so we use\n"
-                "# a loop to generate all but the last pulse train and the\n"
-                "# delay after each of these pulse trains.\n"
-                "repeat " + QString::number(numTrains - 1) + " times:\n"
-                "\t# generate a pulse train\n"
-                "\tset channel " + QString::number(channel) + " to "
-                    + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth +
-                    " pulses at "
-                    + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency +
-                    + "\n"
-                "\twait " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n"
-                "\tturn off channel " + QString::number(channel) + "\n"
-                "\t\n"
-                "\t# delay between pulse trains\n"
-                "\twait " + QString::number(trainDelay, 'f', 2) + " " + unitsTrainDelay + "\n"
-                "end repeat\n"
-                "\n"
-                "# generate the last pulse train (with no delay after it)\n"
-                "set channel " + QString::number(channel) + " to "
-                    + QString::number(pulseWidth, 'f', 2) + " " + unitsPulseWidth +
-                    " pulses at "
-                    + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency +
-                    + "\n"
-                "wait " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n"
-                "turn off channel " + QString::number(channel) + "\n"
-                "\n"
-                "end program"
-            );
+        values +=
+            "let rate = " + QString::number(pulseFrequency, 'f', 2) + " " + unitsPulseFrequency + "\n"
+            "let length = " + QString::number(trainDuration, 'f', 2) + " " + unitsTrainDuration + "\n";
+        if (numTrains == 1) {
+            body = oneTrainTemplate;
+        } else {
+            values += "let delay = " + QString::number(trainDelay, 'f', 2) + " " + unitsTrainDelay + "\n";
+            if (numTrains == 2) {
+                body = twoTrainsTemplate;
+            } else {
+                values += "let trains = " + QString::number(numTrains) + "\n";
+                body = trainsTemplate;
+            }
+        }
     }
+
+    m_texteditTraditionalProgram->setText(values + "\n" + body);
 }
 
 
 void ProgramGuiWindow::run() {
-    // close the serial port, if one is currently open
-    if (m_port) {
-        m_port->close();
-        delete m_port;
-        m_port = NULL;
+    // Ask the device to stop the program, if one is running.  The device
+    // answers between the program's changes, and is then ready for the
+    // next program.
+    // N.B.: this command must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    if (m_running && !m_abortSent) {
+        m_sendBuffer.clear();
+        s_port->write("abort\n");
+        m_abortSent = true;
+        m_buttonRun->setText(forceStopButtonText);
+        return;
+    }
+
+    if (!m_running && s_port && s_portWindow && s_portWindow->m_running &&
+            s_port->portName() == m_comboPort->currentText()) {
+        m_texteditStatus->moveCursor(QTextCursor::End);
+        m_texteditStatus->insertPlainText("\nThe device is running a "
+                "program from another window.\n");
+        return;
+    }
+
+    // If the device doesn't answer, close the serial port (which resets
+    // most Arduinos) and turn off the channels.
+    if (m_running) {
+        closePort();
 
         // discard any remaining commands
         m_sendBuffer.clear();
 
-        // Add a dummy line at the beginning to work around a race condition
-        // when the Arduino resets.
-        m_sendBuffer.push_back("# ArduinoPulseGeneratorGui v1.0");
-
         for (int i = 1; i <= (int)numChannels; ++i) {
             m_sendBuffer.push_back("turn off channel " + QString::number(i));
         }
@@ -782,32 +1129,75 @@ void ProgramGuiWindow::run() {
 
     } else {
         m_buttonRun->setText(interruptButtonText);
+        m_abortSent = false;
 
         // switch to the status tab
         m_tabsOutput->setCurrentIndex(m_tabsOutput->indexOf(m_texteditStatus));
 
-        // read the program from the appropriate tab
-        QStringList lines;
+        m_sendBuffer = programLines();
+
+        highlightRunningLine(-1);
         if (m_tabsProgram->currentIndex() == m_tabsProgram->indexOf(m_texteditProgram)) {
-            m_sendBuffer = m_texteditProgram->toPlainText().split('\n');
+            m_runningEditor = m_texteditProgram;
         } else {
-            m_sendBuffer = m_texteditTraditionalProgram->toPlainText().split('\n');
+            m_runningEditor = m_texteditTraditionalProgram;
         }
+        m_runningSourceLines.clear();
+
+        // warn about timing the device can't meet before sending the
+        // program (parsing errors are reported by the device)
+        CompiledProgram* program = compileProgram(programText(), false);
+        if (program) {
+            m_texteditStatus->moveCursor(QTextCursor::End);
+            m_texteditStatus->insertPlainText(timingReport(program));
+
+            // Run the copy of the program kept on the device, if it has
+            // one; otherwise the device asks for the program, which it
+            // stores for next time.
+            // N.B.: these commands must be kept in sync with
+            // PulseGeneratorFirmware.pde
+            uint32_t hash = program->hash;
+            if (hash == m_storedProgramHash) {
+                hash = m_storedDeviceHash;
+            }
+            m_sendBuffer.push_front("store in slot 0");
+            m_sendBuffer.push_front("run slot 0 if hash " +
+                    QString::number(hash, 16));
+            m_runningProgramHash = program->hash;
+            m_runningSourceLines.resize(program->numCommands);
+            qCopy(program->sourceLines,
+                    program->sourceLines + program->numCommands,
+                    m_runningSourceLines.begin());
+        }
+        m_receivedText.clear();
+        m_serialBuffer.clear();
 
-        // Add a dummy line at the beginning to work around a race condition
-        // when the Arduino resets.
+        // ask for progress reports during the run
+        // N.B.: this command must be kept in sync with
+        // PulseGeneratorFirmware.pde
+        m_sendBuffer.push_front("telemetry every " +
+                QString::number(telemetryInterval) + " ms");
+    }
+    m_running = true;
+
+    // If the port is already open, the device is waiting for the first
+    // line.  Otherwise opening it resets the device, and we wait for it to
+    // prompt us before sending the first line.
+    if (openPort()) {
+        s_port->write((m_sendBuffer.front() + "\n").toUtf8());
+        m_sendBuffer.pop_front();
+    } else if (s_port->isOpen()) {
+        // Add a dummy line at the beginning to work around a race
+        // condition when the Arduino resets.
         m_sendBuffer.push_front("# ArduinoPulseGeneratorGui v1.0");
-
+    } else {
+        m_texteditStatus->moveCursor(QTextCursor::End);
+        m_texteditStatus->insertPlainText("\nUnable to open " +
+                m_comboPort->currentText() + "\n");
+        closePort();
+        m_running = false;
+        m_buttonRun->setText(runButtonText);
     }
-
-    // create the serial port
-    PortSettings settings = {BAUD9600, DATA_8, PAR_NONE, STOP_1, FLOW_OFF, 10};
-    m_port = new QextSerialPort(m_comboPort->currentText(), settings, QextSerialPort::EventDriven);
-
-    QObject::connect(m_port, SIGNAL(readyRead()), SLOT(onNewSerialData()));
-    m_port->open(QIODevice::ReadWrite);
-
-    // wait for the arduino to prompt us before sending the first line.
 }
 
 
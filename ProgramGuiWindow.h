@@ -11,12 +11,59 @@
 #include <QTextStream>
 #include <QTabWidget>
 #include <QDoubleSpinBox>
+#include <QCache>
+#include <QTimer>
 #include <qwt_plot.h>
 #include <qwt_plot_curve.h>
 
+#include "pulseStateMachine.h"
+
 class QextSerialPort;
 class QextSerialEnumerator;
 
+// A parsed and optimized program, kept so an unchanged program doesn't have
+// to be parsed again.  The commands and the source map are kept in a single
+// block of memory, with room for maxCommands of each (see
+// countProgramLines).
+struct CompiledProgram {
+    explicit CompiledProgram(int maxCommands) :
+        numCommands(0), hash(0), timingCosts(NULL) {
+        m_arena = new char[maxCommands *
+            (sizeof(PulseStateCommand) + sizeof(uint16_t))];
+        commands = reinterpret_cast<PulseStateCommand*>(m_arena);
+        sourceLines = reinterpret_cast<uint16_t*>(commands + maxCommands);
+    }
+    ~CompiledProgram() { delete[] m_arena; }
+
+    PulseStateCommand* commands;
+    int numCommands;
+
+    // the source map: the line (counting from 0) each command came from
+    uint16_t* sourceLines;
+
+    // hash of the commands (see hashProgram)
+    uint32_t hash;
+
+    // the expected timing on a board (see reportTiming), and the board's
+    // costs it was worked out with (NULL until it is needed)
+    QString timingReport;
+    const TimingCosts* timingCosts;
+
+private:
+    char* m_arena;
+
+    // (not copyable, since it owns the arena)
+    CompiledProgram(const CompiledProgram&);
+    CompiledProgram& operator=(const CompiledProgram&);
+};
+
+// The plot of a simulated program.
+struct SimulationResult {
+    QVector<QVector<QPointF> > points;
+    float timeStart;
+    float timeEnd;
+};
+
 // A window with a basic text area for entering and editing a program.
 class ProgramGuiWindow : public QWidget
 {
@@ -28,7 +75,6 @@ class ProgramGuiWindow : public QWidget
     // Plot from simulation
     QwtPlot *m_plot;
     QVector<QwtPlotCurve *> m_curves;
-    QVector<QVector<QPointF> > m_points;
 
     // status display
     QTextEdit* m_texteditStatus;
@@ -39,15 +85,34 @@ class ProgramGuiWindow : public QWidget
     QPushButton* m_buttonOpen;
     QPushButton* m_buttonSave;
     QPushButton* m_buttonSimulate;
+    QPushButton* m_buttonSession;
+    QLabel* m_labelBoard;
+    QComboBox* m_comboBoard;
     QLabel* m_labelPort;
     QComboBox* m_comboPort;
     QCheckBox* m_checkboxLock;
     QPushButton* m_buttonRun;
+    QLabel* m_labelProgress;
 
-    // the serial port
-    QextSerialPort* m_port;
+    // The serial port, which is kept open from one run to the next, since
+    // opening it resets most Arduinos (and the device then has to start
+    // again).  It is shared by every program window, and its data goes to
+    // the window that last ran a program on it.
+    static QextSerialPort* s_port;
+    static ProgramGuiWindow* s_portWindow;
     QextSerialEnumerator* m_portEnumerator;
 
+    // true while a program sent from this window is running
+    bool m_running;
+
+    // Makes sure the serial port for the chosen port name is open and
+    // sends its data to this window, returning true if it was already
+    // open (in which case the device is already waiting for a line).
+    bool openPort();
+
+    // closes the serial port, which resets the device
+    static void closePort();
+
     // the tab container
     QTabWidget* m_tabsOutput;
     QTabWidget* m_tabsProgram;
@@ -92,12 +157,81 @@ class ProgramGuiWindow : public QWidget
     // lines buffered to send to the device
     QStringList m_sendBuffer;
 
+    // true once the device has been asked to stop the running program
+    bool m_abortSent;
+
+    // bytes received from the device but not yet handled (i.e. the start
+    // of a telemetry frame)
+    QByteArray m_serialBuffer;
+
+    // fires if the device stops sending telemetry during a run
+    QTimer* m_telemetryTimer;
+
+    // Replaces the parse error codes reported by the device in the status
+    // box (e.g. "error (code 13)") with their messages.
+    void translateErrorCodes();
+
+    // shows the progress reported by a telemetry frame
+    void showTelemetry(const QByteArray& frame);
+
+    // the editor and source map of the program being run, for showing the
+    // line the device has reached
+    QTextEdit* m_runningEditor;
+    QVector<uint16_t> m_runningSourceLines;
+
+    // highlights a line of the running program (or none, if line is -1)
+    void highlightRunningLine(int line);
+
+    // text received from the device since the program was sent
+    QString m_receivedText;
+
+    // The program being run, and the one last stored in the device's
+    // program slot (see pulseGeneratorSlots.h), by their hashes.  The
+    // device's hash is kept as well, since the device may round times
+    // differently when it parses the program.
+    uint32_t m_runningProgramHash;
+    uint32_t m_storedProgramHash;
+    uint32_t m_storedDeviceHash;
+
+    // the program in the current tab, as lines or as UTF-8 text
+    QStringList programLines() const;
+    QByteArray programText() const;
+
+    // Programs that have already been parsed and simulated, keyed by a
+    // hash of their text (see programKey).  Re-running or re-simulating an
+    // unchanged program reuses these.
+    QCache<QByteArray, CompiledProgram> m_compiledPrograms;
+    QCache<QByteArray, SimulationResult> m_simulations;
+
+    // the cache key of a program's text
+    static QByteArray programKey(const QByteArray& text);
+
+    // shows the lines of a program's text, up to the given line, in the
+    // status box
+    void echoProgram(const QByteArray& text, int lastLine);
+
+    // Parses and optimizes a program, or finds it in the cache, returning
+    // NULL if it has an error.  If echo is true, the lines and any error
+    // are shown in the status box.  The result is owned by the cache.
+    CompiledProgram* compileProgram(const QByteArray& text, bool echo);
+
+    // describes the expected timing of a parsed program on a board
+    static QString reportTiming(const PulseStateCommand* commands,
+            int numCommands, const TimingCosts& costs);
+
+    // the expected timing of a compiled program on the selected board
+    const QString& timingReport(CompiledProgram* program);
+
+    // shows a simulation in the plot tab
+    void showSimulation(const SimulationResult& simulation);
+
 private Q_SLOTS:
     void help();
     void newDocument();
     void open();
     void save();
     void simulate();
+    void openSession();
     void run();
 
     void changePulseWidth(int newVal);
@@ -113,6 +247,7 @@ private Q_SLOTS:
     void changeTrainDelay(double newVal);
 
     void onNewSerialData();
+    void onTelemetryTimeout();
     void onLockStateChanged(int state);
     void updateTraditionalDisabledControls();
     void updateFrequencyControlsRange();
@@ -122,6 +257,12 @@ private Q_SLOTS:
 
 public:
     ProgramGuiWindow(QWidget* parent = NULL);
+    ~ProgramGuiWindow();
+
+    // Closes the program windows' serial port if it is the given port, so
+    // that another window can open it, returning false if a program is
+    // running on it.
+    static bool releasePort(const QString& portName);
 
     virtual QSize sizeHint() const;
     void updateProgramName(const QString& name);
@@ -1,135 +1,685 @@
 #include "pulseStateMachine.h"
+#include "pulseGeneratorBoards.h"
+#include "pulseGeneratorCore.h"
+#include "pulseGeneratorSlots.h"
+#ifdef PULSE_OUTPUT_SHIFT_REGISTER
+#include <SPI.h>
+#endif
 
 const int maxInputLength = 80;
 char inputLine[maxInputLength + 1];
 int numChars = 0;
 
 int lineNum = 1;
-const int maxCommands = 200;
+const int maxCommands = Board::maxCommands;
 PulseStateCommand commands[maxCommands];
 int numCommands = 0;
-unsigned repeatDepth = 0;
 
-int channelPins[numChannels] = { 2, 3, 4, 5, 8, 9, 10, 11 };
+// The repeat depth and names of the program being received (or of the
+// standby program, while one is running).
+ParseState parseState;
+
+// the slot the program being received will be stored in once it has run,
+// if any
+const unsigned noSlot = numProgramSlots;
+unsigned storeSlot = noSlot;
+
+// set if the host stopped the last program
+bool aborted = false;
+
+// How the next program starts (see runDeviceCommand): as soon as it has
+// arrived, on a rising edge of the trigger pin, or as soon as it has
+// arrived while raising the sync pin (see pulseGeneratorBoards.h) for any
+// boards waiting on it.
+enum StartMode { startNow, startOnTrigger, startWithSyncPulse };
+StartMode startMode = startNow;
+
+// How far this board's clock drifts from the clock the host times the
+// programs of several boards by, in parts per billion (see
+// ClockCorrection).
+int32_t boardClockDrift = 0;
+
+// The standby program: the next program, received while one is running.
+// It is parsed into whichever end of the command buffer the running program
+// leaves free, and follows the running program without a gap if its "end
+// program" arrives before the running program ends (see
+// ChangeQueue::chain) and doesn't use any channels above the highest one
+// the running program uses (see PulseGeneratorCore::run); otherwise it runs
+// as soon as the running program ends.  It isn't optimized, since that would
+// take too long between changes.
+int activeStart = 0;            // the commands of the running program
+int activeEnd = 0;
+int standbyStart = -1;          // -1 until the first line arrives
+int standbyLimit = 0;
+int numStandbyCommands = 0;
+int standbyLineNum = 1;
+unsigned standbyChannelsUsed = 0;
+bool standbyReady = false;      // true once "end program" has arrived
+
+// Set when a line of the standby program can't be queued: the rest of the
+// program is then read up to its "end program" and dropped, rather than
+// run without the line (even if the running program ends first, and the
+// rest arrives as the program being received).
+bool dropProgram = false;
+
+// Reads the next incoming character (if any), returning true once a
+// complete line has been read into inputLine.
+bool readLine() {
+    if (Serial.available() > 0) {
+        int thisChar = Serial.read();
+        Serial.write(thisChar);
+
+        if (thisChar == '\r' || thisChar == '\n') {
+            inputLine[numChars] = '\0';
+            Serial.println();
+            return true;
+        } else if (numChars < maxInputLength) {
+            inputLine[numChars++] = thisChar;
+        }
+    }
+    return false;
+}
+
+// Telemetry frames report a running program's progress to the host at a
+// low rate ("telemetry every 250 ms").  A frame is binary:
+//
+//      0x1E (the ASCII record separator, which never appears in the text)
+//      the number of bytes from here to the checksum
+//      the index of the running command (2 bytes)
+//      the time since the program started, in microseconds (4 bytes)
+//      the timing precision so far, in microseconds (4 bytes)
+//      the number of repeat loops entered (not counting subroutine calls)
+//      the iterations remaining in each loop, outermost first, for up to
+//          maxTelemetryRepeats loops (4 bytes each)
+//      a checksum: the sum of the bytes after the length, modulo 256
+//
+// with values least significant byte first.  Frames are only sent when
+// there is time to spare before the next change (see SerialHost) and the
+// serial transmit buffer has room for the whole frame, so a frame that
+// doesn't fit yet waits for a later poll.  They are at least
+// minTelemetryInterval apart.  The running command is the one being worked out,
+// which can be a few changes ahead of the outputs.
+// N.B.: This format must be kept in sync with ProgramGuiWindow.cpp
+const uint8_t telemetrySeparator = 0x1E;
+const unsigned maxTelemetryRepeats = 4;
+const Microseconds minTelemetryInterval = 100000;
+Microseconds telemetryInterval = 0;     // 0 if telemetry is off
+Microseconds lastTelemetryTime = 0;
+
+// Sends a value in a telemetry frame, adding it to the checksum.
+void sendTelemetryValue(uint32_t value, uint8_t numBytes,
+        uint8_t* checksum) {
+    for (uint8_t i = 0; i < numBytes; ++i) {
+        uint8_t byte = uint8_t(value >> (8 * i));
+        Serial.write(byte);
+        *checksum += byte;
+    }
+}
+
+// Sends a telemetry frame describing a running program, returning false
+// (without sending anything) if the serial transmit buffer can't take it
+// yet.
+bool sendTelemetry(const RunStatus& status) {
+    const RepeatStack* repeats = status.program->repeats();
+    unsigned depth = 0;
+    for (unsigned i = 0; i < repeats->depth(); ++i) {
+        depth += repeats->isCall(i) ? 0 : 1;
+    }
+    unsigned numRepeats =
+        depth < maxTelemetryRepeats ? depth : maxTelemetryRepeats;
+    uint8_t length = uint8_t(2 + 4 + 4 + 1 + 4 * numRepeats);
+    if (Serial.availableForWrite() < 3 + length) {
+        return false;
+    }
+
+    uint8_t checksum = 0;
+    Serial.write(telemetrySeparator);
+    Serial.write(length);
+    sendTelemetryValue(status.program->commandIndex(), 2, &checksum);
+    sendTelemetryValue(status.elapsed, 4, &checksum);
+    sendTelemetryValue(status.maxError, 4, &checksum);
+    sendTelemetryValue(depth, 1, &checksum);
+    for (unsigned i = 0, sent = 0; sent < numRepeats; ++i) {
+        if (!repeats->isCall(i)) {
+            sendTelemetryValue(repeats->repeatCount(i), 4, &checksum);
+            ++sent;
+        }
+    }
+    Serial.write(checksum);
+    return true;
+}
+
+// Prints a parse error as its code, e.g. " (code 13)".  The messages
+// themselves are only kept by the GUI (see parseErrorMessage), so that they
+// don't take up the RAM of AVR boards.
+// N.B.: This message must be kept in sync with ProgramGuiWindow.cpp
+void printErrorCode(ParseError error) {
+    if (error != parseOk) {
+        Serial.print(F(" (code "));
+        Serial.print(int(error));
+        Serial.print(F(")"));
+    }
+}
+
+// True if a line is the "end program" of a program being dropped (which
+// may be in a repeat or a define that was dropped before it was closed).
+bool endsProgram(const PulseStateCommand& command, ParseError error) {
+    return error == parseOk ? command.type == PulseStateCommand::endProgram :
+        error == errorEndProgramInRepeat || error == errorEndProgramInDefine;
+}
+
+// Drops the rest of a program once its "end program" has arrived (see
+// dropProgram), returning true if the line was the end.
+bool dropProgramLine(const PulseStateCommand& command, ParseError error) {
+    if (!endsProgram(command, error)) {
+        return false;
+    }
+    Serial.println(F("error: program not queued\07"));
+    dropProgram = false;
+    parseState.reset();
+    return true;
+}
+
+// Adds the line in inputLine to the standby program.
+void queueStandbyLine() {
+    if (standbyReady) {
+        Serial.println(F("error: a program is already queued"));
+        return;
+    }
+
+    if (standbyStart < 0) {
+        // use the larger of the gaps around the running program
+        if (activeStart >= maxCommands - activeEnd) {
+            standbyStart = 0;
+            standbyLimit = activeStart;
+        } else {
+            standbyStart = activeEnd;
+            standbyLimit = maxCommands;
+        }
+        numStandbyCommands = 0;
+        standbyLineNum = 1;
+        parseState.reset();
+        standbyChannelsUsed = 0;
+        dropProgram = false;
+    }
+
+    // (a line that is too long isn't parsed, so that it doesn't change
+    // parseState)
+    PulseStateCommand command;
+    bool tooLong = numChars == maxInputLength;
+    ParseError error = (tooLong ? parseOk :
+            command.parseFromString(inputLine, &parseState));
+    if (dropProgram) {
+        if (!tooLong && dropProgramLine(command, error)) {
+            standbyStart = -1;
+            return;
+        }
+        ++standbyLineNum;
+    } else if (error != parseOk || tooLong) {
+        Serial.print(F("error: line "));
+        Serial.print(standbyLineNum);
+        Serial.print(F(" not queued"));
+        printErrorCode(error);
+        Serial.println();
+        dropProgram = true;
+    } else if (command.type == PulseStateCommand::endProgram) {
+        Serial.println(F("queued"));
+        standbyReady = true;
+        return;
+    } else if (command.type != PulseStateCommand::noOp) {
+        if (standbyStart + numStandbyCommands >= standbyLimit) {
+            Serial.println(F("error: no room to queue the program"));
+            dropProgram = true;
+        } else {
+            commands[standbyStart + numStandbyCommands] = command;
+            if (command.lastChannel() > standbyChannelsUsed) {
+                standbyChannelsUsed = command.lastChannel();
+            }
+            ++numStandbyCommands;
+        }
+        ++standbyLineNum;
+    }
+
+    Serial.print(standbyLineNum);
+    Serial.print(F(": "));
+}
+
+// Reads commands from the serial port while a program is running (see
+// NoHost in pulseGeneratorCore.h): "abort", "status", or the lines of the
+// next program, which is queued to follow the running one.
+// N.B.: These commands and messages must be kept in sync with
+// ProgramGuiWindow.cpp and SessionWindow.cpp
+struct SerialHost {
+    // Enough time (in microseconds) to read a character and answer a
+    // command without delaying the next change.  Nothing is printed unless
+    // the serial transmit buffer has room for all of it, so that printing
+    // never waits for the port: a character is only read once there's room
+    // for its echo, or for maxAnswerLength bytes if it ends a line (the
+    // echo and the answer to "status", the longest answer), and telemetry
+    // frames wait for room in the same way (see sendTelemetry).
+    enum { pollTime = 1000, maxAnswerLength = 48 };
+
+    static bool poll(Microseconds timeLeft, const RunStatus& status) {
+        if (timeLeft < pollTime) {
+            return true;
+        }
+
+        if (telemetryInterval != 0 &&
+                status.elapsed - lastTelemetryTime >= telemetryInterval &&
+                sendTelemetry(status)) {
+            lastTelemetryTime = status.elapsed;
+            return true;
+        }
+
+        int next = Serial.peek();
+        if (next < 0 || Serial.availableForWrite() <
+                (next == '\r' || next == '\n' ? maxAnswerLength : 1)) {
+            return true;
+        }
+        if (!readLine()) {
+            return true;
+        }
+
+        bool keepRunning = true;
+        if (strcmp_P(inputLine, PSTR("abort")) == 0) {
+            aborted = true;
+            keepRunning = false;
+        } else if (strcmp_P(inputLine, PSTR("status")) == 0) {
+            Serial.print(F("running "));
+            Serial.print(status.elapsed / 1000);
+            Serial.print(F(" ms, precision "));
+            Serial.print(status.maxError);
+            Serial.println(F(" us"));
+        } else if (numChars != 0) {
+            queueStandbyLine();
+        }
+
+        numChars = 0;
+        return keepRunning;
+    }
+
+    // Waits for the trigger pin if the program was armed with "start on
+    // trigger"; the host can still ask for the status, queue the next
+    // program or abort meanwhile.  The start is checked for every few
+    // microseconds, so boards waiting on the same line start within a few
+    // microseconds of each other.
+    static bool start() {
+        StartMode mode = startMode;
+        startMode = startNow;
+
+        if (mode == startWithSyncPulse) {
+            digitalWrite(Board::syncPin, HIGH);
+        } else if (mode == startOnTrigger) {
+            Serial.println(F("waiting for trigger"));
+
+            // (a line that is already high has to go low first, so that
+            // only a new edge starts the program)
+            bool low = false;
+            for (;;) {
+                if (digitalRead(Board::triggerPin) == LOW) {
+                    low = true;
+                } else if (low) {
+                    break;
+                }
+
+                if (!readLine()) {
+                    continue;
+                }
+                if (strcmp_P(inputLine, PSTR("abort")) == 0) {
+                    numChars = 0;
+                    aborted = true;
+                    return false;
+                } else if (strcmp_P(inputLine, PSTR("status")) == 0) {
+                    Serial.println(F("waiting for trigger"));
+                } else if (numChars != 0) {
+                    queueStandbyLine();
+                }
+                numChars = 0;
+            }
+        }
+        return true;
+    }
+
+    static int32_t clockDrift() {
+        return boardClockDrift;
+    }
+
+    static bool nextProgram(unsigned maxChannel,
+            const PulseStateCommand** next, int* numNext) {
+        if (!standbyReady || standbyChannelsUsed > maxChannel) {
+            return false;
+        }
+
+        *next = commands + standbyStart;
+        *numNext = numStandbyCommands;
+        activeStart = standbyStart;
+        activeEnd = standbyStart + numStandbyCommands;
+        standbyStart = -1;
+        standbyReady = false;
+        return true;
+    }
+};
+
+// the run loop, specialised for this board's channels and outputs
+#ifdef PULSE_OUTPUT_SHIFT_REGISTER
+typedef PulseGeneratorCore<numChannels, Board, ShiftRegisterOutputs,
+        SerialHost> Core;
+#else
+typedef PulseGeneratorCore<numChannels, Board, PinOutputs, SerialHost> Core;
+#endif
+
+// Returns the text following prefix if the text starts with it, or NULL.
+// The prefix is kept in flash (see PSTR).
+const char* skipPrefix(const char* text, const char* prefix) {
+    for (char c; (c = pgm_read_byte(prefix)) != '\0'; ++prefix) {
+        if (*text++ != c) {
+            return NULL;
+        }
+    }
+    return text;
+}
+
+// Reads a number in the given base (10 or 16), returning the text
+// following it or NULL if there isn't a number.
+const char* readNumber(const char* text, uint8_t base, uint32_t* result) {
+    const char* start = text;
+    *result = 0;
+    for (;; ++text) {
+        uint8_t digit;
+        if (*text >= '0' && *text <= '9') {
+            digit = *text - '0';
+        } else if (base == 16 && *text >= 'a' && *text <= 'f') {
+            digit = *text - 'a' + 10;
+        } else if (base == 16 && *text >= 'A' && *text <= 'F') {
+            digit = *text - 'A' + 10;
+        } else {
+            break;
+        }
+        *result = *result * base + digit;
+    }
+    return text == start ? NULL : text;
+}
+
+// Stores the program that has just run in a slot (see "store in slot"),
+// unless the programs that followed it have overwritten it.
+void storeProgram(unsigned slot, int numStored, uint32_t hash) {
+    if (hashProgram(commands, numStored) != hash) {
+        return;
+    }
+    if (ProgramSlots::store(slot, commands, numStored, hash)) {
+        Serial.print(F("stored in slot "));
+        Serial.print(slot);
+        Serial.print(F(" (hash "));
+        Serial.print(hash, HEX);
+        Serial.println(F(")"));
+    } else {
+        Serial.print(F("program too long to store (max "));
+        Serial.print(int(ProgramSlots::maxCommands));
+        Serial.println(F(" commands per slot)"));
+    }
+}
+
+// Runs the parsed program in the command buffer (and any programs queued
+// to follow it) and reports how it went.  The program is stored in the
+// given slot (or noSlot) once it has run, since writing the EEPROM of AVR
+// boards takes up to a few seconds, which would otherwise delay its start.
+void runBufferedProgram(unsigned slot) {
+    int numStored = numCommands;
+    uint32_t hash = (slot != noSlot ? hashProgram(commands, numCommands) : 0);
+    for (;;) {
+        Serial.println(F("Running program..."));
+
+        activeStart = 0;
+        activeEnd = numCommands;
+        standbyStart = -1;
+        standbyReady = false;
+        aborted = false;
+        lastTelemetryTime = 0;
+        // (the line that started the program, e.g. "end program", is
+        // still in inputLine, and the lines read while it runs mustn't be
+        // added to it)
+        numChars = 0;
+        Microseconds maxError = Core::run(commands, numCommands);
+        digitalWrite(Board::syncPin, LOW);
+
+        if (slot != noSlot) {
+            storeProgram(slot, numStored, hash);
+            slot = noSlot;
+        }
+
+        lineNum = 1;
+        numCommands = 0;
+        // N.B.: These messages must be kept in sync with
+        // ProgramGuiWindow.cpp
+        if (aborted) {
+            Serial.print(F("aborted."));
+        } else {
+            Serial.print(F("done."));
+        }
+        Serial.print(F("  (timing precision was better than "));
+        Serial.print(maxError);
+        Serial.println(F(" microseconds)\07"));
+
+        if (standbyStart < 0 || aborted) {
+            parseState.reset();
+            dropProgram = false;
+            return;
+        }
+
+        // A program queued too late to follow without a gap (or only
+        // partly received) becomes the program being received.  (The
+        // commands of a program being dropped are already gone.)
+        if (!dropProgram) {
+            for (int i = 0; i < numStandbyCommands; ++i) {
+                commands[i] = commands[standbyStart + i];
+            }
+            numCommands = numStandbyCommands;
+        }
+        lineNum = standbyLineNum;
+
+        if (!standbyReady) {
+            return;
+        }
+        numCommands = optimizeProgram(commands, numCommands);
+    }
+}
+
+// Handles the commands that aren't part of a program, returning false if
+// the line isn't one of them.  "abort" discards the program being
+// received, and "telemetry" sets how often telemetry frames are sent.  The
+// commands for the program slots (see pulseGeneratorSlots.h) and for how
+// the next program starts are only accepted before the first line of a
+// program.
+//
+// Several boards are run as one by a host (see SessionWindow.cpp):
+//      "clock"                 - answers with the board's clock (micros())
+//                                when the line arrived, e.g.
+//                                "clock 12345678"
+//      "clock drift N ppb"     - times programs by the host's reference
+//                                clock, which this board's clock runs
+//                                N parts per billion faster than (N can
+//                                be negative; 0 turns the correction off)
+//      "start on trigger"      - the next program waits for a rising edge
+//                                on the trigger pin before it starts
+//      "start with sync pulse" - the next program raises the sync pin as
+//                                it starts (and lowers it when it ends)
+// N.B.: These commands and messages must be kept in sync with
+// ProgramGuiWindow.cpp and SessionWindow.cpp
+bool runDeviceCommand(const char* line) {
+    const char* rest;
+    uint32_t slot;
+    uint32_t hash;
+
+    if (strcmp_P(line, PSTR("abort")) == 0) {
+        lineNum = 1;
+        numCommands = 0;
+        parseState.reset();
+        dropProgram = false;
+        storeSlot = noSlot;
+        startMode = startNow;
+        Serial.println(F("aborted.\07"));
+        return true;
+    }
+
+    if (strcmp_P(line, PSTR("status")) == 0) {
+        Serial.println(F("waiting for a program"));
+        return true;
+    }
+
+    uint32_t interval;
+    if ((rest = skipPrefix(line, PSTR("telemetry every "))) &&
+            (rest = readNumber(rest, 10, &interval)) &&
+            strcmp_P(rest, PSTR(" ms")) == 0 && interval <= 3600000UL) {
+        telemetryInterval = interval * 1000;
+        if (telemetryInterval < minTelemetryInterval) {
+            telemetryInterval = minTelemetryInterval;
+        }
+        Serial.print(F("telemetry every "));
+        Serial.print(telemetryInterval / 1000);
+        Serial.println(F(" ms"));
+        return true;
+    }
+
+    if (strcmp_P(line, PSTR("telemetry off")) == 0) {
+        telemetryInterval = 0;
+        Serial.println(F("telemetry off"));
+        return true;
+    }
+
+    if (strcmp_P(line, PSTR("clock")) == 0) {
+        Microseconds now = micros();
+        Serial.print(F("clock "));
+        Serial.println(now);
+        return true;
+    }
+
+    if ((rest = skipPrefix(line, PSTR("clock drift ")))) {
+        bool slow = (*rest == '-');
+        uint32_t drift;
+        if ((rest = readNumber(rest + (slow ? 1 : 0), 10, &drift)) &&
+                strcmp_P(rest, PSTR(" ppb")) == 0 &&
+                drift <= uint32_t(ClockCorrection::maxDrift)) {
+            boardClockDrift = slow ? -int32_t(drift) : int32_t(drift);
+            Serial.print(F("clock drift "));
+            Serial.print(boardClockDrift);
+            Serial.println(F(" ppb"));
+            return true;
+        }
+    }
+
+    if (numCommands != 0 || dropProgram) {
+        return false;
+    }
+
+    if ((rest = skipPrefix(line, PSTR("run slot "))) &&
+            (rest = readNumber(rest, 10, &slot)) &&
+            (rest = skipPrefix(rest, PSTR(" if hash "))) &&
+            (rest = readNumber(rest, 16, &hash)) && *rest == '\0') {
+        if (ProgramSlots::load(slot, hash, commands, maxCommands,
+                    &numCommands)) {
+            runBufferedProgram(noSlot);
+        } else {
+            // not an error: the host just has to send the program
+            Serial.print(F("slot "));
+            Serial.print(slot);
+            Serial.println(F(" doesn't hold that program"));
+        }
+        return true;
+    }
+
+    if (strcmp_P(line, PSTR("start on trigger")) == 0) {
+        startMode = startOnTrigger;
+        Serial.println(F("starting on trigger"));
+        return true;
+    }
+
+    if (strcmp_P(line, PSTR("start with sync pulse")) == 0) {
+        startMode = startWithSyncPulse;
+        Serial.println(F("starting with sync pulse"));
+        return true;
+    }
+
+    if ((rest = skipPrefix(line, PSTR("store in slot "))) &&
+            (rest = readNumber(rest, 10, &slot)) && *rest == '\0') {
+        if (slot < numProgramSlots) {
+            storeSlot = slot;
+        } else {
+            Serial.print(F("error: there are only "));
+            Serial.print(numProgramSlots);
+            Serial.println(F(" program slots\07"));
+        }
+        return true;
+    }
+
+    return false;
+}
 
 void setup() {
     // set up the pins as outputs
-    for (unsigned int i = 0; i < numChannels; ++i) {
-        pinMode(channelPins[i], OUTPUT);
-    }
+    Core::setup();
+
+    // and the pins for starting several boards together
+    pinMode(Board::triggerPin, INPUT);
+    pinMode(Board::syncPin, OUTPUT);
+    digitalWrite(Board::syncPin, LOW);
 
     // set up the serial port
     Serial.begin(9600);
     while (!Serial) {  // wait needed on Arduino Leonardo
     }
 
-    Serial.print("1: ");
+    Serial.print(F("1: "));
 }
 
 void loop() {
     // get any incoming bytes until we have a complete line:
-    if (Serial.available() > 0) {
-        int thisChar = Serial.read();
-        Serial.write(thisChar);
-
-
-        // if we have a complete line...
-        if (thisChar == '\r' || thisChar == '\n') {
-            inputLine[numChars] = '\0';
-
-            Serial.println();
-
-            if (numChars == maxInputLength) {
-                Serial.print("Line too long (must be shorter than ");
-                Serial.print(maxInputLength);
-                Serial.println(" characters)\07");
-            } else {
-                const char* error = NULL;
-                commands[numCommands].parseFromString(inputLine, &error, &repeatDepth);
-
-                if (error) {
-                    Serial.print("error: ");
-                    Serial.print(error);
-                    Serial.println("\07");
-                } else if (commands[numCommands].type == PulseStateCommand::endProgram) {
-                    // run the program
-                    Serial.println("Running program...");
-
-                    PulseChannel channels[numChannels];
-                    RepeatStack stack;
-                    int runningCommandIndex = 0;
-                    Microseconds prevTime = micros();
-                    Microseconds timeInState = 0;
-
-                    Microseconds maxError = 0;
-                    while (runningCommandIndex < numCommands) {
-                        Microseconds newTime = micros();
-                        Microseconds timeAvailable = newTime - prevTime;
-                        Microseconds lastTimeAvailable = timeAvailable;
-
-                        // track the maximum iteration length
-                        if (timeAvailable > maxError) {
-                            maxError = timeAvailable;
-                        }
-
-                        // update the channel states
-                        for (unsigned int i = 0; i < numChannels; ++i) {
-                            channels[i].advanceTime(timeAvailable);
-                        }
-
-                        int step;
-
-                        // run commands until we're out of time
-                        while (0 != (step = commands[runningCommandIndex].execute(
-                                    channels, &stack, runningCommandIndex,
-                                    timeInState, &timeAvailable))) {
-                            runningCommandIndex += step;
-                            timeInState = 0;
-                            lastTimeAvailable = timeAvailable;
-                        }
-                        timeInState += lastTimeAvailable;
-
-                        // update the pins
-                        for (unsigned int i = 0; i < numChannels; ++i) {
-                            digitalWrite(channelPins[i], channels[i].on() ? HIGH : LOW);
-                        }
-
-                        prevTime = newTime;
-                    }
-
-                    // turn off all of the pins
-                    for (unsigned int i = 0; i < numChannels; ++i) {
-                        digitalWrite(channelPins[i], LOW);
-                    }
+    if (readLine()) {
+        if (numChars == maxInputLength) {
+            Serial.print(F("Line too long (must be shorter than "));
+            Serial.print(maxInputLength);
+            Serial.println(F(" characters)\07"));
+        } else if (runDeviceCommand(inputLine)) {
+            // (not part of the program, see runDeviceCommand)
+        } else {
+            ParseError error = commands[numCommands].parseFromString(
+                    inputLine, &parseState);
 
+            if (dropProgram) {
+                if (dropProgramLine(commands[numCommands], error)) {
                     lineNum = 1;
-                    numCommands = 0;
-                    // N.B.: This message must be kept in sync with
-                    // ProgramGuiWindow.cpp
-                    Serial.print("done.  (timing precision was better than ");
-                    Serial.print(maxError);
-                    Serial.println(" microseconds)\07");
-
-                } else if (numCommands == maxCommands - 1) {
-                    Serial.print("error: program too long (max ");
-                    Serial.print(maxCommands);
-                    Serial.println(" commands)\07");
-                    lineNum = 1;
-                    numCommands = 0;
-                    repeatDepth = 0;
-                } else if (commands[numCommands].type == PulseStateCommand::noOp) {
-                    lineNum++;
                 } else {
                     lineNum++;
-                    numCommands++;
                 }
-            }
+            } else if (error != parseOk) {
+                Serial.print(F("error"));
+                printErrorCode(error);
+                Serial.println(F("\07"));
+            } else if (commands[numCommands].type == PulseStateCommand::endProgram) {
+                numCommands = optimizeProgram(commands, numCommands);
+                parseState.reset();
 
-            numChars = 0;
-            Serial.print(lineNum);
-            Serial.print(": ");
-        } else if (numChars < maxInputLength) {
-            inputLine[numChars++] = thisChar;
+                unsigned slot = storeSlot;
+                storeSlot = noSlot;
+                runBufferedProgram(slot);
+
+            } else if (numCommands == maxCommands - 1) {
+                Serial.print(F("error: program too long (max "));
+                Serial.print(maxCommands);
+                Serial.println(F(" commands)\07"));
+                lineNum = 1;
+                numCommands = 0;
+                parseState.reset();
+                storeSlot = noSlot;
+            } else if (commands[numCommands].type == PulseStateCommand::noOp) {
+                lineNum++;
+            } else {
+                lineNum++;
+                numCommands++;
+            }
         }
+
+        numChars = 0;
+        Serial.print(lineNum);
+        Serial.print(F(": "));
     }
 }
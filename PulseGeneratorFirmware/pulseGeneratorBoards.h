@@ -0,0 +1,96 @@
+#ifndef PULSEGENERATORBOARDS_H
+#define PULSEGENERATORBOARDS_H
+#include <stdint.h>
+#include "pulseStateMachine.h"
+
+// Compile-time descriptions of the boards the firmware runs on.  The board
+// is chosen by the Makefile (e.g. "make uno" defines PULSE_BOARD_UNO), or
+// guessed from the processor type when building from the Arduino IDE.
+//
+// Each board provides:
+//      maxChannels - the number of entries in its pin map
+//      maxCommands - the length of the command buffer that fits in its RAM
+//      pin(i)      - the output pin for channel i + 1
+//      latchPin    - the latch (RCLK) pin for shift register outputs
+//      triggerPin  - the input that starts a program armed with "start on
+//                    trigger" (on a rising edge)
+//      syncPin     - the output raised when a program armed with "start
+//                    with sync pulse" starts, and lowered when it ends
+//
+// Several boards can be started together by wiring their trigger pins to
+// one trigger line, or to the sync pin of one of them (see
+// PulseGeneratorFirmware.pde).  The trigger and sync pins are the same on
+// every board, and clear of the channel pins and the SPI pins.
+//
+// pin() is only ever called with constant arguments, so the lookup is
+// folded away by the compiler.
+
+#if !defined(PULSE_BOARD_MEGA) && !defined(PULSE_BOARD_DUE) && \
+        !defined(PULSE_BOARD_UNO)
+#   if defined(__SAM3X8E__)
+#       define PULSE_BOARD_DUE
+#   elif defined(__AVR_ATmega328P__)
+#       define PULSE_BOARD_UNO
+#   else
+#       define PULSE_BOARD_MEGA
+#   endif
+#endif
+
+
+// Arduino Mega 2560 (8 KB of RAM)
+struct MegaBoard {
+    enum { maxChannels = 8, maxCommands = 200, latchPin = 53,
+        triggerPin = 7, syncPin = 6 };
+
+    static uint8_t pin(unsigned channel) {
+        static const uint8_t pins[maxChannels] = { 2, 3, 4, 5, 8, 9, 10, 11 };
+        return pins[channel];
+    }
+};
+
+
+// Arduino Due (96 KB of RAM).  The first eight channels use the same pins as
+// the Mega; the rest continue along the double header row.
+struct DueBoard {
+    enum { maxChannels = 32, maxCommands = 1000, latchPin = 52,
+        triggerPin = 7, syncPin = 6 };
+
+    static uint8_t pin(unsigned channel) {
+        static const uint8_t pins[maxChannels] = {
+            2, 3, 4, 5, 8, 9, 10, 11,
+            22, 23, 24, 25, 26, 27, 28, 29,
+            30, 31, 32, 33, 34, 35, 36, 37,
+            38, 39, 40, 41, 42, 43, 44, 45
+        };
+        return pins[channel];
+    }
+};
+
+
+// Arduino Uno (2 KB of RAM, so only a short program fits)
+struct UnoBoard {
+    enum { maxChannels = 8, maxCommands = 60, latchPin = 10,
+        triggerPin = 7, syncPin = 6 };
+
+    static uint8_t pin(unsigned channel) {
+        static const uint8_t pins[maxChannels] = { 2, 3, 4, 5, 8, 9, 10, 11 };
+        return pins[channel];
+    }
+};
+
+
+#if defined(PULSE_BOARD_DUE)
+typedef DueBoard Board;
+#elif defined(PULSE_BOARD_UNO)
+typedef UnoBoard Board;
+#else
+typedef MegaBoard Board;
+#endif
+
+#ifndef PULSE_OUTPUT_SHIFT_REGISTER
+// fails to compile if PULSE_NUM_CHANNELS is larger than the board's pin map
+typedef char boardHasPinForEveryChannel[
+    (numChannels <= unsigned(Board::maxChannels)) ? 1 : -1];
+#endif
+
+#endif /* PULSEGENERATORBOARDS_H */
@@ -0,0 +1,264 @@
+#ifndef PULSEGENERATORCORE_H
+#define PULSEGENERATORCORE_H
+#include <Arduino.h>
+#include "pulseStateMachine.h"
+#include "pulseGeneratorOutputs.h"
+
+// The firmware's run loop, specialised at compile time on the number of
+// channels, the board's pin map and the output backend (see
+// pulseGeneratorOutputs.h).  A program is run by the smallest
+// specialisation that covers every channel it uses, so unused channels cost
+// nothing in the loop.
+
+
+// How far a running program has got, for the host's status queries.
+struct RunStatus {
+    Microseconds elapsed;       // time since the program started
+    Microseconds maxError;      // the timing precision so far
+
+    // the program, as far as it has been worked out (i.e. up to a few
+    // changes ahead of the outputs)
+    const ProgramStepper* program;
+};
+
+// The host is given the time between changes that the run loop doesn't
+// need, so that it can e.g. read commands from the serial port while a
+// program runs.  A host provides:
+//
+//      poll(timeLeft, status)  - do a small, bounded amount of work, given
+//                                the time left until the next change (0 if
+//                                there is no time to spare), returning
+//                                false to stop the program.
+//      nextProgram(maxChannel, &commands, &numCommands)
+//                              - hand over a program to run as soon as the
+//                                current one ends, with no gap between
+//                                them, returning false if there isn't one
+//                                or it uses channels above maxChannel (the
+//                                channels the run loop was specialised for).
+//      start()                 - called once the first changes have been
+//                                worked out, just before the program's
+//                                clock starts (e.g. to wait for a start
+//                                trigger), returning false to stop the
+//                                program before it starts.
+//      clockDrift()            - the drift of the board's clock to correct
+//                                the program's timing for (see
+//                                ClockCorrection), or 0 for none.
+//
+// This host does nothing with the time, so programs always run to
+// completion, as soon as they are given and on the board's own clock.
+struct NoHost {
+    static bool poll(Microseconds, const RunStatus&) {
+        return true;
+    }
+    static bool nextProgram(unsigned, const PulseStateCommand**, int*) {
+        return false;
+    }
+    static bool start() {
+        return true;
+    }
+    static int32_t clockDrift() {
+        return 0;
+    }
+};
+
+
+// Runs a program that only uses the first Count channels, returning the
+// longest delay between the time an output should have changed and the
+// time it was written (i.e. the timing precision).
+//
+// The commands are run ahead of time to fill a short queue of upcoming
+// changes (see ChangeQueue) whenever there is time to spare, so when the
+// time of a change comes, all that is left to do is to write the outputs;
+// a burst of commands never delays an edge.  The one exception is a change
+// in which channels are set and the backend may be able to generate their
+// trains in hardware: the queue isn't filled past such a change until it
+// has been applied, since handing a train to the hardware changes how the
+// following changes are worked out.  Once the queue is full, the time left
+// before the next change is offered to the Host, and once the program has
+// been worked out to its end, the Host's next program is chained on to it.
+//
+// If the Host gives a clock drift, the program's time is corrected for it
+// (and trains are never handed to the hardware, which would keep to the
+// board's uncorrected clock).
+template <unsigned Count, class Board,
+         template <unsigned, class> class Outputs, class Host>
+Microseconds runProgram(const PulseStateCommand* commands, int numCommands) {
+    typedef Outputs<Count, Board> Channels;
+
+    ClockCorrection clock(Host::clockDrift());
+    const bool trains = Channels::hasTrains && clock.exact();
+
+    ChangeQueue queue(commands, numCommands, trains);
+
+    // work out the first changes before starting the clock
+    while (queue.canFill()) {
+        queue.fill();
+    }
+
+    // the set of pins currently driven high
+    ChannelMask outputs = 0;
+
+    // time of the last change applied
+    Microseconds lastChangeTime = 0;
+
+    if (!Host::start()) {
+        return 0;
+    }
+
+    Microseconds startTime = micros();
+    RunStatus status = { 0, 0, queue.program() };
+    while (!queue.finished()) {
+        Microseconds timeLeft = 0;
+        status.elapsed = clock.correct(micros() - startTime);
+
+        if (queue.ready()) {
+            const PendingChange& change = queue.next();
+
+            // (written to be safe when micros() wraps around)
+            if (status.elapsed - lastChangeTime <
+                    change.time - lastChangeTime) {
+                timeLeft = change.time - status.elapsed;
+            } else {
+                ChannelMask state = change.state;
+
+                if (trains && change.startsProgram) {
+                    // the previous program's trains end with it
+                    for (unsigned i = 0; i < Count; ++i) {
+                        Channels::stopTrain(i);
+                    }
+                }
+
+                if (trains && change.setChannels) {
+                    // the queue stopped here, so the program's channel
+                    // settings are the ones set by this change
+                    ChannelBank* channels = queue.program()->channels();
+                    for (unsigned i = 0; i < Count; ++i) {
+                        ChannelMask bit = ChannelMask(1) << i;
+                        if (!(change.setChannels & bit)) {
+                            continue;
+                        }
+                        if (!channels->regular(i)) {
+                            // Poisson pulses and ramps are worked out by
+                            // the program, so take the channel back from
+                            // the hardware (its parked copy kept the
+                            // train's phase, so state carries it on)
+                            Channels::stopTrain(i);
+                        } else if (Channels::startTrain(i,
+                                    channels->onTime(i),
+                                    channels->offTime(i))) {
+                            // the hardware has the train; keep the
+                            // program's copy of the channel parked (and
+                            // its output low)
+                            channels->park(i);
+                            state &= ~bit;
+                            outputs &= ~bit;
+                        }
+                    }
+                }
+
+                if (state != outputs) {
+                    Channels::write(state ^ outputs, state);
+                    outputs = state;
+                }
+
+                Microseconds error =
+                    clock.correct(micros() - startTime) - change.time;
+                if (error > status.maxError) {
+                    status.maxError = error;
+                }
+
+                lastChangeTime = change.time;
+                queue.pop();
+                continue;
+            }
+        }
+
+        // work out the next change while waiting for this one, or let
+        // the host have the time if there's nothing left to work out
+        const PulseStateCommand* nextCommands;
+        int numNextCommands;
+        if (queue.canFill()) {
+            queue.fill();
+        } else if (queue.canChain() &&
+                Host::nextProgram(Count, &nextCommands, &numNextCommands)) {
+            queue.chain(nextCommands, numNextCommands);
+        } else if (!Host::poll(timeLeft, status)) {
+            break;
+        }
+    }
+
+    // turn off all of the pins
+    Channels::clear();
+
+    return status.maxError;
+}
+
+
+// Picks the smallest specialisation of runProgram (halving the channel
+// count each time) that still covers channelsUsed, for outputs whose cost
+// grows with the channel count (see Outputs::scalesWithCount).  Other
+// outputs always run the program with every channel, so the smaller
+// specialisations would only take up flash.
+template <unsigned Count, class Board,
+         template <unsigned, class> class Outputs, class Host,
+         bool Scales = Outputs<Count, Board>::scalesWithCount>
+struct ProgramDispatch {
+    static Microseconds run(const PulseStateCommand* commands,
+            int numCommands, unsigned channelsUsed) {
+        if (channelsUsed <= Count / 2) {
+            return ProgramDispatch<Count / 2, Board, Outputs, Host>::run(
+                    commands, numCommands, channelsUsed);
+        }
+        return runProgram<Count, Board, Outputs, Host>(commands,
+                numCommands);
+    }
+};
+
+template <class Board, template <unsigned, class> class Outputs,
+         class Host>
+struct ProgramDispatch<1, Board, Outputs, Host, true> {
+    static Microseconds run(const PulseStateCommand* commands,
+            int numCommands, unsigned) {
+        return runProgram<1, Board, Outputs, Host>(commands, numCommands);
+    }
+};
+
+template <unsigned Count, class Board,
+         template <unsigned, class> class Outputs, class Host>
+struct ProgramDispatch<Count, Board, Outputs, Host, false> {
+    static Microseconds run(const PulseStateCommand* commands,
+            int numCommands, unsigned) {
+        return runProgram<Count, Board, Outputs, Host>(commands,
+                numCommands);
+    }
+};
+
+
+template <unsigned NumChannels, class Board,
+         template <unsigned, class> class Outputs = PinOutputs,
+         class Host = NoHost>
+class PulseGeneratorCore {
+    public:
+        // Configures the outputs for all of the channels (initially low).
+        static void setup() {
+            Outputs<NumChannels, Board>::setup();
+        }
+
+        // Runs a parsed program to completion (or until the host stops
+        // it), returning the timing precision achieved (in microseconds).
+        static Microseconds run(const PulseStateCommand* commands,
+                int numCommands) {
+            // find the highest numbered channel the program uses
+            unsigned channelsUsed = 0;
+            for (int i = 0; i < numCommands; ++i) {
+                if (commands[i].lastChannel() > channelsUsed) {
+                    channelsUsed = commands[i].lastChannel();
+                }
+            }
+
+            return ProgramDispatch<NumChannels, Board, Outputs, Host>::run(
+                    commands, numCommands, channelsUsed);
+        }
+};
+
+#endif /* PULSEGENERATORCORE_H */
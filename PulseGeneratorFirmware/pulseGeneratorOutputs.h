@@ -0,0 +1,134 @@
+#ifndef PULSEGENERATOROUTPUTS_H
+#define PULSEGENERATOROUTPUTS_H
+#include <Arduino.h>
+#include "pulseStateMachine.h"
+#include "pulseGeneratorTimers.h"
+
+// Output backends for the firmware's run loop.  Each backend drives the
+// first Count channels of a board and provides:
+//
+//      setup()               - configure the outputs, all channels low
+//      write(changed, state) - make the outputs match state; changed is the
+//                              set of channels that differ from the last
+//                              write
+//      clear()               - set all channels low
+//      hasTrains             - true if startTrain can ever succeed
+//      scalesWithCount       - true if write() costs more for a larger
+//                              Count, so that a program is run with just
+//                              the channels it uses (see ProgramDispatch)
+//      startTrain(i, on, off)
+//                            - generate a steady train on channel i + 1 in
+//                              hardware if possible, returning false if the
+//                              run loop has to generate it instead.  The
+//                              channel's output is left low as far as
+//                              write() is concerned.
+//      stopTrain(i)          - hand channel i + 1 back to the run loop
+//                              (low), if it was generating a train
+
+
+// Drives each channel from its own pin on the board (see Board::pin).  The
+// per-channel work is unrolled at compile time.  Steady trains on pins with
+// a free timer output are generated by the timer (see
+// pulseGeneratorTimers.h).
+template <unsigned Count, class Board>
+struct PinOutputs {
+    enum { index = Count - 1, hasTrains = TimerPulseTrains::available,
+        scalesWithCount = true };
+
+    static ChannelMask bit() { return ChannelMask(1) << index; }
+
+    static void setup() {
+        PinOutputs<Count - 1, Board>::setup();
+        pinMode(Board::pin(index), OUTPUT);
+        digitalWrite(Board::pin(index), LOW);
+    }
+
+    // update the pins of the channels in changed to match state
+    static void write(ChannelMask changed, ChannelMask state) {
+        PinOutputs<Count - 1, Board>::write(changed, state);
+        if (changed & bit()) {
+            digitalWrite(Board::pin(index), (state & bit()) ? HIGH : LOW);
+        }
+    }
+
+    static void clear() {
+        PinOutputs<Count - 1, Board>::clear();
+        TimerPulseTrains::stop(index, Board::pin(index));
+        digitalWrite(Board::pin(index), LOW);
+    }
+
+    static bool startTrain(unsigned channel, Microseconds onTime,
+            Microseconds offTime) {
+        TimerPulseTrains::stop(channel, Board::pin(channel));
+        return TimerPulseTrains::start(channel, Board::pin(channel),
+                onTime, offTime);
+    }
+
+    static void stopTrain(unsigned channel) {
+        TimerPulseTrains::stop(channel, Board::pin(channel));
+    }
+};
+
+template <class Board>
+struct PinOutputs<0, Board> {
+    static void setup() {}
+    static void write(ChannelMask, ChannelMask) {}
+    static void clear() {}
+};
+
+
+#ifdef PULSE_OUTPUT_SHIFT_REGISTER
+#include <SPI.h>
+
+// Clocks the channel states out over SPI to a daisy chain of 74HC595 (or
+// similar) shift registers, then pulses Board::latchPin so that every
+// channel switches on the same latch edge.  Channels 1-8 are Q0-Q7 of the
+// register wired to the Arduino, channels 9-16 the next register along the
+// chain, and so on.
+//
+// The whole chain has to be shifted on every update, so this always sends
+// numChannels bits however many channels the program uses.  The transfer
+// happens inside the run loop, so its cost is part of the measured
+// iteration time (and therefore of the timing precision that is reported).
+template <unsigned Count, class Board>
+struct ShiftRegisterOutputs {
+    enum { numBytes = (numChannels + 7) / 8, hasTrains = false,
+        scalesWithCount = false };
+
+    static void setup() {
+        pinMode(Board::latchPin, OUTPUT);
+        digitalWrite(Board::latchPin, LOW);
+
+        SPI.begin();
+        SPI.setBitOrder(MSBFIRST);
+        SPI.setDataMode(SPI_MODE0);
+        SPI.setClockDivider(SPI_CLOCK_DIV2);
+
+        clear();
+    }
+
+    static void write(ChannelMask, ChannelMask state) {
+        // the highest channels go first so they end up furthest along
+        for (int i = numBytes - 1; i >= 0; --i) {
+            SPI.transfer(uint8_t(state >> (8 * i)));
+        }
+
+        digitalWrite(Board::latchPin, HIGH);
+        digitalWrite(Board::latchPin, LOW);
+    }
+
+    static void clear() {
+        write(0, 0);
+    }
+
+    // the registers are clocked from the run loop, so there's no hardware
+    // to hand a train to
+    static bool startTrain(unsigned, Microseconds, Microseconds) {
+        return false;
+    }
+
+    static void stopTrain(unsigned) {}
+};
+#endif
+
+#endif /* PULSEGENERATOROUTPUTS_H */
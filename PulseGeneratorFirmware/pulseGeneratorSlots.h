@@ -0,0 +1,119 @@
+#ifndef PULSEGENERATORSLOTS_H
+#define PULSEGENERATORSLOTS_H
+#include <Arduino.h>
+#include <string.h>
+#include "pulseStateMachine.h"
+
+// Program slots keep programs on the device, so that the host can run a
+// program again without sending it again.  Each slot holds an optimized
+// program and its hashProgram(); the host asks for a slot to be run only if
+// it holds the program with a given hash (e.g. "run slot 0 if hash
+// 1a2b3c4d"), and sends the program again if it doesn't.
+//
+// On AVR boards the slots are kept in EEPROM, since opening the serial port
+// resets the board and clears its RAM.  Only the bytes that change are
+// written, so storing the same program again doesn't wear out the EEPROM.
+// Other boards (i.e. the Due, which has no EEPROM) keep the slots in RAM,
+// which is cleared whenever the port is opened (the GUI keeps its port open
+// from one run to the next, so the slots last as long as it does).
+
+const unsigned numProgramSlots = 4;
+
+#if defined(__AVR__)
+#include <avr/eeprom.h>
+
+struct SlotMemory {
+    enum { size = E2END + 1 };
+
+    static void read(unsigned address, void* data, unsigned length) {
+        eeprom_read_block(data, (const void*)(uintptr_t)address, length);
+    }
+    static void write(unsigned address, const void* data, unsigned length) {
+        eeprom_update_block(data, (void*)(uintptr_t)address, length);
+    }
+};
+
+#else
+
+struct SlotMemory {
+    enum { size = 16384 };
+
+    static uint8_t* bytes() {
+        static uint8_t memory[size];
+        return memory;
+    }
+    static void read(unsigned address, void* data, unsigned length) {
+        memcpy(data, bytes() + address, length);
+    }
+    static void write(unsigned address, const void* data, unsigned length) {
+        memcpy(bytes() + address, data, length);
+    }
+};
+
+#endif
+
+class ProgramSlots {
+    private:
+        struct Header {
+            uint32_t hash;
+            uint16_t numCommands;
+        };
+
+        enum { slotBytes = SlotMemory::size / numProgramSlots };
+
+    public:
+        // the longest program that fits in a slot
+        enum { maxCommands =
+            (slotBytes - sizeof(Header)) / sizeof(PulseStateCommand) };
+
+        // Stores an (optimized) program in a slot, returning false if the
+        // slot doesn't exist or the program doesn't fit.
+        static bool store(unsigned slot, const PulseStateCommand* commands,
+                int numCommands, uint32_t hash) {
+            if (slot >= numProgramSlots || numCommands > maxCommands) {
+                return false;
+            }
+
+            // The header is written last, so a store that is cut short
+            // leaves the old header with the new commands, which fails the
+            // hash check in load().
+            unsigned address = slot * slotBytes;
+            Header header = { hash, uint16_t(numCommands) };
+            SlotMemory::write(address + sizeof(Header), commands,
+                    numCommands * sizeof(PulseStateCommand));
+            SlotMemory::write(address, &header, sizeof(Header));
+            return true;
+        }
+
+        // Loads the program in a slot into the given buffer if it has the
+        // given hash, returning false (with the buffer's contents undefined)
+        // if it doesn't.
+        static bool load(unsigned slot, uint32_t hash,
+                PulseStateCommand* commands, int maxLength,
+                int* numCommands) {
+            if (slot >= numProgramSlots) {
+                return false;
+            }
+
+            unsigned address = slot * slotBytes;
+            Header header;
+            SlotMemory::read(address, &header, sizeof(Header));
+            if (header.hash != hash || header.numCommands > maxCommands ||
+                    header.numCommands > maxLength) {
+                return false;
+            }
+
+            // check the commands themselves, in case they were stored by a
+            // different version of the firmware (or never stored at all)
+            SlotMemory::read(address + sizeof(Header), commands,
+                    header.numCommands * sizeof(PulseStateCommand));
+            if (hashProgram(commands, header.numCommands) != hash) {
+                return false;
+            }
+
+            *numCommands = header.numCommands;
+            return true;
+        }
+};
+
+#endif /* PULSEGENERATORSLOTS_H */
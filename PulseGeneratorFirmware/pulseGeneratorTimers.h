@@ -0,0 +1,190 @@
+#ifndef PULSEGENERATORTIMERS_H
+#define PULSEGENERATORTIMERS_H
+#include <Arduino.h>
+#include "pulseStateMachine.h"
+
+// Hands steady pulse trains (e.g. "set channel 1 to 10 ms pulses at 10 Hz")
+// to the AVR's 16-bit timers when the channel's pin is one of a timer's
+// output compare pins.  The timer then generates the train in fast PWM
+// mode, so the edges have no jitter and cost no CPU time; the run loop
+// only has to handle the remaining channels and the commands.
+//
+// A train is only handed over when the timer can reproduce the requested
+// on and off times exactly (in whole timer ticks, with the smallest
+// prescaler that fits the period), so that the hardware train doesn't
+// drift relative to the rest of the program.  Each timer can only
+// generate one train at a time, and timer 0 (used by micros()) and the
+// 8-bit timers are never used.  Define PULSE_NO_TIMER_OUTPUTS to disable
+// this altogether.
+//
+// The first rising edge comes one timer tick after the train is started
+// (at most 64 us, with the largest prescaler).
+
+#if defined(__AVR__) && !defined(PULSE_NO_TIMER_OUTPUTS)
+
+class TimerPulseTrains {
+    public:
+        enum { available = true };
+
+    private:
+        // the registers controlling one output compare pin
+        struct Output {
+            uint8_t timer;                  // e.g. 3 for timer 3
+            volatile uint8_t* tccrA;
+            volatile uint8_t* tccrB;
+            volatile uint16_t* icr;
+            volatile uint16_t* tcnt;
+            volatile uint16_t* ocr;
+            uint8_t comBit;                 // COMnx1 for this pin
+        };
+
+        enum { numTimers = 6, noChannel = 0xFF };
+
+        // the longest time that can be converted to CPU cycles without
+        // overflowing 32 bits (about 268 s at 16 MHz)
+        static const Microseconds maxTime =
+            0xFFFFFFFFUL / (F_CPU / 1000000UL);
+
+        // the channel currently using each timer (indexed by timer number)
+        static uint8_t* owners() {
+            static uint8_t owner[numTimers] = {
+                noChannel, noChannel, noChannel,
+                noChannel, noChannel, noChannel
+            };
+            return owner;
+        }
+
+        // find the registers for a pin, returning false if the pin isn't
+        // connected to an output compare unit of a 16-bit timer.
+        static bool lookup(uint8_t pin, Output* output) {
+            switch (digitalPinToTimer(pin)) {
+#define PULSE_TIMER_OUTPUT(N, X) \
+                case TIMER##N##X: { \
+                    Output o = { N, &TCCR##N##A, &TCCR##N##B, &ICR##N, \
+                        &TCNT##N, &OCR##N##X, COM##N##X##1 }; \
+                    *output = o; \
+                    return true; \
+                }
+#if defined(TCCR1A)
+                PULSE_TIMER_OUTPUT(1, A)
+                PULSE_TIMER_OUTPUT(1, B)
+#endif
+#if defined(OCR1C)
+                PULSE_TIMER_OUTPUT(1, C)
+#endif
+#if defined(TCCR3A)
+                PULSE_TIMER_OUTPUT(3, A)
+                PULSE_TIMER_OUTPUT(3, B)
+                PULSE_TIMER_OUTPUT(3, C)
+#endif
+#if defined(TCCR4A)
+                PULSE_TIMER_OUTPUT(4, A)
+                PULSE_TIMER_OUTPUT(4, B)
+                PULSE_TIMER_OUTPUT(4, C)
+#endif
+#if defined(TCCR5A)
+                PULSE_TIMER_OUTPUT(5, A)
+                PULSE_TIMER_OUTPUT(5, B)
+                PULSE_TIMER_OUTPUT(5, C)
+#endif
+#undef PULSE_TIMER_OUTPUT
+                default:
+                    return false;
+            }
+        }
+
+        // Convert a time to timer ticks with the given prescaler, returning
+        // 0 if it isn't a whole number of ticks or doesn't fit the timer.
+        static uint32_t ticks(Microseconds time, uint16_t prescaler) {
+            if (time > maxTime) {
+                return 0;
+            }
+            uint32_t cycles = time * (F_CPU / 1000000UL);
+            if (cycles % prescaler != 0 || cycles / prescaler > 0x10000UL) {
+                return 0;
+            }
+            return cycles / prescaler;
+        }
+
+    public:
+        // Start generating a train on the channel's pin, returning false
+        // (and leaving the pin alone) if the hardware can't do it.
+        static bool start(uint8_t channel, uint8_t pin, Microseconds onTime,
+                Microseconds offTime) {
+            static const uint16_t prescalers[] = { 1, 8, 64, 256, 1024 };
+
+            Output output;
+            if (onTime == 0 || offTime == 0 || onTime > maxTime ||
+                    offTime > maxTime - onTime || !lookup(pin, &output)) {
+                return false;
+            }
+
+            uint8_t owner = owners()[output.timer];
+            if (owner != noChannel && owner != channel) {
+                return false;
+            }
+
+            // use the finest prescaler that fits the period
+            uint8_t clockSelect = 0;
+            uint32_t periodTicks = 0;
+            uint32_t onTicks = 0;
+            for (uint8_t i = 0; i < 5 && clockSelect == 0; ++i) {
+                if ((onTime + offTime) * (F_CPU / 1000000UL) / prescalers[i]
+                        <= 0x10000UL) {
+                    periodTicks = ticks(onTime + offTime, prescalers[i]);
+                    onTicks = ticks(onTime, prescalers[i]);
+                    if (periodTicks == 0 || onTicks == 0) {
+                        return false;
+                    }
+                    clockSelect = i + 1;
+                }
+            }
+            if (clockSelect == 0) {
+                return false;
+            }
+
+            digitalWrite(pin, LOW);
+            uint8_t oldSREG = SREG;
+            cli();
+
+            // fast PWM with TOP = ICRn (mode 14), non-inverting output,
+            // starting at TOP so the first rising edge is on the next tick
+            *output.tccrB = 0;
+            *output.tccrA = _BV(output.comBit) | _BV(WGM11);
+            *output.icr = periodTicks - 1;
+            *output.ocr = onTicks - 1;
+            *output.tcnt = periodTicks - 1;
+            *output.tccrB = _BV(WGM13) | _BV(WGM12) | clockSelect;
+
+            SREG = oldSREG;
+            owners()[output.timer] = channel;
+            return true;
+        }
+
+        // Stop the train on a channel (if any), leaving its pin low.
+        static void stop(uint8_t channel, uint8_t pin) {
+            Output output;
+            if (lookup(pin, &output) && owners()[output.timer] == channel) {
+                *output.tccrB = 0;
+                *output.tccrA = 0;
+                owners()[output.timer] = noChannel;
+            }
+        }
+};
+
+#else
+
+// No timer outputs on this board: every train is generated in software.
+class TimerPulseTrains {
+    public:
+        enum { available = false };
+
+        static bool start(uint8_t, uint8_t, Microseconds, Microseconds) {
+            return false;
+        }
+        static void stop(uint8_t, uint8_t) {}
+};
+
+#endif
+
+#endif /* PULSEGENERATORTIMERS_H */
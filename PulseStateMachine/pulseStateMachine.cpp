@@ -1,50 +1,626 @@
 #include "pulseStateMachine.h"
 #include <stddef.h>
+#include <string.h>
+
+// used to build error messages that mention the number of channels
+#define STRINGIFY_VALUE(x) STRINGIFY(x)
+#define STRINGIFY(x) #x
+
+// Tables that are only read (e.g. the keywords) are kept in flash on AVR
+// boards, which have to read them with pgm_read_byte or pgm_read_word.
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define PULSE_PROGMEM PROGMEM
+static char readProgmemChar(const char* c) { return pgm_read_byte(c); }
+static uint16_t readProgmemWord(const uint16_t* w) { return pgm_read_word(w); }
+#else
+#define PULSE_PROGMEM
+static char readProgmemChar(const char* c) { return *c; }
+static uint16_t readProgmemWord(const uint16_t* w) { return *w; }
+#endif
+
+
+// log2(1 + i / 256) for i from 0 to 255, in 1/65536ths
+static const uint16_t log2Table[256] PULSE_PROGMEM = {
+        0,   369,   736,  1102,  1466,  1829,  2190,  2551,
+     2909,  3267,  3623,  3978,  4331,  4683,  5034,  5384,
+     5732,  6079,  6425,  6769,  7112,  7454,  7795,  8134,
+     8473,  8810,  9146,  9480,  9814, 10146, 10477, 10807,
+    11136, 11464, 11791, 12116, 12440, 12764, 13086, 13407,
+    13727, 14046, 14363, 14680, 14996, 15310, 15624, 15937,
+    16248, 16559, 16868, 17177, 17484, 17791, 18096, 18401,
+    18704, 19007, 19308, 19609, 19909, 20207, 20505, 20802,
+    21098, 21393, 21687, 21980, 22272, 22564, 22854, 23144,
+    23433, 23720, 24007, 24293, 24579, 24863, 25146, 25429,
+    25711, 25992, 26272, 26551, 26830, 27108, 27384, 27660,
+    27936, 28210, 28484, 28757, 29029, 29300, 29571, 29840,
+    30109, 30378, 30645, 30912, 31178, 31443, 31707, 31971,
+    32234, 32496, 32758, 33019, 33279, 33538, 33797, 34055,
+    34312, 34569, 34825, 35080, 35334, 35588, 35841, 36094,
+    36346, 36597, 36847, 37097, 37346, 37595, 37842, 38090,
+    38336, 38582, 38827, 39072, 39316, 39559, 39802, 40044,
+    40286, 40527, 40767, 41006, 41246, 41484, 41722, 41959,
+    42196, 42432, 42667, 42902, 43137, 43370, 43603, 43836,
+    44068, 44300, 44530, 44761, 44990, 45220, 45448, 45676,
+    45904, 46131, 46357, 46583, 46809, 47034, 47258, 47482,
+    47705, 47928, 48150, 48372, 48593, 48813, 49034, 49253,
+    49472, 49691, 49909, 50127, 50344, 50560, 50776, 50992,
+    51207, 51422, 51636, 51850, 52063, 52276, 52488, 52700,
+    52911, 53122, 53332, 53542, 53751, 53960, 54169, 54377,
+    54584, 54791, 54998, 55204, 55410, 55615, 55820, 56025,
+    56229, 56432, 56635, 56838, 57040, 57242, 57443, 57644,
+    57845, 58045, 58245, 58444, 58643, 58841, 59039, 59237,
+    59434, 59631, 59827, 60023, 60219, 60414, 60609, 60803,
+    60997, 61190, 61384, 61576, 61769, 61961, 62152, 62343,
+    62534, 62725, 62915, 63104, 63294, 63483, 63671, 63859,
+    64047, 64234, 64421, 64608, 64794, 64980, 65166, 65351
+};
 
 
-PulseChannel::PulseChannel()
-    : m_on(false), m_timeInState(0)
-{
-    m_stateTime[false] = forever;
-    m_stateTime[true] = 0;
+Microseconds RandomGenerator::exponential(Microseconds mean) {
+    // -ln(u) for u = n / 2^24 uniform in (0, 1], from the top 24 bits of
+    // the next number.  This is worked out in whole numbers (in 2^-24ths)
+    // rather than floating point, whose precision differs between the
+    // boards and the simulator: log2(n) is the position of n's top bit
+    // plus the log of the bits below it, interpolated from log2Table.
+    uint32_t n = (next() >> 8) + 1;
+    unsigned top = 24;
+    while (!(n >> top)) {
+        --top;
+    }
+    uint32_t bits = top > 0 ? (n << (24 - top)) & 0xFFFFFF : 0;
+    unsigned i = bits >> 16;
+    uint32_t fraction = bits & 0xFFFF;
+    uint32_t low = readProgmemWord(&log2Table[i]);
+    uint32_t high = i < 255 ? readProgmemWord(&log2Table[i + 1]) : 65536;
+    uint32_t log2n = (uint32_t(top) << 24) + (low << 8) +
+        (((high - low) * fraction + 0x80) >> 8);
+
+    // -ln(u) = (24 - log2(n)) ln(2), with ln(2) in 2^-32nds
+    uint32_t minusLog = uint32_t(
+            (uint64_t((24UL << 24) - log2n) * 2977044472UL + 0x80000000UL)
+            >> 32);
+    uint64_t time = (uint64_t(mean) * minusLog) >> 24;
+    if (time < 1) {
+        return 1;
+    }
+    return time < forever - 1 ? Microseconds(time) : forever - 1;
 }
 
 
-void PulseChannel::setOnOffTime(Microseconds on, Microseconds off) {
-    m_stateTime[true] = on;
-    m_stateTime[false] = off;
-    m_on = on > 0;
-    m_timeInState = 0;
+ChannelBank::ChannelBank() {
+    reset();
+}
+
+
+void ChannelBank::reset() {
+    m_on = 0;
+    m_active = 0;
+    m_parked = 0;
+    m_parkedSkipping = 0;
+    m_poisson = 0;
+    m_random = RandomGenerator();
+    m_ramping = 0;
+    m_rampWidth = 0;
+    m_burst = 0;
+    m_paired = 0;
+    m_secondPhase = 0;
+    m_betweenPhases = 0;
+    m_now = 0;
+    m_heapSize = 0;
+    for (unsigned i = 0; i < numChannels; ++i) {
+        m_onTime[i] = 0;
+        m_offTime[i] = forever;
+        m_changeTime[i] = 0;
+    }
+}
+
+
+void ChannelBank::heapSet(unsigned position, unsigned channel) {
+    m_heap[position] = channel;
+    m_heapPosition[channel] = position;
 }
 
 
-void PulseChannel::advanceTime(Microseconds dt) {
-    m_timeInState += dt;
+void ChannelBank::siftUp(unsigned position) {
+    unsigned channel = m_heap[position];
+    while (position > 0) {
+        unsigned parent = (position - 1) / 2;
+        if (timeLeft(m_heap[parent]) <= timeLeft(channel)) {
+            break;
+        }
+        heapSet(position, m_heap[parent]);
+        position = parent;
+    }
+    heapSet(position, channel);
+}
+
 
-    while (m_timeInState >= m_stateTime[m_on]) {
-        m_timeInState -= m_stateTime[m_on];
-        m_on = !m_on;
+void ChannelBank::siftDown(unsigned position) {
+    unsigned channel = m_heap[position];
+    for (;;) {
+        unsigned child = 2 * position + 1;
+        if (child >= m_heapSize) {
+            break;
+        }
+        if (child + 1 < m_heapSize &&
+                timeLeft(m_heap[child + 1]) < timeLeft(m_heap[child])) {
+            ++child;
+        }
+        if (timeLeft(channel) <= timeLeft(m_heap[child])) {
+            break;
+        }
+        heapSet(position, m_heap[child]);
+        position = child;
     }
+    heapSet(position, channel);
 }
 
 
-Microseconds PulseChannel::timeUntilNextStateChange() const {
-    return m_stateTime[m_on] - m_timeInState;
+// add a channel to the heap, or move it if it's already there
+void ChannelBank::schedule(unsigned channel, Microseconds changeTime) {
+    m_changeTime[channel] = changeTime;
+
+    if (m_active & bit(channel)) {
+        siftUp(m_heapPosition[channel]);
+        siftDown(m_heapPosition[channel]);
+    } else {
+        m_active |= bit(channel);
+        heapSet(m_heapSize, channel);
+        ++m_heapSize;
+        siftUp(m_heapSize - 1);
+    }
 }
 
 
+// remove a channel from the heap, if it's there
+void ChannelBank::unschedule(unsigned channel) {
+    if (!(m_active & bit(channel))) {
+        return;
+    }
+    m_active &= ~bit(channel);
+
+    // fill the gap with the last channel in the heap
+    unsigned position = m_heapPosition[channel];
+    --m_heapSize;
+    if (position < m_heapSize) {
+        unsigned moved = m_heap[m_heapSize];
+        heapSet(position, moved);
+        siftUp(position);
+        siftDown(m_heapPosition[moved]);
+    }
+}
+
 
-static bool consumeToken(const char* token, const char* input, int* index) {
-    int i = 0;
-    while (token[i] != 0) {
-        if (token[i] != input[*index + i]) {
-            return false; // mismatch
+void ChannelBank::setOnOffTime(unsigned channel, Microseconds on,
+        Microseconds off, bool poisson) {
+    if (on == 0 && off == 0) {
+        // a zero length period would never finish; treat it as "off"
+        off = forever;
+    }
+
+    unpair(channel);
+    m_parked &= ~bit(channel);
+    m_parkedSkipping &= ~bit(channel);
+    if (poisson && on != 0 && on != forever && off != forever) {
+        m_poisson |= bit(channel);
+    } else {
+        m_poisson &= ~bit(channel);
+    }
+    m_ramping &= ~bit(channel);
+    m_burst &= ~bit(channel);
+
+    m_onTime[channel] = on;
+    m_offTime[channel] = off;
+
+    if (on > 0) {
+        m_on |= bit(channel);
+    } else {
+        m_on &= ~bit(channel);
+    }
+
+    Microseconds duration = stateTime(channel, on > 0, m_now);
+    if (duration == forever) {
+        unschedule(channel);
+    } else {
+        schedule(channel, m_now + duration);
+    }
+}
+
+
+void ChannelBank::rampTo(unsigned channel, Microseconds target,
+        Microseconds time, bool width) {
+    Microseconds on = m_onTime[channel];
+    Microseconds off = m_offTime[channel];
+    if (on == 0 || on == forever || off == 0 || off == forever) {
+        // not pulsing
+        return;
+    }
+
+    m_rampFrom[channel] = width ? on : on + off;
+    m_rampTo[channel] = target;
+    m_rampStart[channel] = m_now;
+    m_rampLength[channel] = time;
+    m_ramping |= bit(channel);
+    if (width) {
+        m_rampWidth |= bit(channel);
+    } else {
+        m_rampWidth &= ~bit(channel);
+    }
+
+    resume(channel);
+}
+
+
+void ChannelBank::updateRamp(unsigned channel, Microseconds start) {
+    Microseconds elapsed = start - m_rampStart[channel];
+    Microseconds from = m_rampFrom[channel];
+    Microseconds to = m_rampTo[channel];
+    bool width = (m_rampWidth & bit(channel)) != 0;
+
+    Microseconds value = to;
+    if (elapsed < m_rampLength[channel]) {
+        if (width) {
+            // (in whole microseconds; the product fits in 64 bits)
+            uint64_t change = uint64_t(from < to ? to - from : from - to) *
+                elapsed / m_rampLength[channel];
+            value = from < to ? from + Microseconds(change) :
+                from - Microseconds(change);
+        } else {
+            // the frequency, 1 / period, moves linearly from 1 / from to
+            // 1 / to
+            double fraction = double(elapsed) / m_rampLength[channel];
+            value = Microseconds(double(from) * to /
+                    (to + (double(from) - to) * fraction) + 0.5);
+        }
+    } else {
+        m_ramping &= ~bit(channel);
+    }
+
+    // (always leaving a gap between the pulses)
+    if (width) {
+        Microseconds period = m_onTime[channel] + m_offTime[channel];
+        if (value >= period) {
+            value = period - 1;
         }
-        i++;
+        m_onTime[channel] = value;
+        m_offTime[channel] = period - value;
+    } else {
+        m_offTime[channel] =
+            value > m_onTime[channel] ? value - m_onTime[channel] : 1;
     }
+}
 
-    *index += i;
-    return true;
+
+void ChannelBank::burst(unsigned channel, uint16_t pulses,
+        Microseconds period) {
+    Microseconds on = m_onTime[channel];
+    Microseconds off = m_offTime[channel];
+    if (on == 0 || on == forever || off == 0 || off == forever ||
+            pulses == 0 || (m_poisson & bit(channel))) {
+        return;
+    }
+
+    m_burst |= bit(channel);
+    m_burstPulses[channel] = pulses;
+    m_burstLeft[channel] = pulses;
+    m_burstPeriod[channel] = period;
+    resume(channel);
+}
+
+
+Microseconds ChannelBank::burstGap(unsigned channel) const {
+    // (from the start of the burst to the end of its last pulse, which
+    // may not fit in 32 bits)
+    uint64_t length = uint64_t(m_burstPulses[channel] - 1) *
+        (m_onTime[channel] + m_offTime[channel]) + m_onTime[channel];
+    if (length >= m_burstPeriod[channel]) {
+        return m_offTime[channel];
+    }
+    return m_burstPeriod[channel] - Microseconds(length);
+}
+
+
+void ChannelBank::pair(unsigned first, unsigned second, Microseconds gap) {
+    Microseconds on = m_onTime[first];
+    Microseconds off = m_offTime[first];
+    if (on == 0 || on == forever || off == 0 || off == forever ||
+            first == second) {
+        return;
+    }
+
+    unpair(first);
+    setOnOffTime(second, 0, forever);
+    m_paired |= bit(first);
+    m_secondPhase |= bit(second);
+    m_betweenPhases &= ~bit(first);
+    m_partner[first] = second;
+    m_pairGap[first] = gap;
+    resume(first);
+}
+
+
+void ChannelBank::unpair(unsigned channel) {
+    if (m_secondPhase & bit(channel)) {
+        for (unsigned i = 0; i < numChannels; ++i) {
+            if ((m_paired & bit(i)) && m_partner[i] == channel) {
+                channel = i;
+                break;
+            }
+        }
+    }
+    if (!(m_paired & bit(channel))) {
+        return;
+    }
+
+    // (the first phase channel carries on as a plain train)
+    unsigned second = m_partner[channel];
+    m_paired &= ~bit(channel);
+    m_betweenPhases &= ~bit(channel);
+    m_secondPhase &= ~bit(second);
+    m_on &= ~bit(second);
+}
+
+
+Microseconds ChannelBank::nextState(unsigned channel, Microseconds start) {
+    if (!(m_paired & bit(channel))) {
+        m_on ^= bit(channel);
+        return stateTime(channel, (m_on & bit(channel)) != 0, start);
+    }
+
+    // a pair goes through the first phase, the gap, the second phase and
+    // the rest of the period
+    unsigned second = m_partner[channel];
+    Microseconds width = m_onTime[channel];
+    Microseconds gap = m_pairGap[channel];
+    if (m_on & bit(channel)) {
+        m_on &= ~bit(channel);
+        m_betweenPhases |= bit(channel);
+
+        // (the period's off time is drawn here, once per period)
+        Microseconds off = stateTime(channel, false, start);
+        m_pairRest[channel] = off > gap && off - gap > width ?
+            off - gap - width : 0;
+        return gap;
+    } else if (m_betweenPhases & bit(channel)) {
+        m_betweenPhases &= ~bit(channel);
+        m_on |= bit(second);
+        return width;
+    } else if (m_on & bit(second)) {
+        m_on &= ~bit(second);
+        return m_pairRest[channel];
+    } else {
+        m_on |= bit(channel);
+        return stateTime(channel, true, start);
+    }
+}
+
+
+void ChannelBank::park(unsigned channel) {
+    if (regular(channel)) {
+        m_parked |= bit(channel) & m_active;
+    }
+}
+
+
+void ChannelBank::resume(unsigned channel) {
+    if (!(m_parked & bit(channel))) {
+        return;
+    }
+    m_parked &= ~bit(channel);
+    if (!(m_parkedSkipping & bit(channel))) {
+        // (it's still in the state it was parked in)
+        return;
+    }
+    m_parkedSkipping &= ~bit(channel);
+
+    // The channel's changes are at its next change time, the on or off
+    // time before that, a period before that and so on, so find the one
+    // just after now.  (Its settings are still the plain on and off times
+    // here; any new ramp or bursts start with the next state.)
+    Microseconds on = m_onTime[channel];
+    Microseconds off = m_offTime[channel];
+    Microseconds period = on + off;
+    Microseconds left = timeLeft(channel);
+    if (period > on && left > period) {
+        left = (left - 1) % period + 1;
+    }
+    Microseconds length = (m_on & bit(channel)) ? on : off;
+    if (left > length) {
+        m_on ^= bit(channel);
+        left -= length;
+    }
+    schedule(channel, m_now + left);
+}
+
+
+Microseconds ChannelBank::parkedSkip(unsigned channel,
+        Microseconds overshoot) const {
+    uint64_t period = uint64_t(m_onTime[channel]) + m_offTime[channel];
+    uint64_t skip = (overshoot / period + 1) * period;
+    if (skip < parkedStride) {
+        skip = parkedStride - parkedStride % period;
+    }
+    return Microseconds(skip);
+}
+
+
+void ChannelBank::advanceTime(Microseconds dt) {
+    // handle the state changes in order until the next one is after dt
+    while (m_heapSize > 0 && timeLeft(m_heap[0]) <= dt) {
+        unsigned channel = m_heap[0];
+
+        // one or more state changes happen during dt
+        Microseconds start = m_changeTime[channel];
+        Microseconds overshoot = dt - timeLeft(channel);
+        Microseconds duration = nextState(channel, start);
+
+        // (a parked channel only has to keep its phase, so from here on it
+        // jumps by whole periods, leaving its state as it was)
+        Microseconds period = m_onTime[channel] + m_offTime[channel];
+        if ((m_parked & bit(channel)) && period > m_onTime[channel] &&
+                period < parkedStride) {
+            m_parkedSkipping |= bit(channel);
+            m_changeTime[channel] = m_now + dt - overshoot + duration +
+                parkedSkip(channel, overshoot);
+            siftDown(0);
+            continue;
+        }
+        while (overshoot >= duration) {
+            overshoot -= duration;
+            start += duration;
+            duration = nextState(channel, start);
+        }
+
+        if (duration == forever) {
+            unschedule(channel);
+        } else {
+            m_changeTime[channel] = m_now + dt - overshoot + duration;
+            siftDown(0);
+        }
+    }
+
+    m_now += dt;
+}
+
+
+
+// Keywords in the program language, in the order of the keywords table.
+enum Keyword {
+    keywordEnd,
+    keywordProgram,
+    keywordRepeat,
+    keywordTimes,
+    keywordSet,
+    keywordChannel,
+    keywordTo,
+    keywordPulses,
+    keywordAt,
+    keywordEvery,
+    keywordTurn,
+    keywordOn,
+    keywordOff,
+    keywordWait,
+    keywordLet,
+    keywordDefine,
+    keywordCall,
+    keywordRandom,
+    keywordPoisson,
+    keywordSeed,
+    keywordRamp,
+    keywordOver,
+    keywordBurst,
+    keywordPair,
+    keywordWith,
+    keywordAfter,
+    keywordUs,
+    keywordMicrosecondsLatin1,
+    keywordMicrosecondsUtf8,
+    keywordMuSecondsUtf8,
+    keywordMs,
+    keywordS,
+    keywordHz,
+    keywordKHz,
+    numKeywords,
+    notAKeyword = numKeywords
+};
+
+// The spelling of each keyword.  On AVR boards the table is kept in flash
+// rather than copied into the (much smaller) RAM.
+const unsigned maxKeywordLength = 8;
+static const char keywords[numKeywords][maxKeywordLength] PULSE_PROGMEM = {
+    "end",
+    "program",
+    "repeat",
+    "times",
+    "set",
+    "channel",
+    "to",
+    "pulses",
+    "at",
+    "every",
+    "turn",
+    "on",
+    "off",
+    "wait",
+    "let",
+    "define",
+    "call",
+    "random",
+    "poisson",
+    "seed",
+    "ramp",
+    "over",
+    "burst",
+    "pair",
+    "with",
+    "after",
+    "us",
+    "\xB5s",     // latin 1 micro
+    "\xC2\xB5s", // utf8 micro
+    "\xCE\xBCs", // utf8 greek mu
+    "ms",
+    "s",
+    "Hz",
+    "kHz"
+};
+
+// Finds the keyword spelled by the given characters.
+static Keyword findKeyword(const char* word, unsigned length) {
+    if (length >= maxKeywordLength) {
+        return notAKeyword;
+    }
+
+    for (unsigned k = 0; k < numKeywords; ++k) {
+        unsigned i = 0;
+        while (i < length && readProgmemChar(&keywords[k][i]) == word[i]) {
+            ++i;
+        }
+        if (i == length && readProgmemChar(&keywords[k][i]) == 0) {
+            return Keyword(k);
+        }
+    }
+    return notAKeyword;
+}
+
+
+// A word, number, or punctuation mark in a line of a program.
+struct Token {
+    enum Kind {
+        endOfLine,
+        word,
+        number,
+        symbol
+    };
+
+    Kind kind;
+
+    // for words, the keyword (or notAKeyword), and the word itself (which
+    // isn't null-terminated)
+    Keyword keyword;
+    const char* text;
+    unsigned length;
+
+    // for symbols, the character, e.g. ':' or '+'
+    char character;
+
+    // for numbers, the value, and whether it is a whole number that fits
+    // in a uint32_t (in which case it is also in integer)
+    double value;
+    uint32_t integer;
+    bool isInteger;
+};
+
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+
+// true for the characters in a word (including the bytes of a micro sign)
+static bool isWordChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+        (uint8_t(c) & 0x80) != 0;
 }
 
 
@@ -52,8 +628,7 @@ static void consumeWhitespace(const char* input, int* index) {
     int i = 0;
 
     while (input[*index + i] == ' ' || input[*index + i] == '\t' ||
-            input[*index + i] == '\n' || input[*index + i] == '\r'|| 
-            input[*index + i] == '#') {
+            input[*index + i] == '\r'|| input[*index + i] == '#') {
 
         if (input[*index + i] == '#') {
             // for comments, read to end of line/string
@@ -69,360 +644,1055 @@ static void consumeWhitespace(const char* input, int* index) {
     *index += i;
 }
 
-static bool consumeUInt32(const char* input, int* index, uint32_t* result) {
-    uint32_t val = 0;
-
-    if (!(input[*index] >= '0' && input[*index] <= '9')) {
-        return false;
-    }
-
-    while (input[*index] >= '0' && input[*index] <= '9') {
-        uint32_t val10 = 10 * val;
-        uint32_t newVal = val10 + input[*index] - '0';
-        (*index)++;
-
-        if (val10 / 10 != val || newVal < val10) {
-            // overflow
-            return false;
-        }
-        val = newVal;
-    }
-
-    *result = val;
-    return true;
-}
-
 
-static bool consumeDouble(const char* input, int* index, double* result) {
+static void lexNumber(const char* input, int* index, Token* token) {
     double val = 0;
-
-    if (input[*index] != '.' && !(input[*index] >= '0' && input[*index] <= '9')) {
-        return false;
-    }
+    uint32_t intVal = 0;
+    bool isInteger = true;
 
     // read the integer component
-    while (input[*index] >= '0' && input[*index] <= '9') {
+    while (isDigit(input[*index])) {
         val = 10 * val + input[*index] - '0';
+
+        uint32_t val10 = 10 * intVal;
+        uint32_t newVal = val10 + input[*index] - '0';
+        if (val10 / 10 != intVal || newVal < val10) {
+            // overflow
+            isInteger = false;
+        }
+        intVal = newVal;
         (*index)++;
     }
 
     // read the decimal component, if present
     if (input[*index] == '.') {
         (*index)++;
+        isInteger = false;
 
         double place = 1.;
-        while (input[*index] >= '0' && input[*index] <= '9') {
+        while (isDigit(input[*index])) {
             place = place / 10.;
             val = val + place * (input[*index] - '0');
             (*index)++;
         }
     }
 
-    *result = val;
-    return true;
+    token->kind = Token::number;
+    token->value = val;
+    token->integer = intVal;
+    token->isInteger = isInteger;
 }
 
 
-static bool consumeTime(const char* input, int* index, Microseconds* result) {
-    const char* expectedToken;
-    double val;
+// Reads the next token, skipping any whitespace and comments before it.
+// Each character of the line is only looked at once.
+static void lexToken(const char* input, int* index, Token* token) {
+    consumeWhitespace(input, index);
 
-    if (!consumeDouble(input, index, &val)) {
-        return false;
+    char c = input[*index];
+    if (c == 0 || c == '\n') {
+        token->kind = Token::endOfLine;
+    } else if (isDigit(c) || c == '.') {
+        lexNumber(input, index, token);
+    } else if (isWordChar(c)) {
+        int start = *index;
+        while (isWordChar(input[*index])) {
+            (*index)++;
+        }
+        token->kind = Token::word;
+        token->text = input + start;
+        token->length = *index - start;
+        token->keyword = findKeyword(token->text, token->length);
+    } else {
+        token->kind = Token::symbol;
+        token->character = c;
+        (*index)++;
     }
+}
 
-    consumeWhitespace(input, index);
-    switch (input[*index]) {
-        case 'u':
-            expectedToken = "us";
-            break;
 
-        case '\xB5': // Latin-1 micro
-            expectedToken = "\xB5s";
-            break;
+// Reads a line of a program one token at a time.  The next token is kept
+// in token, so the parser can look at it before deciding what to do.
+struct LineReader {
+    const char* input;
+    int index;
+    Token token;
 
-        case '\xC2': // micro, utf-8
-            expectedToken = "\xC2\xB5s";
-            break;
+    LineReader(const char* line) : input(line), index(0) { advance(); }
 
-        case '\xCE': // mu, utf-8
-            expectedToken = "\xCE\xBCs";
-            break;
+    void advance() { lexToken(input, &index, &token); }
 
-        case 'm':
-            expectedToken = "ms";
-            val *= 1000;
-            break;
+    bool isKeyword(Keyword keyword) const {
+        return token.kind == Token::word && token.keyword == keyword;
+    }
 
-        case 's':
-            expectedToken = "s";
-            val *= 1000000;
-            break;
+    bool isSymbol(char symbol) const {
+        return token.kind == Token::symbol && token.character == symbol;
+    }
 
-        default:
+    // moves past the next token if it is the given keyword
+    bool skipKeyword(Keyword keyword) {
+        if (!isKeyword(keyword)) {
             return false;
+        }
+        advance();
+        return true;
+    }
+
+    // true if the next token can start a value, i.e. is a number, a name
+    // or "("
+    bool atValue() const {
+        return token.kind == Token::number || isSymbol('(') ||
+            (token.kind == Token::word && token.keyword == notAKeyword);
     }
+};
 
-    *result = Microseconds(val);
 
-    return consumeToken(expectedToken, input, index);
+// finds a named value, returning -1 if there isn't one with that name
+static int findName(const ParseState* state, const char* name,
+        unsigned length) {
+    if (length > maxNameLength) {
+        return -1;
+    }
+    for (unsigned i = 0; i < state->numNames; ++i) {
+        if (strncmp(state->names[i], name, length) == 0 &&
+                state->names[i][length] == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 
-static bool consumeFrequency(const char* input, int* index, Microseconds* result) {
-    const char* expectedToken;
-    double val;
+// Gives a plain number the unit with the given keyword (e.g. makes 15 into
+// 15 ms), returning false if the keyword isn't a unit.  Times are kept in
+// microseconds and frequencies in hertz.
+static bool applyUnit(Keyword unit, ProgramValue* value) {
+    switch (unit) {
+        case keywordUs:
+        case keywordMicrosecondsLatin1:
+        case keywordMicrosecondsUtf8:
+        case keywordMuSecondsUtf8:
+            value->quantity = ProgramValue::duration;
+            break;
 
-    if (!consumeDouble(input, index, &val)) {
-        return false;
-    }
+        case keywordMs:
+            value->value *= 1000;
+            value->quantity = ProgramValue::duration;
+            break;
 
-    consumeWhitespace(input, index);
-    switch (input[*index]) {
-        case 'H':
-            expectedToken = "Hz";
+        case keywordS:
+            value->value *= 1000000;
+            value->quantity = ProgramValue::duration;
+            break;
+
+        case keywordHz:
+            value->quantity = ProgramValue::frequency;
             break;
 
-        case 'k':
-            expectedToken = "kHz";
-            val *= 1000;
+        case keywordKHz:
+            value->value *= 1000;
+            value->quantity = ProgramValue::frequency;
             break;
 
         default:
             return false;
     }
 
-    *result = Microseconds(1000000/val);
-
-    return consumeToken(expectedToken, input, index);
+    value->isInteger = false;
+    return true;
 }
 
 
-void PulseStateCommand::parseFromString(const char* input, const char** error,
-        unsigned* repeatDepth) {
-    int index = 0;
-    uint32_t val;
+// Adds (or subtracts) b to a, which must be the same kind of quantity.
+static ParseError addValue(ProgramValue* a, const ProgramValue& b,
+        bool subtract) {
+    if (a->quantity != b.quantity) {
+        return errorUnitsDontMatch;
+    }
 
-    consumeWhitespace(input, &index);
-    if (input[index] == 0) {
-        // empty line, comment, etc.
-        type = noOp;
-    } else if (input[index] == 'e') {
-        // e.g. "end program" or "end repeat"
-        if (!consumeToken("end", input, &index)) {
-            *error = "unrecognized command";
-            return;
-        }
-        consumeWhitespace(input, &index);
+    if (subtract) {
+        a->isInteger = a->isInteger && b.isInteger && a->integer >= b.integer;
+        a->integer -= b.integer;
+        a->value -= b.value;
+    } else {
+        uint32_t sum = a->integer + b.integer;
+        a->isInteger = a->isInteger && b.isInteger && sum >= a->integer;
+        a->integer = sum;
+        a->value += b.value;
+    }
+    return parseOk;
+}
 
-        if (input[index] == 'p') {
-            if (!consumeToken("program", input, &index)) {
-                *error = "unrecognized command";
-                return;
-            }
-            if (*repeatDepth != 0) {
-                *error = "found \"end program\" while still expecting an \"end repeat\"";
-                return;
-            }
-            type = endProgram;
-        } else if (input[index] == 'r') {
-            if (!consumeToken("repeat", input, &index)) {
-                *error = "unrecognized command";
-                return;
-            }
-            if (*repeatDepth == 0) {
-                *error = "found \"end repeat\" without matching \"repeat\"";
-                return;
-            }
-            type = endRepeat;
-            *repeatDepth -= 1;
-        } else {
-            *error = "expected \"repeat\" or \"program\"";
-            return;
-        }
 
-    } else if (input[index] == 'r') {
-        // e.g. "repeat 12 times:"
-        if (!consumeToken("repeat", input, &index)) {
-            *error = "unrecognized command";
-            return;
-        }
-        type = repeat;
+// Multiplies a by b.  A quantity can be multiplied by a plain number, and a
+// time by a frequency (giving a plain number, e.g. the number of pulses).
+static ParseError multiplyValue(ProgramValue* a, const ProgramValue& b) {
+    uint32_t product = a->integer * b.integer;
+    a->isInteger = a->isInteger && b.isInteger &&
+        (b.integer == 0 || product / b.integer == a->integer);
+    a->integer = product;
+
+    if (b.quantity == ProgramValue::plainNumber) {
+        a->value *= b.value;
+    } else if (a->quantity == ProgramValue::plainNumber) {
+        a->value *= b.value;
+        a->quantity = b.quantity;
+    } else if (a->quantity != b.quantity) {
+        // microseconds times hertz
+        a->value = a->value * b.value / 1000000;
+        a->quantity = ProgramValue::plainNumber;
+    } else {
+        return errorUnitsDontMatch;
+    }
+    return parseOk;
+}
 
-        consumeWhitespace(input, &index);
-        if (!consumeUInt32(input, &index, &repeatCount)) {
-            *error = "expected repeat count";
-            return;
-        }
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken("times", input, &index)) {
-            *error = "expected \"times\"";
-            return;
-        }
+// Divides a by b.  A quantity can be divided by a plain number or by the
+// same kind of quantity, and a plain number by a time (giving a frequency)
+// or by a frequency (giving a time, e.g. "1 / 10 Hz" is 100 ms).
+static ParseError divideValue(ProgramValue* a, const ProgramValue& b) {
+    if (b.value == 0) {
+        return errorDivisionByZero;
+    }
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken(":", input, &index)) {
-            *error = "expected \":\"";
-            return;
-        }
-        if (*repeatDepth == maxRepeatNesting) {
-            *error = "repeats nested too deeply";
-            return;
-        }
-        *repeatDepth += 1;
+    a->isInteger = a->isInteger && b.isInteger && b.integer != 0 &&
+        a->integer % b.integer == 0;
+    a->integer = (a->isInteger ? a->integer / b.integer : 0);
+
+    if (b.quantity == ProgramValue::plainNumber) {
+        a->value /= b.value;
+    } else if (a->quantity == b.quantity) {
+        a->value /= b.value;
+        a->quantity = ProgramValue::plainNumber;
+    } else if (a->quantity == ProgramValue::plainNumber) {
+        a->value = 1000000 * a->value / b.value;
+        a->quantity = (b.quantity == ProgramValue::duration ?
+                ProgramValue::frequency : ProgramValue::duration);
+    } else {
+        return errorUnitsDontMatch;
+    }
+    return parseOk;
+}
 
-    } else if (input[index] == 's') {
-        // e.g. "set channel 3 to 213 us pulses at 15.1 Hz"
-        if (!consumeToken("set", input, &index)) {
-            *error = "unrecognized command";
-            return;
-        }
-        type = setChannel;
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken("channel", input, &index)) {
-            *error = "expected \"channel\"";
-            return;
+static ParseError readExpression(LineReader* reader, const ParseState* state,
+        ProgramValue* result);
+
+
+// Reads a number, a name or an expression in parentheses, with an optional
+// unit, e.g. "15 ms", "width" or "(width + 5) ms".
+static ParseError readFactor(LineReader* reader, const ParseState* state,
+        ProgramValue* result) {
+    const Token& token = reader->token;
+
+    if (token.kind == Token::number) {
+        result->value = token.value;
+        result->integer = token.integer;
+        result->isInteger = token.isInteger;
+        result->quantity = ProgramValue::plainNumber;
+        reader->advance();
+    } else if (token.kind == Token::word && token.keyword == notAKeyword) {
+        int i = findName(state, token.text, token.length);
+        if (i < 0) {
+            return errorUnknownName;
+        } else if (state->values[i].quantity == ProgramValue::subroutine) {
+            return errorExpectedValue;
         }
-
-        consumeWhitespace(input, &index);
-        if (!consumeUInt32(input, &index, &val)) {
-            *error = "expected channel number";
-            return;
+        *result = state->values[i];
+        reader->advance();
+    } else if (reader->isSymbol('(')) {
+        reader->advance();
+        ParseError error = readExpression(reader, state, result);
+        if (error != parseOk) {
+            return error;
         }
-        if (val > numChannels || val == 0) {
-            *error = "channel number must be between 1 and 8";
-            return;
+        if (!reader->isSymbol(')')) {
+            return errorExpectedCloseParen;
         }
-        channel = val;
+        reader->advance();
+    } else {
+        return errorExpectedValue;
+    }
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken("to", input, &index)) {
-            *error = "expected \"to\"";
-            return;
+    if (token.kind == Token::word &&
+            token.keyword >= keywordUs && token.keyword <= keywordKHz) {
+        if (result->quantity != ProgramValue::plainNumber) {
+            return errorUnitsDontMatch;
         }
+        applyUnit(token.keyword, result);
+        reader->advance();
+    }
+    return parseOk;
+}
 
-        consumeWhitespace(input, &index);
-        if (!consumeTime(input, &index, &onTime)) {
-            *error = "expected time, e.g. \"2 s\", "
-                "\"13 ms\", \"12 us\", or \"15 \u00B5s\"";
-            return;
-        }
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken("pulses", input, &index)) {
-            *error = "expected \"pulses\"";
-            return;
+// Reads factors multiplied or divided together.
+static ParseError readTerm(LineReader* reader, const ParseState* state,
+        ProgramValue* result) {
+    ParseError error = readFactor(reader, state, result);
+    while (error == parseOk && (reader->isSymbol('*') ||
+                reader->isSymbol('/'))) {
+        bool divide = reader->isSymbol('/');
+        reader->advance();
+
+        ProgramValue factor;
+        error = readFactor(reader, state, &factor);
+        if (error == parseOk) {
+            error = (divide ? divideValue(result, factor) :
+                    multiplyValue(result, factor));
         }
+    }
+    return error;
+}
 
-        consumeWhitespace(input, &index);
-
-        Microseconds period;
-        if (input[index] == 'a') { // e.g. "at 12 Hz"
-            if (!consumeToken("at", input, &index)) {
-                *error = "expected \"at\" or \"every\"";
-                return;
-            }
 
-            consumeWhitespace(input, &index);
-            if (!consumeFrequency(input, &index, &period)) {
-                *error = "expected frequency, e.g. \"2.3 Hz\" or \"15 kHz\"";
-                return;
-            }
-        } else { // e.g. "every 2 s"
-            if (!consumeToken("every", input, &index)) {
-                *error = "expected \"at\" or \"every\"";
-                return;
-            }
+// Reads terms added or subtracted together, e.g. "2 * width + 5 ms".
+static ParseError readExpression(LineReader* reader, const ParseState* state,
+        ProgramValue* result) {
+    ParseError error = readTerm(reader, state, result);
+    while (error == parseOk && (reader->isSymbol('+') ||
+                reader->isSymbol('-'))) {
+        bool subtract = reader->isSymbol('-');
+        reader->advance();
 
-            consumeWhitespace(input, &index);
-            if (!consumeTime(input, &index, &period)) {
-                *error = "expected time, e.g. \"2 s\", "
-                    "\"13 ms\", \"12 us\", or \"15 \u00B5s\"";
-                return;
-            }
+        ProgramValue term;
+        error = readTerm(reader, state, &term);
+        if (error == parseOk) {
+            error = addValue(result, term, subtract);
         }
+    }
+    return error;
+}
 
-        if (period < onTime) {
-            *error = "pulse duration longer than total period";
-            return;
-        }
-        offTime = period - onTime;
 
-    } else if (input[index] == 't') {
-        // e.g. "turn off channel 4" or "turn on channel 1"
-        if (!consumeToken("turn", input, &index)) {
-            *error = "unrecognized command";
-            return;
+// Reads an expression giving the given kind of quantity, returning
+// notFound if there isn't one (or it is negative).
+static ParseError readQuantity(LineReader* reader, const ParseState* state,
+        ProgramValue::Quantity quantity, ParseError notFound,
+        ProgramValue* result) {
+    if (!reader->atValue()) {
+        return notFound;
+    }
+    ParseError error = readExpression(reader, state, result);
+    if (error != parseOk) {
+        return error;
+    }
+    if (result->quantity != quantity || result->value < 0) {
+        return notFound;
+    }
+    return parseOk;
+}
+
+
+// Reads a time, e.g. "2 s" or "width + 5 ms".
+static ParseError readTime(LineReader* reader, const ParseState* state,
+        Microseconds* result) {
+    ProgramValue value;
+    ParseError error = readQuantity(reader, state, ProgramValue::duration,
+            errorExpectedTime, &value);
+    if (error != parseOk) {
+        return error;
+    }
+    if (value.value >= forever) {
+        return errorExpectedTime;
+    }
+    *result = Microseconds(value.value);
+    return parseOk;
+}
+
+
+// Reads a frequency, e.g. "2.3 Hz", giving its period in microseconds.
+static ParseError readPeriod(LineReader* reader, const ParseState* state,
+        Microseconds* result) {
+    ProgramValue value;
+    ParseError error = readQuantity(reader, state, ProgramValue::frequency,
+            errorExpectedFrequency, &value);
+    if (error != parseOk) {
+        return error;
+    }
+    if (value.value == 0 || 1000000/value.value >= forever) {
+        return errorExpectedFrequency;
+    }
+    *result = Microseconds(1000000/value.value);
+    return parseOk;
+}
+
+
+// Reads a whole number, e.g. a repeat count, returning notFound if there
+// isn't one.
+static ParseError readCount(LineReader* reader, const ParseState* state,
+        ParseError notFound, uint32_t* result) {
+    ProgramValue value;
+    ParseError error = readQuantity(reader, state, ProgramValue::plainNumber,
+            notFound, &value);
+    if (error != parseOk) {
+        return error;
+    }
+    if (value.isInteger) {
+        *result = value.integer;
+    } else if (value.value < 4294967296.0 &&
+            uint32_t(value.value) == value.value) {
+        *result = uint32_t(value.value);
+    } else {
+        return notFound;
+    }
+    return parseOk;
+}
+
+
+// Reads "channel" and a channel number.
+static ParseError readChannel(LineReader* reader, const ParseState* state,
+        uint8_t* channel) {
+    uint32_t val;
+
+    if (!reader->skipKeyword(keywordChannel)) {
+        return errorExpectedChannel;
+    }
+    ParseError error = readCount(reader, state, errorExpectedChannelNumber,
+            &val);
+    if (error != parseOk) {
+        return error;
+    }
+    if (val > numChannels || val == 0) {
+        return errorChannelOutOfRange;
+    }
+    *channel = val;
+    return parseOk;
+}
+
+
+// Checks that the next token is a name that can be given to a value or a
+// subroutine.
+static ParseError checkNewName(const Token& token, const ParseState* state) {
+    if (token.kind != Token::word || token.keyword != notAKeyword) {
+        return errorExpectedName;
+    }
+    if (token.length > maxNameLength) {
+        return errorNameTooLong;
+    }
+    if (findName(state, token.text, token.length) >= 0) {
+        return errorNameAlreadyDefined;
+    }
+    if (state->numNames == maxNamedValues) {
+        return errorTooManyNames;
+    }
+    return parseOk;
+}
+
+
+// gives a value (or a subroutine) a name
+static void addName(ParseState* state, const char* name, unsigned length,
+        const ProgramValue& value) {
+    memcpy(state->names[state->numNames], name, length);
+    state->names[state->numNames][length] = '\0';
+    state->values[state->numNames] = value;
+    state->numNames += 1;
+}
+
+
+// the levels of RepeatStack in use at this point of the program (a
+// subroutine's own call uses one)
+static unsigned stackDepth(const ParseState* state) {
+    return state->repeatDepth + (state->definingSubroutine >= 0 ? 1 : 0);
+}
+
+
+// notes the levels of RepeatStack used by the subroutine being defined
+static void noteStackDepth(ParseState* state, unsigned depth) {
+    if (state->definingSubroutine >= 0) {
+        ProgramValue& subroutine = state->values[state->definingSubroutine];
+        if (depth > subroutine.value) {
+            subroutine.value = depth;
+        }
+    }
+}
+
+
+#if !defined(__AVR__)
+static const char* const parseErrorMessages[numParseErrors] = {
+    NULL,
+    "unrecognized command",
+    "expected \"repeat\" or \"program\"",
+    "found \"end program\" while still expecting an \"end repeat\"",
+    "found \"end repeat\" without matching \"repeat\"",
+    "expected repeat count",
+    "expected \"times\"",
+    "expected \":\"",
+    "repeats nested too deeply",
+    "expected \"channel\"",
+    "expected channel number",
+    "channel number must be between 1 and "
+        STRINGIFY_VALUE(PULSE_NUM_CHANNELS),
+    "expected \"to\"",
+    "expected time, e.g. \"2 s\", \"13 ms\", \"12 us\", or \"15 \u00B5s\"",
+    "expected \"pulses\"",
+    "expected \"at\" or \"every\"",
+    "expected frequency, e.g. \"2.3 Hz\" or \"15 kHz\"",
+    "pulse duration longer than total period",
+    "expected \"on\" or \"off\"",
+    "unexpected text found after end of command",
+    "unexpected command found after end of program",
+    "missing \"end program\"",
+    "expected a name, e.g. \"let width = 15 ms\"",
+    "expected \"=\"",
+    "name too long",
+    "name already defined",
+    "too many names",
+    "unknown name",
+    "expected a number or a name",
+    "expected \")\"",
+    "units don't match",
+    "division by zero",
+    "found \"end program\" while still expecting an \"end define\"",
+    "found \"end define\" without matching \"define\"",
+    "found \"end define\" while still expecting an \"end repeat\"",
+    "\"define\" can't be inside a repeat or another \"define\"",
+    "not a subroutine",
+    "a subroutine can't call itself",
+    "expected a whole number, e.g. \"seed 12\"",
+    "the longest wait must not be shorter than the shortest",
+    "expected a pulse width or rate, e.g. \"to 2 ms pulses\" or "
+        "\"to 40 Hz\"",
+    "expected \"over\", e.g. \"over 5 s\"",
+    "expected the number of pulses in each burst, e.g. \"to 4 pulses\"",
+    "expected \"with\", e.g. \"with channel 2\"",
+    "expected \"after\", e.g. \"after 50 us\"",
+    "a channel can't be paired with itself",
+    "a repeat must run at least once"
+};
+
+
+const char* parseErrorMessage(ParseError error) {
+    return unsigned(error) < numParseErrors ? parseErrorMessages[error] :
+        "unknown error";
+}
+#endif
+
+
+ParseError PulseStateCommand::parseFromString(const char* input,
+        ParseState* state, int* length) {
+    LineReader reader(input);
+    const Token& token = reader.token;
+    ParseError error;
+
+    if (token.kind == Token::endOfLine) {
+        // empty line, comment, etc.
+        type = noOp;
+        if (length) {
+            *length = reader.index;
+        }
+        return parseOk;
+    } else if (token.kind != Token::word) {
+        return errorUnrecognizedCommand;
+    }
+
+    Keyword command = token.keyword;
+    reader.advance();
+
+    switch (command) {
+    case keywordEnd:
+        // e.g. "end program" or "end repeat"
+        if (reader.skipKeyword(keywordProgram)) {
+            if (state->repeatDepth != 0) {
+                return errorEndProgramInRepeat;
+            }
+            if (state->definingSubroutine >= 0) {
+                return errorEndProgramInDefine;
+            }
+            type = endProgram;
+        } else if (reader.skipKeyword(keywordRepeat)) {
+            if (state->repeatDepth == 0) {
+                return errorEndRepeatWithoutRepeat;
+            }
+            type = endRepeat;
+            state->repeatDepth -= 1;
+        } else if (reader.skipKeyword(keywordDefine)) {
+            if (state->definingSubroutine < 0) {
+                return errorEndDefineWithoutDefine;
+            }
+            if (state->repeatDepth != 0) {
+                return errorEndDefineInRepeat;
+            }
+            type = endSubroutine;
+            state->definingSubroutine = -1;
+        } else {
+            return errorExpectedRepeatOrProgram;
         }
+        break;
+
+    case keywordRepeat:
+        // e.g. "repeat 12 times:"
+        type = repeat;
+        error = readCount(&reader, state, errorExpectedRepeatCount,
+                &repeatCount);
+        if (error != parseOk) {
+            return error;
+        }
+        if (repeatCount == 0) {
+            // (it would run about 2^32 times, since the count is only
+            // checked at the end of each iteration)
+            return errorZeroRepeatCount;
+        }
+        if (!reader.skipKeyword(keywordTimes)) {
+            return errorExpectedTimes;
+        }
+        if (!reader.isSymbol(':')) {
+            return errorExpectedColon;
+        }
+        reader.advance();
+        if (stackDepth(state) == maxRepeatNesting) {
+            return errorNestedTooDeeply;
+        }
+        state->repeatDepth += 1;
+        noteStackDepth(state, stackDepth(state));
+        break;
+
+    case keywordSet: {
+        // e.g. "set channel 3 to 213 us pulses at 15.1 Hz" or "set channel
+        // 3 to 213 us poisson pulses at 15.1 Hz"
         type = setChannel;
+        error = readChannel(&reader, state, &channel);
+        if (error != parseOk) {
+            return error;
+        }
+        if (!reader.skipKeyword(keywordTo)) {
+            return errorExpectedTo;
+        }
+        error = readTime(&reader, state, &onTime);
+        if (error != parseOk) {
+            return error;
+        }
+        poisson = reader.skipKeyword(keywordPoisson);
+        if (!reader.skipKeyword(keywordPulses)) {
+            return errorExpectedPulses;
+        }
+
+        Microseconds period;
+        if (reader.skipKeyword(keywordAt)) {
+            // e.g. "at 12 Hz"
+            error = readPeriod(&reader, state, &period);
+        } else if (reader.skipKeyword(keywordEvery)) {
+            // e.g. "every 2 s"
+            error = readTime(&reader, state, &period);
+        } else {
+            return errorExpectedAtOrEvery;
+        }
+        if (error != parseOk) {
+            return error;
+        }
+
+        if (period < onTime) {
+            return errorPulseLongerThanPeriod;
+        }
+        offTime = period - onTime;
+        break;
+    }
 
-        consumeWhitespace(input, &index);
-        const char* expectedToken;
-        if (input[index] == 'o' && input[index + 1] == 'n') {
-            expectedToken = "on";
+    case keywordRamp: {
+        // e.g. "ramp channel 1 to 100 Hz over 5 s", "ramp channel 1 to
+        // every 10 ms over 5 s" or "ramp channel 1 to 2 ms pulses over 5 s"
+        type = rampChannel;
+        error = readChannel(&reader, state, &channel);
+        if (error != parseOk) {
+            return error;
+        }
+        if (!reader.skipKeyword(keywordTo)) {
+            return errorExpectedTo;
+        }
+
+        rampWidth = false;
+        if (reader.skipKeyword(keywordEvery)) {
+            error = readTime(&reader, state, &rampTarget);
+            if (error != parseOk) {
+                return error;
+            }
+        } else {
+            ProgramValue value;
+            if (!reader.atValue()) {
+                return errorExpectedRampTarget;
+            }
+            error = readExpression(&reader, state, &value);
+            if (error != parseOk) {
+                return error;
+            }
+            if (value.quantity == ProgramValue::frequency) {
+                if (value.value <= 0 || 1000000/value.value >= forever ||
+                        1000000/value.value < 1) {
+                    return errorExpectedFrequency;
+                }
+                rampTarget = Microseconds(1000000/value.value);
+            } else if (value.quantity == ProgramValue::duration) {
+                if (value.value < 0 || value.value >= forever) {
+                    return errorExpectedTime;
+                }
+                if (!reader.skipKeyword(keywordPulses)) {
+                    return errorExpectedPulses;
+                }
+                rampTarget = Microseconds(value.value);
+                rampWidth = true;
+            } else {
+                return errorExpectedRampTarget;
+            }
+        }
+
+        if (!reader.skipKeyword(keywordOver)) {
+            return errorExpectedOver;
+        }
+        error = readTime(&reader, state, &rampTime);
+        if (error != parseOk) {
+            return error;
+        }
+        break;
+    }
+
+    case keywordBurst: {
+        // e.g. "burst channel 1 to 4 pulses at 5 Hz" or "burst channel 1
+        // to 4 pulses every 200 ms"
+        type = burstChannel;
+        error = readChannel(&reader, state, &channel);
+        if (error != parseOk) {
+            return error;
+        }
+        if (!reader.skipKeyword(keywordTo)) {
+            return errorExpectedTo;
+        }
+        error = readCount(&reader, state, errorExpectedBurstCount,
+                &burstPulses);
+        if (error != parseOk) {
+            return error;
+        }
+        if (burstPulses == 0 || burstPulses > 0xFFFF) {
+            return errorExpectedBurstCount;
+        }
+        if (!reader.skipKeyword(keywordPulses)) {
+            return errorExpectedPulses;
+        }
+
+        if (reader.skipKeyword(keywordAt)) {
+            error = readPeriod(&reader, state, &burstPeriod);
+        } else if (reader.skipKeyword(keywordEvery)) {
+            error = readTime(&reader, state, &burstPeriod);
+        } else {
+            return errorExpectedAtOrEvery;
+        }
+        if (error != parseOk) {
+            return error;
+        }
+        break;
+    }
+
+    case keywordPair:
+        // e.g. "pair channel 1 with channel 2 after 50 us"
+        type = pairChannels;
+        error = readChannel(&reader, state, &channel);
+        if (error != parseOk) {
+            return error;
+        }
+        if (!reader.skipKeyword(keywordWith)) {
+            return errorExpectedWith;
+        }
+        error = readChannel(&reader, state, &pairedChannel);
+        if (error != parseOk) {
+            return error;
+        }
+        if (pairedChannel == channel) {
+            return errorPairedWithItself;
+        }
+        if (!reader.skipKeyword(keywordAfter)) {
+            return errorExpectedAfter;
+        }
+        error = readTime(&reader, state, &pairGap);
+        if (error != parseOk) {
+            return error;
+        }
+        break;
+
+    case keywordTurn:
+        // e.g. "turn off channel 4" or "turn on channel 1"
+        type = setChannel;
+        poisson = false;
+        if (reader.skipKeyword(keywordOn)) {
             onTime = forever;
             offTime = 0;
-        } else {
-            expectedToken = "off";
+        } else if (reader.skipKeyword(keywordOff)) {
             onTime = 0;
             offTime = forever;
+        } else {
+            return errorExpectedOnOrOff;
         }
-        if (!consumeToken(expectedToken, input, &index)) {
-            *error = "expected \"on\" or \"off\"";
-            return;
+        error = readChannel(&reader, state, &channel);
+        if (error != parseOk) {
+            return error;
         }
+        break;
 
-        consumeWhitespace(input, &index);
-        if (!consumeToken("channel", input, &index)) {
-            *error = "expected \"channel\"";
-            return;
+    case keywordWait: {
+        // e.g. "wait 182 us" or "wait random 10 ms to 50 ms"
+        type = wait;
+        if (!reader.skipKeyword(keywordRandom)) {
+            error = readTime(&reader, state, &waitTime);
+            if (error != parseOk) {
+                return error;
+            }
+            break;
         }
 
-        consumeWhitespace(input, &index);
-        if (!consumeUInt32(input, &index, &val)) {
-            *error = "expected channel number";
-            return;
+        type = randomWait;
+        Microseconds longest;
+        error = readTime(&reader, state, &waitTime);
+        if (error != parseOk) {
+            return error;
+        }
+        if (!reader.skipKeyword(keywordTo)) {
+            return errorExpectedTo;
+        }
+        error = readTime(&reader, state, &longest);
+        if (error != parseOk) {
+            return error;
         }
-        if (val > numChannels || val == 0) {
-            *error = "channel number must be between 1 and 8";
-            return;
+        if (longest < waitTime) {
+            return errorRandomRangeBackwards;
         }
-        channel = val;
+        waitRange = longest - waitTime;
+        break;
+    }
 
-    } else if (input[index] == 'w') {
-        // e.g. "wait 182 us"
-        if (!consumeToken("wait", input, &index)) {
-            *error = "unrecognized command";
-            return;
+    case keywordSeed:
+        // e.g. "seed 12"
+        type = seedRandom;
+        error = readCount(&reader, state, errorExpectedSeed, &seed);
+        if (error != parseOk) {
+            return error;
         }
-        type = wait;
+        break;
 
-        consumeWhitespace(input, &index);
-        if (!consumeTime(input, &index, &waitTime)) {
-            *error = "expected time, e.g. \"2 s\", "
-                "\"13 ms\", \"12 us\", or \"15 \u00B5s\"";
-            return;
+    case keywordLet: {
+        // e.g. "let width = 15 ms", which gives a name to a value for the
+        // rest of the program
+        type = noOp;
+        error = checkNewName(token, state);
+        if (error != parseOk) {
+            return error;
         }
-    } else {
-        *error = "unrecognized command";
-        return;
+        const char* name = token.text;
+        unsigned nameLength = token.length;
+        reader.advance();
+        if (!reader.isSymbol('=')) {
+            return errorExpectedEquals;
+        }
+        reader.advance();
+
+        if (!reader.atValue()) {
+            return errorExpectedValue;
+        }
+        ProgramValue value;
+        error = readExpression(&reader, state, &value);
+        if (error != parseOk) {
+            return error;
+        }
+        if (token.kind != Token::endOfLine) {
+            return errorTextAfterCommand;
+        }
+
+        // (the name is only kept once the whole line has been read)
+        addName(state, name, nameLength, value);
+        break;
     }
 
-    consumeWhitespace(input, &index);
-    if (input[index] != 0) {
-        *error = "unexpected text found after end of command";
-        return;
+    case keywordDefine: {
+        // e.g. "define flash:", which starts a subroutine
+        type = defineSubroutine;
+        if (state->repeatDepth != 0 || state->definingSubroutine >= 0) {
+            return errorDefineNotAtTopLevel;
+        }
+        error = checkNewName(token, state);
+        if (error != parseOk) {
+            return error;
+        }
+        const char* name = token.text;
+        unsigned nameLength = token.length;
+        reader.advance();
+        if (!reader.isSymbol(':')) {
+            return errorExpectedColon;
+        }
+        reader.advance();
+        if (token.kind != Token::endOfLine) {
+            return errorTextAfterCommand;
+        }
+
+        ProgramValue subroutine;
+        subroutine.value = 1;
+        subroutine.integer = state->numCommands;
+        subroutine.isInteger = false;
+        subroutine.quantity = ProgramValue::subroutine;
+        state->definingSubroutine = state->numNames;
+        addName(state, name, nameLength, subroutine);
+        break;
+    }
+
+    case keywordCall: {
+        // e.g. "call flash"
+        type = callSubroutine;
+        if (token.kind != Token::word || token.keyword != notAKeyword) {
+            return errorExpectedName;
+        }
+        int i = findName(state, token.text, token.length);
+        if (i < 0) {
+            return errorUnknownName;
+        } else if (state->values[i].quantity != ProgramValue::subroutine) {
+            return errorNotASubroutine;
+        } else if (i == state->definingSubroutine) {
+            return errorRecursiveCall;
+        }
+        unsigned depth = stackDepth(state) + unsigned(state->values[i].value);
+        if (depth > maxRepeatNesting) {
+            return errorNestedTooDeeply;
+        }
+        reader.advance();
+        if (token.kind != Token::endOfLine) {
+            return errorTextAfterCommand;
+        }
+        subroutineStart = state->values[i].integer;
+        noteStackDepth(state, depth);
+        break;
+    }
+
+    default:
+        return errorUnrecognizedCommand;
+    }
+
+    if (token.kind != Token::endOfLine) {
+        return errorTextAfterCommand;
+    }
+
+    if (type != noOp && type != endProgram) {
+        state->numCommands += 1;
+    }
+    if (length) {
+        *length = reader.index;
+    }
+    return parseOk;
+}
+
+
+#if !defined(__AVR__)
+ParseError PulseStateCommand::parseFromString(const char* input,
+        unsigned* repeatDepth) {
+    ParseState state;
+    if (repeatDepth) {
+        state.repeatDepth = *repeatDepth;
+    }
+    ParseError error = parseFromString(input, &state);
+    if (repeatDepth) {
+        *repeatDepth = state.repeatDepth;
+    }
+    return error;
+}
+
+
+void PulseStateCommand::parseFromString(const char* input, const char** error,
+        unsigned* repeatDepth) {
+    *error = parseErrorMessage(parseFromString(input, repeatDepth));
+}
+
+
+int countProgramLines(const char* text, size_t length) {
+    int lines = 1;
+    const char* end = text + length;
+    while ((text = (const char*)memchr(text, '\n', end - text)) != NULL) {
+        ++lines;
+        ++text;
+    }
+    return lines;
+}
+
+
+ParseError parseProgram(const char* text, size_t length,
+        PulseStateCommand* commands, uint16_t* sourceLines,
+        int* numCommands, int* errorLine) {
+    // The lines up to the last '\n' are parsed where they are, since the
+    // parser stops at the '\n'.  The last line may not end with anything,
+    // so it is copied and given a '\0'.
+    size_t lastLineStart = length;
+    while (lastLineStart > 0 && text[lastLineStart - 1] != '\n') {
+        --lastLineStart;
+    }
+    char shortLastLine[128];
+    char* lastLine = shortLastLine;
+    size_t lastLineLength = length - lastLineStart;
+    if (lastLineLength >= sizeof(shortLastLine)) {
+        lastLine = new char[lastLineLength + 1];
+    }
+    memcpy(lastLine, text + lastLineStart, lastLineLength);
+    lastLine[lastLineLength] = '\0';
+
+    // The lines are split at each '\n', the same way countProgramLines
+    // counts them, so that there's never more than one command for each
+    // entry in commands and sourceLines.
+    const int numLines = countProgramLines(text, length);
+    ParseError error = parseOk;
+    ParseState state;
+    bool endProgramFound = false;
+    int n = 0;
+    int line = 0;
+    size_t start = 0;
+    for (;;) {
+        const char* input;
+        const char* lineEnd;
+        if (start < lastLineStart) {
+            input = text + start;
+            lineEnd = (const char*)memchr(input, '\n', lastLineStart - start);
+        } else {
+            input = lastLine;
+            lineEnd = lastLine + lastLineLength;
+        }
+        int lineLength;
+        PulseStateCommand& command = commands[n];
+        error = command.parseFromString(input, &state, &lineLength);
+        if (error == parseOk && input + lineLength != lineEnd) {
+            // (the parser stopped at a '\0' in the middle of the line)
+            error = errorTextAfterCommand;
+        }
+        if (error != parseOk) {
+            break;
+        }
+
+        if (command.type == PulseStateCommand::endProgram) {
+            endProgramFound = true;
+        } else if (command.type != PulseStateCommand::noOp) {
+            if (endProgramFound) {
+                error = errorCommandAfterEndProgram;
+                break;
+            }
+            sourceLines[n++] = uint16_t(line < 0xFFFF ? line : 0xFFFF);
+        }
+
+        if (line + 1 >= numLines) {
+            break;
+        }
+        start = lineEnd - text + 1;
+        ++line;
+    }
+
+    if (lastLine != shortLastLine) {
+        delete[] lastLine;
     }
 
-    *error = NULL;
+    if (error == parseOk && !endProgramFound) {
+        error = errorMissingEndProgram;
+    }
+    *numCommands = n;
+    *errorLine = line;
+    return error;
 }
+#endif
 
 
-int PulseStateCommand::execute(PulseChannel* channels, RepeatStack* stack,
+int PulseStateCommand::execute(ChannelBank* channels, RepeatStack* stack,
                 int commandId, Microseconds timeInState,
-                Microseconds* timeAvailable) {
+                Microseconds* timeAvailable) const {
     switch (type) {
         default:
         case noOp:
@@ -433,9 +1703,28 @@ int PulseStateCommand::execute(PulseChannel* channels, RepeatStack* stack,
             return 0;
 
         case setChannel:
-            channels[channel - 1].setOnOffTime(onTime, offTime);
+            channels->setOnOffTime(channel - 1, onTime, offTime, poisson);
+            return 1;
+
+        case seedRandom:
+            channels->random()->seed(seed);
+            return 1;
+
+        case rampChannel:
+            channels->rampTo(channel - 1, rampTarget, rampTime, rampWidth);
+            return 1;
+
+        case burstChannel:
+            channels->burst(channel - 1, uint16_t(burstPulses), burstPeriod);
+            return 1;
+
+        case pairChannels:
+            channels->pair(channel - 1, pairedChannel - 1, pairGap);
             return 1;
 
+        // (ProgramStepper runs the wait drawn for a random wait instead, so
+        // here it only waits for its shortest time)
+        case randomWait:
         case wait:
             if (waitTime > *timeAvailable + timeInState) {
                 *timeAvailable = 0;
@@ -458,6 +1747,733 @@ int PulseStateCommand::execute(PulseChannel* channels, RepeatStack* stack,
         case repeat:
             stack->pushRepeat(commandId + 1, repeatCount);
             return 1;
+
+        case defineSubroutine: {
+            // skip the subroutine, which only runs when it's called (the
+            // parser makes sure it has an end)
+            const PulseStateCommand* end = this + 1;
+            while (end->type != endSubroutine) {
+                ++end;
+            }
+            return end - this + 1;
+        }
+
+        case callSubroutine:
+            stack->pushCall(commandId + 1);
+            return int(subroutineStart) + 1 - commandId;
+
+        case endSubroutine: {
+            int returnTarget = stack->getLoopTarget();
+            stack->pop();
+            return returnTarget - commandId;
+        }
     }
 };
 
+
+ProgramStepper::ProgramStepper(const PulseStateCommand* commands,
+        int numCommands) {
+    reset(commands, numCommands);
+}
+
+
+void ProgramStepper::reset(const PulseStateCommand* commands,
+        int numCommands) {
+    m_commands = commands;
+    m_numCommands = numCommands;
+    m_runningCommandIndex = 0;
+    m_channels.reset();
+    m_stack.clear();
+    m_time = 0;
+    m_timeInState = 0;
+    m_state = 0;
+    m_finished = false;
+    m_commandsRun = 0;
+    enterCommand();
+}
+
+
+void ProgramStepper::enterCommand() {
+    if (m_runningCommandIndex < m_numCommands &&
+            m_commands[m_runningCommandIndex].type ==
+                PulseStateCommand::randomWait) {
+        const PulseStateCommand& command = m_commands[m_runningCommandIndex];
+        m_drawnWait.type = PulseStateCommand::wait;
+        m_drawnWait.waitTime = command.waitTime +
+            m_channels.random()->uniform(command.waitRange);
+    }
+}
+
+
+bool ProgramStepper::step(Microseconds* time, ChannelMask* state,
+        ChannelMask* setChannels) {
+    *setChannels = 0;
+
+    while (!m_finished) {
+        // run every command that happens at this moment, i.e. up to the
+        // next wait that hasn't finished yet
+        int step;
+        Microseconds timeAvailable = 0;
+        while (m_runningCommandIndex < m_numCommands &&
+                m_commands[m_runningCommandIndex].type !=
+                    PulseStateCommand::endProgram &&
+                0 != (step = runningCommand().execute(
+                        &m_channels, &m_stack, m_runningCommandIndex,
+                        m_timeInState, &timeAvailable))) {
+            const PulseStateCommand& command =
+                m_commands[m_runningCommandIndex];
+            if (command.type == PulseStateCommand::setChannel ||
+                    command.type == PulseStateCommand::rampChannel ||
+                    command.type == PulseStateCommand::burstChannel) {
+                *setChannels |= ChannelMask(1) << (command.channel - 1);
+            } else if (command.type == PulseStateCommand::pairChannels) {
+                *setChannels |= ChannelMask(1) << (command.channel - 1);
+                *setChannels |= ChannelMask(1) << (command.pairedChannel - 1);
+            }
+            m_runningCommandIndex += step;
+            m_timeInState = 0;
+            ++m_commandsRun;
+            enterCommand();
+        }
+
+        // (the outputs all turn off when the program finishes, so any
+        // changes at that moment don't count)
+        if (m_runningCommandIndex >= m_numCommands ||
+                m_commands[m_runningCommandIndex].type ==
+                    PulseStateCommand::endProgram) {
+            m_finished = true;
+            break;
+        }
+
+        if (m_channels.onChannels() != m_state || *setChannels != 0) {
+            m_state = m_channels.onChannels();
+            *time = m_time;
+            *state = m_state;
+            return true;
+        }
+
+        // skip ahead to the end of the wait or the next state change,
+        // whichever comes first.  Only waits take time: any other command
+        // that didn't move on (an "end repeat" closing an empty loop jumps
+        // back to itself) is simply run again.
+        if (runningCommand().type != PulseStateCommand::wait) {
+            continue;
+        }
+        Microseconds dt = runningCommand().waitTime - m_timeInState;
+        if (m_channels.timeUntilNextStateChange() < dt) {
+            dt = m_channels.timeUntilNextStateChange();
+        }
+        m_channels.advanceTime(dt);
+        m_time += dt;
+        m_timeInState += dt;
+    }
+
+    *time = m_time;
+    *state = 0;
+    return false;
+}
+
+
+
+ChangeQueue::ChangeQueue(const PulseStateCommand* commands, int numCommands,
+        bool stopAtSettings) :
+    m_program(commands, numCommands), m_start(0), m_size(0),
+    m_programFinished(false), m_stopAtSettings(stopAtSettings),
+    m_timeOffset(0), m_chained(false), m_holding(false) {
+}
+
+
+bool ChangeQueue::canFill() const {
+    if ((m_programFinished && !m_holding) || m_size == prefetchDepth) {
+        return false;
+    }
+
+    const PendingChange& last =
+        m_changes[(m_start + m_size + prefetchDepth - 1) % prefetchDepth];
+    return !(m_stopAtSettings && m_size > 0 && last.setChannels != 0);
+}
+
+
+void ChangeQueue::fill() {
+    PendingChange& change = m_changes[(m_start + m_size) % prefetchDepth];
+    ++m_size;
+
+    if (m_holding) {
+        change = m_held;
+        m_holding = false;
+        return;
+    }
+
+    m_programFinished = !m_program.step(&change.time, &change.state,
+            &change.setChannels);
+    change.time += m_timeOffset;
+    change.startsProgram = m_chained;
+
+    // If a chained program doesn't change anything at its start, the
+    // outputs still turn off when the previous program ends.
+    if (m_chained && change.time != m_timeOffset) {
+        m_held = change;
+        m_held.startsProgram = false;
+        m_holding = true;
+
+        change.time = m_timeOffset;
+        change.state = 0;
+        change.setChannels = 0;
+    }
+    m_chained = false;
+}
+
+
+bool ChangeQueue::canChain() const {
+    return m_programFinished && !m_holding && !m_chained && m_size != 0;
+}
+
+
+void ChangeQueue::chain(const PulseStateCommand* commands,
+        int numCommands) {
+    // the last change in the queue is the current program's end
+    --m_size;
+    m_timeOffset = m_changes[(m_start + m_size) % prefetchDepth].time;
+
+    m_program.reset(commands, numCommands);
+    m_programFinished = false;
+    m_chained = true;
+}
+
+
+void ChangeQueue::pop() {
+    m_start = (m_start + 1) % prefetchDepth;
+    --m_size;
+}
+
+
+ClockCorrection::ClockCorrection(int32_t drift)
+    : m_interval(0), m_remainder(0), m_divisor(1), m_error(0),
+    m_lastStep(0), m_nextStep(0), m_offset(0), m_fast(drift > 0)
+{
+    if (drift < -maxDrift) {
+        drift = -maxDrift;
+    } else if (drift > maxDrift) {
+        drift = maxDrift;
+    }
+    if (drift == 0) {
+        return;
+    }
+
+    // A board time b is a reference time b * 10^9 / (10^9 + drift), i.e.
+    // b less (or plus) b * |drift| / (10^9 + drift), so step k comes at
+    // the board time k * (10^9 + drift) / |drift| (rounded up).
+    uint32_t numerator = uint32_t(1000000000L + drift);
+    m_divisor = drift > 0 ? drift : -drift;
+    m_interval = numerator / m_divisor;
+    m_remainder = numerator % m_divisor;
+    m_nextStep = m_interval;
+    m_error = m_divisor - 1 + m_remainder;
+    if (m_error >= m_divisor) {
+        m_error -= m_divisor;
+        ++m_nextStep;
+    }
+}
+
+
+// converts a number of cycles to microseconds, rounding up
+static Microseconds cyclesToMicroseconds(uint32_t cycles,
+        const TimingCosts& costs) {
+    return (cycles + costs.cyclesPerMicrosecond - 1) /
+        costs.cyclesPerMicrosecond;
+}
+
+
+// the number of channels in a set
+static unsigned countChannels(ChannelMask channels) {
+    unsigned count = 0;
+    for (; channels != 0; channels &= channels - 1) {
+        ++count;
+    }
+    return count;
+}
+
+
+void analyzeTiming(const PulseStateCommand* commands, int numCommands,
+        const TimingCosts& costs, uint32_t maxChanges,
+        TimingAnalysis* result) {
+    result->numChanges = 0;
+    result->maxCommandsPerChange = 0;
+    result->minChangeSpacing = forever;
+    result->minChangeSpacingAt = 0;
+    result->maxError = 0;
+    result->maxErrorAt = 0;
+    result->lateChanges = 0;
+    result->truncated = false;
+
+    ChangeQueue queue(commands, numCommands, false);
+
+    // the predicted time on the firmware's clock (which starts once the
+    // first changes have been worked out) and the time of the last change
+    // applied
+    Microseconds now = 0;
+    bool started = false;
+    Microseconds lastChangeTime = 0;
+
+    // the outputs after the last change applied, and the time of the last
+    // change to them
+    ChannelMask outputs = 0;
+    Microseconds lastEdgeTime = 0;
+
+    while (!queue.finished() && !result->truncated) {
+        if (queue.ready() && (started || !queue.canFill()) &&
+                now - lastChangeTime >= queue.next().time - lastChangeTime) {
+            // apply the next change
+            const PendingChange& change = queue.next();
+            if (now != change.time) {
+                ++result->lateChanges;
+            }
+            now += cyclesToMicroseconds(costs.perChange +
+                    countChannels(change.state ^ outputs) * costs.perWrite,
+                    costs);
+            if (now - change.time > result->maxError) {
+                result->maxError = now - change.time;
+                result->maxErrorAt = change.time;
+            }
+
+            if (change.state != outputs) {
+                if (result->numChanges > 0 &&
+                        change.time - lastEdgeTime <
+                            result->minChangeSpacing) {
+                    result->minChangeSpacing = change.time - lastEdgeTime;
+                    result->minChangeSpacingAt = change.time;
+                }
+                lastEdgeTime = change.time;
+                outputs = change.state;
+
+                if (++result->numChanges == maxChanges) {
+                    result->truncated = !queue.finished();
+                }
+            }
+
+            lastChangeTime = change.time;
+            queue.pop();
+            started = true;
+        } else if (queue.canFill()) {
+            // work out the next change
+            uint32_t commandsRun = queue.program()->commandsRun();
+            queue.fill();
+            commandsRun = queue.program()->commandsRun() - commandsRun;
+
+            if (started) {
+                now += cyclesToMicroseconds(
+                        costs.perStep + commandsRun * costs.perCommand, costs);
+            }
+            if (commandsRun > result->maxCommandsPerChange) {
+                result->maxCommandsPerChange = commandsRun;
+            }
+        } else {
+            // wait for the next change
+            now = queue.next().time;
+        }
+    }
+}
+
+// adds a value to an FNV-1a hash, one byte at a time (least significant
+// first, so that the hash doesn't depend on the processor)
+static uint32_t hashValue(uint32_t hash, uint32_t value, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; ++i) {
+        hash = (hash ^ (value & 0xFF)) * 16777619UL;
+        value >>= 8;
+    }
+    return hash;
+}
+
+
+uint32_t hashProgram(const PulseStateCommand* commands, int numCommands) {
+    uint32_t hash = 2166136261UL;
+    for (int i = 0; i < numCommands; ++i) {
+        const PulseStateCommand& command = commands[i];
+        if (command.type == PulseStateCommand::endProgram) {
+            break;
+        } else if (command.type == PulseStateCommand::noOp) {
+            continue;
+        }
+
+        hash = hashValue(hash, command.type, 1);
+        switch (command.type) {
+            case PulseStateCommand::setChannel:
+                hash = hashValue(hash, command.channel, 1);
+                hash = hashValue(hash, command.onTime, 4);
+                hash = hashValue(hash, command.offTime, 4);
+                if (command.poisson) {
+                    // (only added for Poisson channels, so the hashes of
+                    // other programs stay the same)
+                    hash = hashValue(hash, 1, 1);
+                }
+                break;
+
+            case PulseStateCommand::wait:
+                hash = hashValue(hash, command.waitTime, 4);
+                break;
+
+            case PulseStateCommand::randomWait:
+                hash = hashValue(hash, command.waitTime, 4);
+                hash = hashValue(hash, command.waitRange, 4);
+                break;
+
+            case PulseStateCommand::seedRandom:
+                hash = hashValue(hash, command.seed, 4);
+                break;
+
+            case PulseStateCommand::rampChannel:
+                hash = hashValue(hash, command.channel, 1);
+                hash = hashValue(hash, command.rampWidth, 1);
+                hash = hashValue(hash, command.rampTarget, 4);
+                hash = hashValue(hash, command.rampTime, 4);
+                break;
+
+            case PulseStateCommand::burstChannel:
+                hash = hashValue(hash, command.channel, 1);
+                hash = hashValue(hash, command.burstPulses, 4);
+                hash = hashValue(hash, command.burstPeriod, 4);
+                break;
+
+            case PulseStateCommand::pairChannels:
+                hash = hashValue(hash, command.channel, 1);
+                hash = hashValue(hash, command.pairedChannel, 1);
+                hash = hashValue(hash, command.pairGap, 4);
+                break;
+
+            case PulseStateCommand::repeat:
+                hash = hashValue(hash, command.repeatCount, 4);
+                break;
+
+            case PulseStateCommand::callSubroutine:
+                hash = hashValue(hash, command.subroutineStart, 4);
+                break;
+
+            default:
+                break;
+        }
+    }
+    return hash;
+}
+
+
+// true if the command leaves the channel on forever
+static bool turnsOn(const PulseStateCommand& command) {
+    return command.type == PulseStateCommand::setChannel &&
+        command.onTime == forever;
+}
+
+
+// true if the command leaves the channel off forever
+static bool turnsOff(const PulseStateCommand& command) {
+    return command.type == PulseStateCommand::setChannel &&
+        command.onTime == 0 &&
+        (command.offTime == 0 || command.offTime == forever);
+}
+
+
+// removes the no-op commands, returning the new number of commands
+static int removeNoOps(PulseStateCommand* commands, int numCommands,
+        uint16_t* sourceLines) {
+    // where the subroutines were and where they are moved to, for the calls
+    // after them (the parser allows at most maxNamedValues of them)
+    uint32_t oldStart[maxNamedValues];
+    uint32_t newStart[maxNamedValues];
+    unsigned numSubroutines = 0;
+
+    int n = 0;
+    for (int i = 0; i < numCommands; ++i) {
+        PulseStateCommand& command = commands[i];
+        if (command.type == PulseStateCommand::defineSubroutine &&
+                numSubroutines < maxNamedValues) {
+            oldStart[numSubroutines] = i;
+            newStart[numSubroutines++] = n;
+        } else if (command.type == PulseStateCommand::callSubroutine) {
+            for (unsigned j = 0; j < numSubroutines; ++j) {
+                if (command.subroutineStart == oldStart[j]) {
+                    command.subroutineStart = newStart[j];
+                    break;
+                }
+            }
+        }
+
+        if (command.type != PulseStateCommand::noOp) {
+            if (sourceLines) {
+                sourceLines[n] = sourceLines[i];
+            }
+            commands[n++] = commands[i];
+        }
+    }
+    return n;
+}
+
+
+// finds the "end repeat" matching the repeat at the given index
+static int findEndRepeat(const PulseStateCommand* commands, int numCommands,
+        int repeatIndex) {
+    unsigned depth = 0;
+    for (int i = repeatIndex; i < numCommands; ++i) {
+        if (commands[i].type == PulseStateCommand::repeat) {
+            ++depth;
+        } else if (commands[i].type == PulseStateCommand::endRepeat &&
+                --depth == 0) {
+            return i;
+        }
+    }
+    return numCommands;
+}
+
+
+// merges consecutive waits and drops zero length waits
+static void mergeWaits(PulseStateCommand* commands, int numCommands) {
+    int lastWait = -1;
+    for (int i = 0; i < numCommands; ++i) {
+        PulseStateCommand& command = commands[i];
+        if (command.type == PulseStateCommand::noOp) {
+            continue;
+        } else if (command.type != PulseStateCommand::wait) {
+            lastWait = -1;
+        } else if (command.waitTime == 0) {
+            command.type = PulseStateCommand::noOp;
+        } else if (lastWait >= 0 &&
+                commands[lastWait].waitTime < forever - command.waitTime) {
+            commands[lastWait].waitTime += command.waitTime;
+            command.type = PulseStateCommand::noOp;
+        } else {
+            lastWait = i;
+        }
+    }
+}
+
+
+// drops settings that have no effect on the output
+static void removeRedundantSettings(PulseStateCommand* commands,
+        int numCommands) {
+    enum { unknown, on, off };
+
+    // what we know about each channel (all are off at the start), the last
+    // command that set it at this moment in time (if any), and what we knew
+    // before that command
+    uint8_t state[numChannels];
+    int setAt[numChannels];
+    uint8_t stateBeforeSet[numChannels];
+    for (unsigned i = 0; i < numChannels; ++i) {
+        state[i] = off;
+        setAt[i] = -1;
+    }
+
+    for (int i = 0; i < numCommands; ++i) {
+        PulseStateCommand& command = commands[i];
+        switch (command.type) {
+            case PulseStateCommand::setChannel: {
+                unsigned channel = command.channel - 1;
+                if (setAt[channel] >= 0) {
+                    // overridden before it had any effect
+                    commands[setAt[channel]].type = PulseStateCommand::noOp;
+                    state[channel] = stateBeforeSet[channel];
+                    setAt[channel] = -1;
+                }
+
+                if ((turnsOn(command) && state[channel] == on) ||
+                        (turnsOff(command) && state[channel] == off)) {
+                    command.type = PulseStateCommand::noOp;
+                } else {
+                    stateBeforeSet[channel] = state[channel];
+                    state[channel] = turnsOn(command) ? on :
+                        turnsOff(command) ? off : unknown;
+                    setAt[channel] = i;
+                }
+                break;
+            }
+
+            case PulseStateCommand::wait:
+            case PulseStateCommand::randomWait:
+                for (unsigned j = 0; j < numChannels; ++j) {
+                    setAt[j] = -1;
+                }
+                break;
+
+            case PulseStateCommand::rampChannel:
+            case PulseStateCommand::burstChannel:
+                // ramps and bursts start from the channel's setting (and
+                // have no effect on a channel that's simply on or off)
+                setAt[command.channel - 1] = -1;
+                break;
+
+            case PulseStateCommand::pairChannels:
+                // (which may turn off the second channel)
+                setAt[command.channel - 1] = -1;
+                setAt[command.pairedChannel - 1] = -1;
+                state[command.pairedChannel - 1] = unknown;
+                break;
+
+            case PulseStateCommand::repeat:
+            case PulseStateCommand::endRepeat:
+            case PulseStateCommand::defineSubroutine:
+            case PulseStateCommand::endSubroutine:
+            case PulseStateCommand::callSubroutine:
+                // these can be reached from more than one place (or, for
+                // calls, can set any channel)
+                for (unsigned j = 0; j < numChannels; ++j) {
+                    state[j] = unknown;
+                    setAt[j] = -1;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+
+// moves "turn on" and "turn off" commands at the start of a repeat that
+// are the only commands in the repeat setting their channel in front of
+// the repeat (innermost repeats first, so settings can move out of several
+// levels of repeats).
+static void hoistLoopInvariants(PulseStateCommand* commands,
+        int numCommands, uint16_t* sourceLines) {
+    for (int end = 0; end < numCommands; ++end) {
+        if (commands[end].type != PulseStateCommand::endRepeat) {
+            continue;
+        }
+
+        int start = end - 1;
+        unsigned depth = 0;
+        while (depth > 0 || commands[start].type != PulseStateCommand::repeat) {
+            if (commands[start].type == PulseStateCommand::endRepeat) {
+                ++depth;
+            } else if (commands[start].type == PulseStateCommand::repeat) {
+                --depth;
+            }
+            --start;
+        }
+
+        // look through the settings at the start of the repeat, before
+        // anything takes time
+        int i = start + 1;
+        while (i < end && (commands[i].type == PulseStateCommand::setChannel ||
+                    commands[i].type == PulseStateCommand::noOp)) {
+            const PulseStateCommand& command = commands[i];
+
+            bool invariant = turnsOn(command) || turnsOff(command);
+            for (int j = start + 1; j < end && invariant; ++j) {
+                invariant = j == i ||
+                    (commands[j].type != PulseStateCommand::callSubroutine &&
+                     (commands[j].type != PulseStateCommand::setChannel ||
+                      commands[j].channel != command.channel) &&
+                     (commands[j].type != PulseStateCommand::pairChannels ||
+                      commands[j].pairedChannel != command.channel));
+            }
+
+            if (invariant) {
+                PulseStateCommand hoisted = command;
+                for (int j = i; j > start; --j) {
+                    commands[j] = commands[j - 1];
+                }
+                commands[start] = hoisted;
+
+                if (sourceLines) {
+                    uint16_t hoistedLine = sourceLines[i];
+                    for (int j = i; j > start; --j) {
+                        sourceLines[j] = sourceLines[j - 1];
+                    }
+                    sourceLines[start] = hoistedLine;
+                }
+                ++start;
+            }
+            ++i;
+        }
+    }
+}
+
+
+// replaces repeats that turn one channel on and off with a pulse train
+static void collapsePulseLoops(PulseStateCommand* commands,
+        int numCommands, uint16_t* sourceLines) {
+    for (int i = 0; i + 5 < numCommands; ++i) {
+        PulseStateCommand* loop = commands + i;
+        if (loop[0].type != PulseStateCommand::repeat ||
+                loop[0].repeatCount == 0 ||
+                !turnsOn(loop[1]) ||
+                loop[2].type != PulseStateCommand::wait ||
+                !turnsOff(loop[3]) || loop[3].channel != loop[1].channel ||
+                loop[4].type != PulseStateCommand::wait ||
+                loop[5].type != PulseStateCommand::endRepeat) {
+            continue;
+        }
+
+        Microseconds onTime = loop[2].waitTime;
+        Microseconds offTime = loop[4].waitTime;
+        if (onTime == 0 || offTime == 0 || onTime >= forever - offTime ||
+                loop[0].repeatCount >= forever / (onTime + offTime)) {
+            continue;
+        }
+        Microseconds totalTime = loop[0].repeatCount * (onTime + offTime);
+
+        // the train ends with the last pulse; the channel is then turned
+        // off for the rest of the final period.
+        uint8_t channel = loop[1].channel;
+        loop[0].type = PulseStateCommand::setChannel;
+        loop[0].channel = channel;
+        loop[0].poisson = false;
+        loop[0].onTime = onTime;
+        loop[0].offTime = offTime;
+        loop[1].type = PulseStateCommand::wait;
+        loop[1].waitTime = totalTime - offTime;
+        loop[2] = loop[3];
+        loop[3].type = PulseStateCommand::wait;
+        loop[3].waitTime = offTime;
+        loop[4].type = PulseStateCommand::noOp;
+        loop[5].type = PulseStateCommand::noOp;
+
+        // the train comes from the "turn on", and each command after it
+        // from the one it replaced
+        if (sourceLines) {
+            uint16_t* lines = sourceLines + i;
+            lines[0] = lines[1];
+            lines[1] = lines[2];
+            lines[2] = lines[3];
+            lines[3] = lines[4];
+        }
+    }
+}
+
+
+// replaces repeats of a single iteration with their contents, and removes
+// empty repeats (which take no time, but can't be run by execute since
+// their "end repeat" would jump to itself).  Works from the innermost
+// repeats out, so removing a repeat can leave the one around it empty.
+static void unwrapSimpleRepeats(PulseStateCommand* commands,
+        int numCommands) {
+    for (int i = numCommands - 1; i >= 0; --i) {
+        if (commands[i].type == PulseStateCommand::repeat) {
+            int end = findEndRepeat(commands, numCommands, i);
+            bool empty = true;
+            for (int j = i + 1; j < end && empty; ++j) {
+                empty = commands[j].type == PulseStateCommand::noOp;
+            }
+            if (end < numCommands &&
+                    (empty || commands[i].repeatCount == 1)) {
+                commands[i].type = PulseStateCommand::noOp;
+                commands[end].type = PulseStateCommand::noOp;
+            }
+        }
+    }
+}
+
+
+int optimizeProgram(PulseStateCommand* commands, int numCommands,
+        uint16_t* sourceLines) {
+    numCommands = removeNoOps(commands, numCommands, sourceLines);
+    mergeWaits(commands, numCommands);
+    removeRedundantSettings(commands, numCommands);
+    numCommands = removeNoOps(commands, numCommands, sourceLines);
+
+    hoistLoopInvariants(commands, numCommands, sourceLines);
+    collapsePulseLoops(commands, numCommands, sourceLines);
+    unwrapSimpleRepeats(commands, numCommands);
+
+    removeRedundantSettings(commands, numCommands);
+    mergeWaits(commands, numCommands);
+    return removeNoOps(commands, numCommands, sourceLines);
+}
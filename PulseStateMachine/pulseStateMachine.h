@@ -1,6 +1,7 @@
 #ifndef PULSESTATEMACHINE_H
 #define PULSESTATEMACHINE_H
 #include <stdint.h>
+#include <stddef.h>
 
 // A duration of time, in microseconds.
 typedef uint32_t Microseconds;
@@ -8,29 +9,65 @@ typedef uint32_t Microseconds;
 // A duration much longer than any duration used in the program.
 const Microseconds forever = 0xFFFFFFFF;
 
-// Maximum number of pulse channels supported by the firmware.
-const unsigned numChannels = 8;
+// Maximum number of pulse channels supported by the firmware.  Boards with
+// more (or fewer) outputs override this at compile time, e.g.
+// -DPULSE_NUM_CHANNELS=32 (see the board targets in the firmware Makefile).
+#ifndef PULSE_NUM_CHANNELS
+#define PULSE_NUM_CHANNELS 8
+#endif
+const unsigned numChannels = PULSE_NUM_CHANNELS;
 
-// Maximum number of nested repeats
+// A set of channels, where bit i represents channel i + 1.
+#if PULSE_NUM_CHANNELS <= 8
+typedef uint8_t ChannelMask;
+#elif PULSE_NUM_CHANNELS <= 16
+typedef uint16_t ChannelMask;
+#elif PULSE_NUM_CHANNELS <= 32
+typedef uint32_t ChannelMask;
+#elif PULSE_NUM_CHANNELS <= 64
+typedef uint64_t ChannelMask;
+#else
+#error "PULSE_NUM_CHANNELS must be 64 or less"
+#endif
+
+// Maximum number of nested repeats and subroutine calls (at most 32, see
+// RepeatStack::m_calls)
 const unsigned maxRepeatNesting = 20;
 
-// Store the state of repeats in a running program.
+// Store the state of repeats and subroutine calls in a running program.
 class RepeatStack {
     private:
+        // the start of each loop, or the command to return to for calls
         int m_loopTarget[maxRepeatNesting];
         uint32_t m_repeatCount[maxRepeatNesting];
         unsigned m_size;
 
+        // the levels that are calls rather than loops (bit i for level i)
+        uint32_t m_calls;
+
     public:
-        RepeatStack() { m_size = 0; };
+        RepeatStack() { m_size = 0; m_calls = 0; };
+
+        // leave every loop and call
+        void clear() { m_size = 0; m_calls = 0; }
 
         // enter into a new repeat loop
         void pushRepeat(int loopTarget, uint32_t repeatCount) {
             m_loopTarget[m_size] = loopTarget;
             m_repeatCount[m_size] = repeatCount;
+            m_calls &= ~(uint32_t(1) << m_size);
             ++m_size;
         };
 
+        // enter into a subroutine, which returns to returnTarget (see
+        // getLoopTarget)
+        void pushCall(int returnTarget) {
+            m_loopTarget[m_size] = returnTarget;
+            m_repeatCount[m_size] = 0;
+            m_calls |= uint32_t(1) << m_size;
+            ++m_size;
+        }
+
         // decrement and return the number of iterations remaining
         uint32_t decrementRepeatCount() {
             return --(m_repeatCount[m_size - 1]);
@@ -41,46 +78,440 @@ class RepeatStack {
 
         // exit the current loop
         void pop() { --m_size; }
+
+        // the number of loops currently entered
+        unsigned depth() const { return m_size; }
+
+        // the iterations remaining in a loop (0 is the outermost)
+        uint32_t repeatCount(unsigned level) const {
+            return m_repeatCount[level];
+        }
+
+        // true if a level is a subroutine call rather than a loop
+        bool isCall(unsigned level) const {
+            return (m_calls >> level) & 1;
+        }
 };
 
 
-// Stores the state of a single channel that can generate a square wave.
-// call advanceTime to update the on/off state to reflect where you are
-// in the waveform.
-class PulseChannel {
+// A fast pseudo-random number generator (Marsaglia's xorshift32) for the
+// random timing in programs.  A program always starts with the same seed
+// (unless it sets another with "seed"), so it makes the same choices each
+// time it runs, on the device and in the simulator alike.
+class RandomGenerator {
     private:
-        enum { numStates=2 };
-        bool m_on;
-        Microseconds m_stateTime[numStates];
-        Microseconds m_timeInState;
+        uint32_t m_state;
 
     public:
-        // Constructor
-        PulseChannel();
+        // the seed a program starts with
+        static const uint32_t defaultSeed = 2463534242UL;
+
+        RandomGenerator() : m_state(defaultSeed) {}
+
+        // starts the sequence given by a seed (any value, including 0)
+        void seed(uint32_t seed) {
+            m_state = seed ^ defaultSeed;
+            if (m_state == 0) {
+                // (xorshift never leaves 0)
+                m_state = defaultSeed;
+            }
+        }
+
+        // the next number in the sequence
+        uint32_t next() {
+            m_state ^= m_state << 13;
+            m_state ^= m_state >> 17;
+            m_state ^= m_state << 5;
+            return m_state;
+        }
+
+        // a time from 0 to range (inclusive), all equally likely
+        Microseconds uniform(Microseconds range) {
+            return range == forever ? next() : next() % (range + 1);
+        }
+
+        // a time from an exponential distribution with the given mean,
+        // e.g. the gaps between the events of a Poisson process (at least
+        // 1 us, so pulses never merge, and less than forever).  It's worked
+        // out without floating point, so every board gives the same times
+        // as the simulator, each within about mean / 65536 of the exact
+        // value.
+        Microseconds exponential(Microseconds mean);
+};
+
+
+// Stores the state of all of the channels, each of which can generate a
+// square wave.  Call advanceTime to update the on/off states to reflect
+// where you are in the waveforms.
+//
+// The state is kept as a structure of arrays: the on/off states of all
+// channels share a single bitmask and the per-channel times are kept in
+// parallel arrays.  The pulsing channels are also kept in a min-heap ordered
+// by the time of their next state change, so finding the next change takes
+// constant time and each state change costs O(log n) in the number of
+// channels, rather than every step scanning every channel.  Channels are
+// numbered from 0 here (i.e. channel 0 is "channel 1" in a program).
+class ChannelBank {
+    private:
+        // channels that are currently on
+        ChannelMask m_on;
+
+        // channels that will change state again, i.e. that are pulsing
+        ChannelMask m_active;
+
+        // pulsing channels that are parked (see park): they stay scheduled,
+        // so that they keep their phase, but are left out of the outputs.
+        // Once a parked channel has changed state its changes follow its
+        // on and off times, so it's only touched every few periods (see
+        // parkedSkip).
+        ChannelMask m_parked;
+        ChannelMask m_parkedSkipping;
+
+        // pulsing channels whose off times are random (see setOnOffTime)
+        ChannelMask m_poisson;
+
+        RandomGenerator m_random;
+
+        // channels being ramped (see rampTo), and those of them whose pulse
+        // width is ramped rather than their rate
+        ChannelMask m_ramping;
+        ChannelMask m_rampWidth;
+
+        // channels grouped into bursts (see burst)
+        ChannelMask m_burst;
+
+        // channels whose pulses are the first phase of a pair (see pair),
+        // the channels giving the second phases, and the first phase
+        // channels that are between the two phases
+        ChannelMask m_paired;
+        ChannelMask m_secondPhase;
+        ChannelMask m_betweenPhases;
+
+        // time elapsed since the bank was created (wraps around)
+        Microseconds m_now;
+
+        Microseconds m_onTime[numChannels];
+        Microseconds m_offTime[numChannels];
+
+        // the pulse width or period each ramp goes from and to, the value
+        // of m_now when it started, and how long it lasts
+        Microseconds m_rampFrom[numChannels];
+        Microseconds m_rampTo[numChannels];
+        Microseconds m_rampStart[numChannels];
+        Microseconds m_rampLength[numChannels];
+
+        // the number of pulses in each burst of a channel in bursts, the
+        // pulses left in the current one, and the time from the start of
+        // one burst to the next
+        uint16_t m_burstPulses[numChannels];
+        uint16_t m_burstLeft[numChannels];
+        Microseconds m_burstPeriod[numChannels];
+
+        // for each first phase channel, the channel giving its second
+        // phase, the gap between the phases, and the time from the end of
+        // the second phase to the next pulse
+        uint8_t m_partner[numChannels];
+        Microseconds m_pairGap[numChannels];
+        Microseconds m_pairRest[numChannels];
+
+        // value of m_now at which each active channel next changes state
+        Microseconds m_changeTime[numChannels];
+
+        // min-heap of the active channels ordered by their next change, and
+        // the position of each active channel within the heap.
+        uint8_t m_heap[numChannels];
+        uint8_t m_heapPosition[numChannels];
+        uint8_t m_heapSize;
+
+        static ChannelMask bit(unsigned channel) {
+            return ChannelMask(1) << channel;
+        }
+
+        // moves a ramping channel's settings along to those for a pulse
+        // starting at the given time
+        void updateRamp(unsigned channel, Microseconds start);
+
+        // the off time after the last pulse of a burst
+        Microseconds burstGap(unsigned channel) const;
+
+        // puts a parked channel back in the outputs, in the state its
+        // timeline has reached (see park)
+        void resume(unsigned channel);
+
+        // how far to move a parked channel's next change on once it's
+        // overshoot microseconds late: a whole number of periods, and at
+        // least about parkedStride, so that it's rarely touched.  (Channels
+        // with longer periods are stepped as usual.)
+        enum { parkedStride = 1UL << 30 };
+        Microseconds parkedSkip(unsigned channel, Microseconds overshoot) const;
+
+        // moves an active channel (and its second phase channel, if it's
+        // paired) on to its next state, which starts at the given time,
+        // returning how long that state lasts
+        Microseconds nextState(unsigned channel, Microseconds start);
+
+        // ends the pairing the channel is part of, if any, leaving the
+        // second phase channel off
+        void unpair(unsigned channel);
+
+        // how long the given channel stays in the given state, from the
+        // moment (start) it enters that state (drawing a random off time
+        // for Poisson channels)
+        Microseconds stateTime(unsigned channel, bool on,
+                Microseconds start) {
+            if (on && (m_ramping & bit(channel))) {
+                updateRamp(channel, start);
+            }
+            if (!on && (m_poisson & bit(channel))) {
+                return m_random.exponential(m_offTime[channel]);
+            }
+            if (!on && (m_burst & bit(channel)) &&
+                    --m_burstLeft[channel] == 0) {
+                m_burstLeft[channel] = m_burstPulses[channel];
+                return burstGap(channel);
+            }
+            return on ? m_onTime[channel] : m_offTime[channel];
+        }
+
+        // time until an active channel changes state (wrap-around safe)
+        Microseconds timeLeft(unsigned channel) const {
+            return m_changeTime[channel] - m_now;
+        }
+
+        // heap maintenance
+        void heapSet(unsigned position, unsigned channel);
+        void siftUp(unsigned position);
+        void siftDown(unsigned position);
+        void schedule(unsigned channel, Microseconds changeTime);
+        void unschedule(unsigned channel);
+
+    public:
+        // Constructor; all channels start off.
+        ChannelBank();
+
+        // Turns every channel off and starts the clock and the random
+        // numbers again, as if the bank had just been created.
+        void reset();
+
+        // the set of channels that should be on at this moment in time.
+        ChannelMask onChannels() const { return m_on & ~m_parked; }
+
+        // the set of channels that will change state again (i.e. that are
+        // not simply on or off forever).
+        ChannelMask activeChannels() const { return m_active & ~m_parked; }
 
         // true iff the channel should be on at this moment in time.
-        bool on() const { return m_on; }
+        bool on(unsigned channel) const {
+            return (onChannels() & bit(channel)) != 0;
+        }
+
+        // gets the current amount of time the channel spends in the on
+        // state before switching off.
+        Microseconds onTime(unsigned channel) const {
+            return m_onTime[channel];
+        }
 
-        // gets the current amount of time spent in the on state before
-        // switching off.
-        Microseconds onTime() const { return m_stateTime[true]; }
+        // gets the current amount of time the channel spends in the off
+        // state before switching on.
+        Microseconds offTime(unsigned channel) const {
+            return m_offTime[channel];
+        }
 
-        // gets the current amount of time spent in the off state before
-        // switching on.
-        Microseconds offTime() const { return m_stateTime[false]; }
+        // true if the channel's off times are random (see setOnOffTime).
+        bool poisson(unsigned channel) const {
+            return (m_poisson & bit(channel)) != 0;
+        }
 
         // sets how long the channel should spend in the on and off state
         // for each period of the square wave.  Note that the sum of the
-        // two times is the period of the square wave.
-        void setOnOffTime(Microseconds on, Microseconds off);
+        // two times is the period of the square wave.  If poisson is true
+        // (and the channel pulses), each off time is instead drawn from an
+        // exponential distribution with off as its mean, so that the
+        // pulses arrive as a Poisson process with a dead time of on.
+        void setOnOffTime(unsigned channel, Microseconds on, Microseconds off,
+                bool poisson = false);
+
+        // Ramps a pulsing channel's rate (or, if width is true, its pulse
+        // width) from its current setting to target (a period or a pulse
+        // width) over the given time.  Each pulse is given the settings for
+        // the moment it starts: rates change linearly in frequency, with
+        // the pulse width kept, and widths change linearly with the period
+        // kept.  The channel keeps the target settings once the ramp ends,
+        // until it's set again.  Channels that aren't pulsing are left as
+        // they are.
+        void rampTo(unsigned channel, Microseconds target,
+                Microseconds time, bool width);
+
+        // Groups a pulsing channel's pulses into bursts of the given number
+        // of pulses (counting the one it's on), with the bursts starting
+        // period apart, e.g. for theta burst stimulation.  The pulses in a
+        // burst keep the channel's on and off times (which a ramp can
+        // change), and the gap after each burst makes up the rest of the
+        // period, or is the usual off time if the burst doesn't fit in it.
+        // The channel stays in bursts until it's set again.  Channels that
+        // aren't pulsing, or are Poisson channels, are left as they are.
+        void burst(unsigned channel, uint16_t pulses, Microseconds period);
+
+        // Pairs two channels for biphasic pulses: gap after each of first's
+        // pulses ends, second gives a pulse of the same width (e.g. for the
+        // two phases of a charge-balanced pulse).  The pair is scheduled as
+        // one channel, so the gap is exact, and with no gap the first phase
+        // ends in the same change that starts the second.  First keeps its
+        // timing (including any ramp, bursts or Poisson times), except that
+        // its next pulse waits for the second phase to finish.  Setting
+        // either channel again ends the pairing.  If first isn't pulsing,
+        // neither channel is changed.
+        void pair(unsigned first, unsigned second, Microseconds gap);
+
+        // true if the channel pulses with fixed on and off times, i.e. isn't
+        // a Poisson channel, being ramped, in bursts or paired
+        bool regular(unsigned channel) const {
+            return ((m_poisson | m_ramping | m_burst | m_paired |
+                        m_secondPhase) & bit(channel)) == 0;
+        }
+
+        // Leaves a regular channel out of the outputs (so it reads as off)
+        // while its pulses carry on in the background, e.g. while the
+        // hardware generates them instead.  A later ramp, burst or pair
+        // continues from the state and phase the channel has reached, just
+        // as if it had never been parked; setting the channel again ends
+        // the parking.
+        void park(unsigned channel);
+
+        // the generator for the random off times, which programs share for
+        // their other random choices
+        RandomGenerator* random() { return &m_random; }
 
-        // update the on/off state of the channel to reflect the passage of
-        // dt microseconds of time.
+        // update the on/off state of every channel to reflect the passage
+        // of dt microseconds of time.
         void advanceTime(Microseconds dt);
 
         // Compute the minimum time that must advance for the next state
-        // change to occur.
-        Microseconds timeUntilNextStateChange() const;
+        // change to occur on the given channel.
+        Microseconds timeUntilNextStateChange(unsigned channel) const {
+            return ((m_active & ~m_parked) & bit(channel)) ?
+                timeLeft(channel) : forever;
+        }
+
+        // Compute the minimum time that must advance for the next state
+        // change to occur on any channel (forever if all are idle).
+        Microseconds timeUntilNextStateChange() const {
+            return m_heapSize ? timeLeft(m_heap[0]) : forever;
+        }
+};
+
+
+// The errors found when parsing a line of a program (see parseErrorMessage
+// for their descriptions).  The firmware reports errors by their numbers,
+// which the GUI translates, so new errors go at the end so that the numbers
+// of the others stay the same.
+enum ParseError {
+    parseOk,
+    errorUnrecognizedCommand,
+    errorExpectedRepeatOrProgram,
+    errorEndProgramInRepeat,
+    errorEndRepeatWithoutRepeat,
+    errorExpectedRepeatCount,
+    errorExpectedTimes,
+    errorExpectedColon,
+    errorNestedTooDeeply,
+    errorExpectedChannel,
+    errorExpectedChannelNumber,
+    errorChannelOutOfRange,
+    errorExpectedTo,
+    errorExpectedTime,
+    errorExpectedPulses,
+    errorExpectedAtOrEvery,
+    errorExpectedFrequency,
+    errorPulseLongerThanPeriod,
+    errorExpectedOnOrOff,
+    errorTextAfterCommand,
+    errorCommandAfterEndProgram,
+    errorMissingEndProgram,
+    errorExpectedName,
+    errorExpectedEquals,
+    errorNameTooLong,
+    errorNameAlreadyDefined,
+    errorTooManyNames,
+    errorUnknownName,
+    errorExpectedValue,
+    errorExpectedCloseParen,
+    errorUnitsDontMatch,
+    errorDivisionByZero,
+    errorEndProgramInDefine,
+    errorEndDefineWithoutDefine,
+    errorEndDefineInRepeat,
+    errorDefineNotAtTopLevel,
+    errorNotASubroutine,
+    errorRecursiveCall,
+    errorExpectedSeed,
+    errorRandomRangeBackwards,
+    errorExpectedRampTarget,
+    errorExpectedOver,
+    errorExpectedBurstCount,
+    errorExpectedWith,
+    errorExpectedAfter,
+    errorPairedWithItself,
+    errorZeroRepeatCount,
+    numParseErrors
+};
+
+#if !defined(__AVR__)
+// A human-readable description of a parse error (NULL for parseOk).  The
+// descriptions are left out of the AVR firmware to save RAM.
+const char* parseErrorMessage(ParseError error);
+#endif
+
+
+// Maximum number of names a program can define with "let", and the length
+// of each name
+const unsigned maxNamedValues = 8;
+const unsigned maxNameLength = 7;
+
+// The value of an expression in a program, e.g. "2 * width + 5 ms".  Times
+// are kept in microseconds and frequencies in hertz.  Whole numbers that
+// fit in a uint32_t are kept exactly in integer as well (e.g. for repeat
+// counts larger than a float can hold).  Subroutines (see "define") are
+// named with a ProgramValue too: integer is the index of their "define"
+// command and value the most levels of RepeatStack a call to them uses.
+struct ProgramValue {
+    enum Quantity {
+        plainNumber,
+        duration,
+        frequency,
+        subroutine
+    };
+
+    double value;
+    uint32_t integer;
+    bool isInteger;
+    uint8_t quantity;
+};
+
+// What the parser knows about the lines of a program it has read so far:
+// the depth of nested repeats, the names defined with "let" and "define",
+// and the number of commands so far (i.e. the index the next command will
+// have, not counting blank lines, "let"s or "end program").
+struct ParseState {
+    ParseState() { reset(); }
+
+    // forgets everything, e.g. before the start of another program
+    void reset() {
+        repeatDepth = 0;
+        numNames = 0;
+        numCommands = 0;
+        definingSubroutine = -1;
+    }
+
+    unsigned repeatDepth;
+    unsigned numCommands;
+
+    // the name of the subroutine being defined, or -1 outside "define"
+    int8_t definingSubroutine;
+
+    uint8_t numNames;
+    char names[maxNamedValues][maxNameLength + 1];
+    ProgramValue values[maxNamedValues];
 };
 
 
@@ -101,18 +532,91 @@ class PulseChannel {
 //
 // Formal syntax:
 //
-//    command := "end" |
-//               "change" channel "to repeat" time "on" time "off" |
+//    command := "end program" |
+//               "repeat" expression "times:" |
+//               "end repeat" |
+//               "set" channel "to" expression ["poisson"] "pulses at"
+//                   expression |
+//               "set" channel "to" expression ["poisson"] "pulses every"
+//                   expression |
 //               "turn on" channel |
 //               "turn off" channel |
-//               "wait" time;
-//    channel := "channel" integer;
-//    time := integer timeunit;
-//    timeunit := "s" | "ms" | "us" |
+//               "ramp" channel "to" expression "pulses over" expression |
+//               "ramp" channel "to" expression "over" expression |
+//               "ramp" channel "to every" expression "over" expression |
+//               "burst" channel "to" expression "pulses at" expression |
+//               "burst" channel "to" expression "pulses every" expression |
+//               "pair" channel "with" channel "after" expression |
+//               "wait" expression |
+//               "wait random" expression "to" expression |
+//               "seed" expression |
+//               "let" name "=" expression |
+//               "define" name ":" |
+//               "end define" |
+//               "call" name;
+//    channel := "channel" expression;
+//    expression := term { ("+" | "-") term };
+//    term := factor { ("*" | "/") factor };
+//    factor := (number | name | "(" expression ")") [unit];
+//    unit := "s" | "ms" | "us" |
 //               "\xB5s" |                 # latin 1 micro
 //               "\x00B5s" |               # utf8 micro
-//               "\x03BCs";                # greek mu
-//    integer := "[0-9]+"
+//               "\x03BCs" |               # greek mu
+//               "Hz" | "kHz";
+//    number := "[0-9]*(\.[0-9]*)?"
+//    name := "[a-zA-Z_]+"                 # other than a keyword
+//
+// Expressions are worked out when the line is parsed, so a name only
+// stands for the value it was given.  Times and frequencies have to be
+// added to (or subtracted from) the same kind of quantity, but can be
+// multiplied or divided by plain numbers, e.g. "let period = 1 / rate".
+//
+// The commands between "define" and "end define" (a subroutine) are
+// skipped where they are written, and run instead wherever the
+// subroutine is called, e.g.
+//
+//        define flash:
+//            turn on channel 2
+//            wait 5 ms
+//            turn off channel 2
+//        end define
+//        call flash
+//        wait 1 s
+//        call flash
+//
+// "wait random 10 ms to 50 ms" waits for a time between the two, all
+// equally likely, and "poisson pulses" are pulses whose start times form a
+// Poisson process (with the given mean rate, and with each pulse finishing
+// before the next starts).  The choices come from a RandomGenerator, so a
+// program makes the same ones each time it's run (or, after "seed 12",
+// the ones for that seed).
+//
+// "ramp" sweeps a pulsing channel smoothly from its current setting, e.g.
+//
+//        set channel 1 to 5 ms pulses at 10 Hz
+//        ramp channel 1 to 100 Hz over 5 s
+//        wait 5 s
+//
+// sweeps the rate up to 100 Hz (with 5 ms pulses), and "ramp channel 1 to
+// 2 ms pulses over 5 s" would narrow the pulses instead, keeping the rate.
+// Like "set", a ramp doesn't wait for itself to finish (see
+// ChannelBank::rampTo).
+//
+// "burst" groups a pulsing channel's pulses into bursts, e.g.
+//
+//        set channel 1 to 1 ms pulses at 100 Hz
+//        burst channel 1 to 4 pulses at 5 Hz
+//
+// gives bursts of four 100 Hz pulses, starting five times a second (see
+// ChannelBank::burst).
+//
+// "pair channel 1 with channel 2 after 50 us" makes channel 2 give the
+// second phase of channel 1's pulses: a pulse of the same width, starting
+// 50 us after each of channel 1's ends (see ChannelBank::pair).
+//
+// A subroutine has to be defined (at the top level of the program) before
+// it is called, so it can't call itself.  The calls and the repeats they
+// are in share the maxRepeatNesting levels of RepeatStack.
 //
 struct PulseStateCommand {
     public:
@@ -122,37 +626,98 @@ struct PulseStateCommand {
             wait,
             repeat,
             endRepeat,
-            noOp
+            noOp,
+            defineSubroutine,
+            endSubroutine,
+            callSubroutine,
+            randomWait,
+            seedRandom,
+            rampChannel,
+            burstChannel,
+            pairChannels
         };
 
         Type type;
         union {
             struct {
+                // (ramps, bursts and pairs share the channel with setChannel;
+                // for pairs, it's the first phase channel)
                 uint8_t channel;
-                Microseconds onTime;
-                Microseconds offTime;
+                union {
+                    bool poisson;
+                    // (true to ramp the pulse width rather than the rate)
+                    bool rampWidth;
+                    // the second phase channel
+                    uint8_t pairedChannel;
+                };
+                union {
+                    Microseconds onTime;
+                    // the pulse width or period to ramp to
+                    Microseconds rampTarget;
+                    uint32_t burstPulses;
+                    Microseconds pairGap;
+                };
+                union {
+                    Microseconds offTime;
+                    Microseconds rampTime;
+                    Microseconds burstPeriod;
+                };
             };
             struct {
+                // (for random waits, the shortest wait, and how much
+                // longer it can be)
                 Microseconds waitTime;
+                Microseconds waitRange;
             };
             struct {
                 uint32_t repeatCount;
             };
+            struct {
+                // the index of the subroutine's "define" command
+                uint32_t subroutineStart;
+            };
+            struct {
+                uint32_t seed;
+            };
         };
 
     public:
         // Constructor.
         PulseStateCommand() : type(noOp) {};
 
-        // Converts one line of human-readable text (input) into a
-        // pulseStateCommand.  The error parameter will be set to NULL
-        // if the conversion was successful; otherwise the error parameter
-        // will point to a human-readable string describing the parsing error.
-        // Repeat depth contains the current depth of nested repeats, and
-        // will be automatically incremented or decremented by the parsed
-        // command.
+        // the highest numbered channel the command sets (counting from 1),
+        // or 0 if it doesn't set one
+        unsigned lastChannel() const {
+            if (type == pairChannels) {
+                return channel > pairedChannel ? channel : pairedChannel;
+            }
+            return type == setChannel ? channel : 0;
+        }
+
+        // Converts one line of human-readable text (input, which ends at a
+        // '\0' or '\n') into a pulseStateCommand, returning parseOk if the
+        // conversion was successful and otherwise the parsing error.
+        // State holds the lines of the program before this one (the depth
+        // of nested repeats and the names defined so far), and is updated
+        // by the parsed command.  If length isn't NULL and the conversion
+        // was successful, it is set to the length of the line (i.e. the
+        // index of the '\0' or '\n').
+        ParseError parseFromString(const char* input, ParseState* state,
+                int* length = NULL);
+
+#if !defined(__AVR__)
+        // As above, for lines that don't use names: repeat depth contains
+        // the current depth of nested repeats, and will be automatically
+        // incremented or decremented by the parsed command (or may be NULL
+        // for a line outside any repeat).
+        ParseError parseFromString(const char* input, unsigned* repeatDepth);
+
+        // As above, but the error parameter will be set to NULL if the
+        // conversion was successful; otherwise the error parameter will
+        // point to a human-readable string describing the parsing error.
         void parseFromString(const char* input, const char** error,
                 unsigned* repeatDepth);
+#endif
 
         // Runs the command, updating the on/off times for the channels
         // (passed in the channels parameter) as needed.
@@ -173,9 +738,350 @@ struct PulseStateCommand {
         // The return value is the number of commands to advance (0 iff the
         // command was not completed this tick, 1 when a normal command
         // completed, and the relative distance to the jump target for jumps)
-        int execute(PulseChannel* channels, RepeatStack* stack,
+        int execute(ChannelBank* channels, RepeatStack* stack,
                 int commandId, Microseconds timeInState,
-                Microseconds* timeAvailable);
+                Microseconds* timeAvailable) const;
+};
+
+
+#if !defined(__AVR__)
+// The number of lines in a program's text, i.e. the most commands that
+// parseProgram can find in it.
+int countProgramLines(const char* text, size_t length);
+
+// Parses a whole program at once, e.g. the text of an editor or a file
+// mapped into memory.  The lines are separated by '\n' (or "\r\n"), and
+// the text doesn't have to end with a '\0' (a '\0' within a line is an
+// error, like any other text after a command).  The commands of the program
+// (without the blank lines, comments and "end program") are written to
+// commands, and the line each came from (counting from 0) to sourceLines;
+// both must have room for countProgramLines(text, length) entries.
+// Returns parseOk and the number of commands in *numCommands if the
+// program is complete, and otherwise the first error and the line it was
+// found on in *errorLine.
+ParseError parseProgram(const char* text, size_t length,
+        PulseStateCommand* commands, uint16_t* sourceLines,
+        int* numCommands, int* errorLine);
+#endif
+
+
+// Runs a program on its own clock rather than in real time, stopping at
+// each moment the outputs change.  The firmware uses this to work out the
+// upcoming changes ahead of time (while it would otherwise be waiting for
+// the next edge), and the simulator uses it to plot the same timeline the
+// firmware produces.
+class ProgramStepper {
+    private:
+        const PulseStateCommand* m_commands;
+        int m_numCommands;
+        int m_runningCommandIndex;
+        ChannelBank m_channels;
+        RepeatStack m_stack;
+
+        // time since the start of the program (wraps around)
+        Microseconds m_time;
+
+        // time spent so far in the running command (i.e. in a wait)
+        Microseconds m_timeInState;
+
+        // the outputs as of the last step
+        ChannelMask m_state;
+
+        bool m_finished;
+
+        // total number of commands run so far
+        uint32_t m_commandsRun;
+
+        // the wait drawn for the running command, if it's a random wait
+        PulseStateCommand m_drawnWait;
+
+        // draws the length of a random wait when it starts
+        void enterCommand();
+
+        // the running command, with a random wait replaced by the wait
+        // drawn for it when it started
+        const PulseStateCommand& runningCommand() const {
+            return m_commands[m_runningCommandIndex].type ==
+                PulseStateCommand::randomWait ? m_drawnWait :
+                m_commands[m_runningCommandIndex];
+        }
+
+    public:
+        // Constructor.  The program ends at its "end program" command or
+        // after its last command, whichever comes first.
+        ProgramStepper(const PulseStateCommand* commands, int numCommands);
+
+        // Starts another program from the beginning, as if the stepper had
+        // just been created for it (but without building a new one, which
+        // is too big to have two of on the stack of an Uno).
+        void reset(const PulseStateCommand* commands, int numCommands);
+
+        // Runs the program up to the next moment at which a channel turns
+        // on or off, or at which a command sets a channel.  *time is set to
+        // that moment (relative to the start of the program), *state to the
+        // channels that are on from then on, and *setChannels to the
+        // channels set by commands at that moment.  Returns false once the
+        // program has finished, in which case *time is the time at which it
+        // finished and every channel is off.
+        bool step(Microseconds* time, ChannelMask* state,
+                ChannelMask* setChannels);
+
+        // the state of the channels as of the last step (e.g. to look up
+        // the settings of the channels that were set).
+        ChannelBank* channels() { return &m_channels; }
+
+        // the total number of commands run so far (a measure of the work
+        // done by the steps).
+        uint32_t commandsRun() const { return m_commandsRun; }
+
+        // the index of the running command, and the loops it is in
+        int commandIndex() const { return m_runningCommandIndex; }
+        const RepeatStack* repeats() const { return &m_stack; }
+};
+
+
+// The number of upcoming changes to the outputs that the firmware works out
+// ahead of time.
+const unsigned prefetchDepth = 8;
+
+
+// An upcoming change to the outputs.
+struct PendingChange {
+    // time of the change, relative to the start of the program
+    Microseconds time;
+
+    // the channels that are on from then on
+    ChannelMask state;
+
+    // the channels set by commands at that moment
+    ChannelMask setChannels;
+
+    // true if this is the first change of a program that follows another
+    // (see ChangeQueue::chain)
+    bool startsProgram;
 };
 
+
+// A short queue of a program's upcoming changes to the outputs, worked out
+// ahead of time with a ProgramStepper.  The firmware fills it while it is
+// waiting for the next change, so that when the time of a change comes,
+// all that is left to do is to write the outputs.
+class ChangeQueue {
+    private:
+        ProgramStepper m_program;
+        PendingChange m_changes[prefetchDepth];
+        unsigned m_start;
+        unsigned m_size;
+        bool m_programFinished;
+        bool m_stopAtSettings;
+
+        // the time the current program started (see chain)
+        Microseconds m_timeOffset;
+
+        // true until the first change of a chained program is added
+        bool m_chained;
+
+        // a change already worked out but not yet added to the queue
+        PendingChange m_held;
+        bool m_holding;
+
+    public:
+        // Constructor.  If stopAtSettings is true, the queue isn't filled
+        // past a change that sets channels until that change has been
+        // removed, so that the settings can still be looked up (through
+        // program()) when the change is applied.
+        ChangeQueue(const PulseStateCommand* commands, int numCommands,
+                bool stopAtSettings);
+
+        // true if there are no more changes, i.e. the program is over.
+        bool finished() const {
+            return m_size == 0 && m_programFinished && !m_holding;
+        }
+
+        // true if there is a change waiting in the queue.
+        bool ready() const { return m_size != 0; }
+
+        // true if another change can be worked out now.
+        bool canFill() const;
+
+        // works out the next change and adds it to the queue.  The last
+        // change turns all of the channels off at the end of the program.
+        void fill();
+
+        // the next change, and removing it from the queue.
+        const PendingChange& next() const { return m_changes[m_start]; }
+        void pop();
+
+        // the program, as of the last change added to the queue.
+        ProgramStepper* program() { return &m_program; }
+
+        // true if every change of the program has been worked out but its
+        // last change (turning everything off) hasn't been removed yet, so
+        // another program can follow it without a gap.
+        bool canChain() const;
+
+        // Starts another program at the moment the current one ends, in
+        // place of the current program's last change.  The new program
+        // starts with all of its channels off, so any channel it doesn't
+        // turn on at its start turns off when the current program ends.
+        void chain(const PulseStateCommand* commands, int numCommands);
+};
+
+
+// Converts the time on a board's clock to the time on a reference clock
+// (e.g. another board's), given how far the board's clock drifts from the
+// reference, so that several boards started together stay together.  The
+// drift is in parts per billion of the reference time, and positive if the
+// board's clock runs fast.  Rather than multiplying every time, the
+// correction steps by one microsecond at a time, at the exact (Bresenham)
+// spacing for the drift.
+class ClockCorrection {
+    private:
+        // the board time between steps (m_interval + m_remainder /
+        // m_divisor, or 0 if there's no correction), and the fractions of
+        // a microsecond left over from the steps so far
+        Microseconds m_interval;
+        uint32_t m_remainder;
+        uint32_t m_divisor;
+        uint32_t m_error;
+
+        // the board time of the last step, and from it to the next one
+        Microseconds m_lastStep;
+        Microseconds m_nextStep;
+
+        // the correction so far, and whether it is taken off the board time
+        Microseconds m_offset;
+        bool m_fast;
+
+        // takes the next step and works out the time to the one after it
+        void advanceStep() {
+            m_lastStep += m_nextStep;
+            ++m_offset;
+            m_nextStep = m_interval;
+            m_error += m_remainder;
+            if (m_error >= m_divisor) {
+                m_error -= m_divisor;
+                ++m_nextStep;
+            }
+        }
+
+    public:
+        // the largest drift that can be corrected (1%)
+        static const int32_t maxDrift = 10000000L;
+
+        explicit ClockCorrection(int32_t drift);
+
+        // true if there is no correction, i.e. the board's clock is the
+        // reference
+        bool exact() const { return m_interval == 0; }
+
+        // The reference time for a time on the board's clock, both relative
+        // to the same moment.  Board times must not go backwards from one
+        // call to the next (but can wrap around).
+        Microseconds correct(Microseconds boardTime) {
+            while (m_interval != 0 && boardTime - m_lastStep >= m_nextStep) {
+                advanceStep();
+            }
+            return m_fast ? boardTime - m_offset : boardTime + m_offset;
+        }
+};
+
+
+// Estimated cost (in CPU cycles) of the firmware's work on a board, used to
+// predict whether it can keep up with a program before the program is
+// sent.  These are rough estimates for the pin outputs, not measurements,
+// and err on the slow side.
+struct TimingCosts {
+    const char* boardName;
+    uint32_t cyclesPerMicrosecond;
+    uint32_t perChange;         // applying a change, besides the writes
+    uint32_t perWrite;          // writing one output
+    uint32_t perStep;           // working out a change, besides the commands
+    uint32_t perCommand;        // running one command
+};
+
+// The estimates for each board the firmware supports, the default board
+// (the Mega) first.  The Mega and the Uno have the same processor core and
+// clock, so they have the same estimates.
+const TimingCosts boardTimingCosts[] = {
+    { "Arduino Mega", 16, 200, 80, 600, 200 },
+    { "Arduino Uno", 16, 200, 80, 600, 200 },
+    { "Arduino Due", 84, 250, 100, 700, 250 }
+};
+const int numBoardTimingCosts =
+    sizeof(boardTimingCosts) / sizeof(boardTimingCosts[0]);
+
+
+// The predicted timing of a program (see analyzeTiming).  Times are
+// relative to the start of the program.
+struct TimingAnalysis {
+    // number of changes to the outputs analyzed
+    uint32_t numChanges;
+
+    // most commands run to work out a single change
+    uint32_t maxCommandsPerChange;
+
+    // shortest time between two changes to the outputs (forever if there
+    // are fewer than two), and the time of the second of the two
+    Microseconds minChangeSpacing;
+    Microseconds minChangeSpacingAt;
+
+    // the longest predicted delay of a change (i.e. the timing precision)
+    // and the time at which the change should have happened
+    Microseconds maxError;
+    Microseconds maxErrorAt;
+
+    // number of changes predicted to be delayed by the work for other
+    // changes, i.e. that the firmware can't keep up with
+    uint32_t lateChanges;
+
+    // true if the program has more than maxChanges changes, in which case
+    // only the first maxChanges were analyzed
+    bool truncated;
+};
+
+// Predicts how well the firmware will keep to a program's timing, by
+// running the program with a ProgramStepper and modelling the firmware's
+// queue of upcoming changes with the given costs.  Analyzes at most
+// maxChanges changes.
+void analyzeTiming(const PulseStateCommand* commands, int numCommands,
+        const TimingCosts& costs, uint32_t maxChanges,
+        TimingAnalysis* result);
+
+
+// Computes a hash (32 bit FNV-1a) of a parsed program, which identifies the
+// program independently of its formatting and comments.  Blank lines are
+// ignored, and the program ends at its "end program" command.
+uint32_t hashProgram(const PulseStateCommand* commands, int numCommands);
+
+
+// Rewrites a parsed program (in place) into an equivalent one that takes
+// less work to run, returning the new number of commands.  The output
+// produced by the program is unchanged.  In particular:
+//
+//  * blank lines are removed and consecutive waits are merged;
+//  * settings that are overridden at the same moment, or that turn a
+//    channel on (or off) when it is already on (or off), are removed;
+//  * "turn on" and "turn off" commands at the start of a repeat are moved
+//    in front of the repeat when nothing else in the repeat sets the same
+//    channel;
+//  * repeats of one iteration are replaced by their contents, and empty
+//    repeats are removed; and
+//  * repeats that just turn a channel on and off, e.g.
+//
+//        repeat 100 times:
+//            turn on channel 1
+//            wait 10 ms
+//            turn off channel 1
+//            wait 90 ms
+//        end repeat
+//
+//    are replaced by a pulse train and a single long wait.
+//
+// If sourceLines isn't NULL, it gives the source line of each command (a
+// source map) and is rearranged along with the commands, so that it still
+// gives the line each command of the optimized program came from.
+int optimizeProgram(PulseStateCommand* commands, int numCommands,
+        uint16_t* sourceLines = NULL);
+
 #endif /* PULSESTATEMACHINE_H */
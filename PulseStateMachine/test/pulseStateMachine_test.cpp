@@ -1,5 +1,6 @@
 #include <iostream>
 #include <assert.h>
+#include <math.h>
 #include <stdlib.h>
 #include "pulseStateMachine.h"
 #include "string.h"
@@ -9,78 +10,443 @@ using std::endl;
 
 #define assertClose(X, Y) assert(abs((X) - (Y)) <= 1)
 
-void runPulseChannelTests() {
+void runChannelBankTests() {
     // should be off by default
     {
-        PulseChannel p;
-        assert(p.on() == false);
-        assert(p.onTime() == 0);
-        //assert(p.offTime() == 0); // no off pulse to finish
+        ChannelBank p;
+        assert(p.on(0) == false);
+        assert(p.onTime(0) == 0);
+        //assert(p.offTime(0) == 0); // no off pulse to finish
         p.advanceTime(1);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
         p.advanceTime(1);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
+        assert(p.onChannels() == 0);
     }
 
     // should be able to set on and off times, resulting in appropriate on and
     // off intervals.
     {
-        PulseChannel p;
-        p.setOnOffTime(20, 50);
-        assert(p.on() == true);
+        ChannelBank p;
+        p.setOnOffTime(0, 20, 50);
+        assert(p.on(0) == true);
         p.advanceTime(19);
-        assert(p.on() == true);
+        assert(p.on(0) == true);
         p.advanceTime(1);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
         p.advanceTime(49);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
         p.advanceTime(1);
-        assert(p.on() == true);
+        assert(p.on(0) == true);
         p.advanceTime(19);
-        assert(p.on() == true);
+        assert(p.on(0) == true);
         p.advanceTime(1);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
         p.advanceTime(49);
-        assert(p.on() == false);
+        assert(p.on(0) == false);
         p.advanceTime(1);
-        assert(p.on() == true);
+        assert(p.on(0) == true);
     }
 
     // setting 0 for on time should turn off and leave off
     {
-        PulseChannel p;
-        p.setOnOffTime(0, 10);
-        assert(p.on() == false);
-        p.setOnOffTime(20, 50);
-        assert(p.on() == true);
-        p.setOnOffTime(0, 10);
-        assert(p.on() == false);
+        ChannelBank p;
+        p.setOnOffTime(0, 0, 10);
+        assert(p.on(0) == false);
+        p.setOnOffTime(0, 20, 50);
+        assert(p.on(0) == true);
+        p.setOnOffTime(0, 0, 10);
+        assert(p.on(0) == false);
     }
 
     // setting 0 for on time should turn on and leave on
     {
-        PulseChannel p;
-        p.setOnOffTime(10, 0);
-        assert(p.on() == true);
-        p.setOnOffTime(20, 50);
-        assert(p.on() == true);
-        p.setOnOffTime(10, 0);
-        assert(p.on() == true);
+        ChannelBank p;
+        p.setOnOffTime(0, 10, 0);
+        assert(p.on(0) == true);
+        p.setOnOffTime(0, 20, 50);
+        assert(p.on(0) == true);
+        p.setOnOffTime(0, 10, 0);
+        assert(p.on(0) == true);
+    }
+
+    // only channels that will change state again should be active
+    {
+        ChannelBank p;
+        assert(p.activeChannels() == 0);
+        p.setOnOffTime(0, 20, 50);
+        assert(p.activeChannels() == 1);
+        p.setOnOffTime(0, forever, 0);
+        assert(p.activeChannels() == 0);
+        p.setOnOffTime(0, 0, forever);
+        assert(p.activeChannels() == 0);
+        p.setOnOffTime(0, 0, 0);
+        assert(p.activeChannels() == 0);
+        assert(p.on(0) == false);
     }
 
     // should correctly compute time until next state change
     {
-        PulseChannel p;
-        p.setOnOffTime(20, 50);
-        assert(p.timeUntilNextStateChange() == 20);
+        ChannelBank p;
+        p.setOnOffTime(0, 20, 50);
+        assert(p.timeUntilNextStateChange(0) == 20);
         p.advanceTime(11);
-        assert(p.timeUntilNextStateChange() == 9);
+        assert(p.timeUntilNextStateChange(0) == 9);
         p.advanceTime(9);
-        assert(p.timeUntilNextStateChange() == 50);
+        assert(p.timeUntilNextStateChange(0) == 50);
         p.advanceTime(23);
-        assert(p.timeUntilNextStateChange() == 27);
+        assert(p.timeUntilNextStateChange(0) == 27);
         p.advanceTime(27);
+        assert(p.timeUntilNextStateChange(0) == 20);
+    }
+
+    // should track all of the channels independently
+    {
+        ChannelBank p;
+        assert(p.timeUntilNextStateChange() == forever);
+        p.setOnOffTime(1, 20, 50);
+        p.setOnOffTime(3, forever, 0);
+        p.setOnOffTime(numChannels - 1, 30, 5);
+        assert(p.onChannels() ==
+                ((ChannelMask(1) << (numChannels - 1)) | 0x0A));
         assert(p.timeUntilNextStateChange() == 20);
+        p.advanceTime(20);
+        assert(p.onChannels() ==
+                ((ChannelMask(1) << (numChannels - 1)) | 0x08));
+        assert(p.timeUntilNextStateChange() == 10);
+        p.advanceTime(10);
+        assert(p.onChannels() == 0x08);
+        assert(p.timeUntilNextStateChange() == 5);
+
+        // several state changes in one step
+        p.advanceTime(100);
+        assert(p.on(1) == false);
+        assert(p.timeUntilNextStateChange(1) == 10);
+        assert(p.on(numChannels - 1) == true);
+        assert(p.timeUntilNextStateChange(numChannels - 1) == 5);
+        assert(p.on(3) == true);
+    }
+
+    // should visit state changes in time order, however the channels were
+    // set and removed
+    {
+        ChannelBank p;
+        for (unsigned i = 0; i < numChannels; ++i) {
+            p.setOnOffTime(i, 10 * (numChannels - i), 1000);
+        }
+        p.setOnOffTime(2, 0, forever);
+        p.setOnOffTime(numChannels - 1, 5, 1000);
+
+        assert(p.timeUntilNextStateChange() == 5);
+        p.advanceTime(5);
+        assert(p.on(numChannels - 1) == false);
+        assert(p.on(numChannels - 2) == true);
+        assert(p.timeUntilNextStateChange() == 15);
+        p.advanceTime(15);
+        assert(p.on(numChannels - 1) == false);
+        assert(p.on(numChannels - 2) == false);
+        assert(p.on(numChannels - 3) == true);
+        assert(p.timeUntilNextStateChange(2) == forever);
+    }
+
+    // Poisson channels should keep their pulse width, with gaps that
+    // average the off time
+    {
+        ChannelBank p;
+        p.setOnOffTime(0, 10, 990, true);
+        assert(p.poisson(0));
+        double totalPeriod = 0;
+        const int numPulses = 10000;
+        for (int i = 0; i < numPulses; ++i) {
+            assert(p.on(0));
+            assert(p.timeUntilNextStateChange() == 10);
+            p.advanceTime(10);
+            assert(!p.on(0));
+            Microseconds offTime = p.timeUntilNextStateChange();
+            p.advanceTime(offTime);
+            totalPeriod += 10 + offTime;
+        }
+        double meanPeriod = totalPeriod / numPulses;
+        assert(meanPeriod > 970 && meanPeriod < 1030);
+
+        // (a constant level isn't random)
+        p.setOnOffTime(0, forever, 0, true);
+        assert(!p.poisson(0));
+        p.setOnOffTime(0, 10, 990);
+        assert(!p.poisson(0));
+    }
+
+    // ramps should move each pulse's settings along linearly, from the
+    // pulse's start, and then keep the target
+    {
+        ChannelBank p;
+        p.setOnOffTime(0, 100, 900);
+        p.rampTo(0, 500, 10000, false);
+        assert(!p.regular(0));
+
+        // 1 kHz to 2 kHz over 10 ms
+        Microseconds start = 0;
+        Microseconds lastPeriod = 1000;
+        for (int i = 0; i < 20; ++i) {
+            assert(p.on(0) && p.onTime(0) == 100);
+            Microseconds period = p.onTime(0) + p.offTime(0);
+            assert(period <= lastPeriod);
+            double expected = 1e6 / (1000 + 1000 * (start / 10000.));
+            if (start >= 10000) {
+                expected = 500;
+            }
+            assert(period + 0.5 >= expected && period - 0.5 <= expected);
+            lastPeriod = period;
+            p.advanceTime(p.timeUntilNextStateChange());
+            p.advanceTime(p.timeUntilNextStateChange());
+            start += period;
+        }
+        assert(p.regular(0));
+        assert(p.onTime(0) == 100 && p.offTime(0) == 400);
+
+        // widths, keeping the period, and several pulses in one step
+        p.rampTo(0, 300, 5000, true);
+        p.advanceTime(4000);
+        assert(p.onTime(0) == 100 + 200 * 4000 / 5000);
+        assert(p.onTime(0) + p.offTime(0) == 500);
+        p.advanceTime(2000);
+        assert(p.onTime(0) == 300 && p.offTime(0) == 200);
+
+        // a new setting ends a ramp
+        p.rampTo(0, 50, 5000, true);
+        p.setOnOffTime(0, 10, 20);
+        assert(p.regular(0));
+        p.advanceTime(10000);
+        assert(p.onTime(0) == 10 && p.offTime(0) == 20);
+
+        // channels that don't pulse aren't ramped
+        p.setOnOffTime(1, forever, 0);
+        p.rampTo(1, 500, 100, false);
+        assert(p.regular(1) && p.on(1));
+        assert(p.timeUntilNextStateChange(1) == forever);
+    }
+
+    // a parked channel should keep its settings and read as off, and a
+    // ramp should continue its pulses just as if it had never been parked
+    {
+        ChannelBank p;
+        ChannelBank q;
+        p.setOnOffTime(2, 10000, 90000);
+        q.setOnOffTime(2, 10000, 90000);
+        p.advanceTime(5000);
+        q.advanceTime(5000);
+        p.park(2);
+        assert(!p.on(2) && p.onChannels() == 0);
+        assert(p.timeUntilNextStateChange(2) == forever);
+        assert(p.onTime(2) == 10000 && p.offTime(2) == 90000);
+        p.advanceTime(50000);
+        q.advanceTime(50000);
+        assert(!p.on(2));
+
+        p.rampTo(2, 50000, 0, false);
+        q.rampTo(2, 50000, 0, false);
+        assert(!p.on(2) && !q.on(2));
+        assert(p.timeUntilNextStateChange(2) == 45000);
+        assert(q.timeUntilNextStateChange(2) == 45000);
+        for (int i = 0; i < 6; ++i) {
+            Microseconds dt = q.timeUntilNextStateChange();
+            assert(p.timeUntilNextStateChange() == dt);
+            p.advanceTime(dt);
+            q.advanceTime(dt);
+            assert(p.onChannels() == q.onChannels());
+        }
+        assert(p.offTime(2) == 40000);
+
+        // (however long it's parked for)
+        p.setOnOffTime(3, 300, 700);
+        q.setOnOffTime(3, 300, 700);
+        p.park(3);
+        for (int i = 0; i < 5; ++i) {
+            p.advanceTime(1000000001);
+            q.advanceTime(1000000001);
+        }
+        p.rampTo(3, 2000, 10000, false);
+        q.rampTo(3, 2000, 10000, false);
+        assert(p.onChannels() == q.onChannels());
+        for (int i = 0; i < 20; ++i) {
+            Microseconds dt = q.timeUntilNextStateChange();
+            assert(p.timeUntilNextStateChange() == dt);
+            p.advanceTime(dt);
+            q.advanceTime(dt);
+            assert(p.onChannels() == q.onChannels());
+        }
+    }
+
+    // bursts should keep their pulses' timing, and start a period apart
+    {
+        ChannelBank p;
+        p.setOnOffTime(0, 1000, 9000);
+        p.burst(0, 4, 200000);
+        assert(!p.regular(0));
+        Microseconds time = 0;
+        for (int burst = 0; burst < 3; ++burst) {
+            for (int pulse = 0; pulse < 4; ++pulse) {
+                assert(p.on(0));
+                Microseconds dt = p.timeUntilNextStateChange();
+                assert(dt == 1000);
+                p.advanceTime(dt);
+                assert(!p.on(0));
+                dt = p.timeUntilNextStateChange();
+                time += 1000 + dt;
+                assert(dt == (pulse < 3 ? 9000 : 200000 - 31000));
+                p.advanceTime(dt);
+            }
+            assert(time == Microseconds(200000 * (burst + 1)));
+        }
+
+        // several bursts in one step
+        p.advanceTime(400000 + 15000);
+        assert(!p.on(0));
+        assert(p.timeUntilNextStateChange() == 5000);
+
+        // bursts that don't fit in their period run on
+        p.setOnOffTime(1, 10, 10);
+        p.burst(1, 10, 50);
+        p.advanceTime(190);
+        assert(!p.on(1));
+        assert(p.timeUntilNextStateChange(1) == 10);
+
+        // a new setting ends the bursts
+        p.setOnOffTime(0, 1000, 9000);
+        assert(p.regular(0));
+    }
+
+    // bursts on a parked channel should carry on from where its pulses
+    // have got to
+    {
+        ChannelBank p;
+        ChannelBank q;
+        p.setOnOffTime(0, 1000, 9000);
+        q.setOnOffTime(0, 1000, 9000);
+        p.park(0);
+        p.advanceTime(34500);
+        q.advanceTime(34500);
+        p.burst(0, 3, 100000);
+        q.burst(0, 3, 100000);
+        assert(!p.on(0) && p.timeUntilNextStateChange(0) == 5500);
+        for (int i = 0; i < 12; ++i) {
+            Microseconds dt = q.timeUntilNextStateChange();
+            assert(p.timeUntilNextStateChange() == dt);
+            p.advanceTime(dt);
+            q.advanceTime(dt);
+            assert(p.onChannels() == q.onChannels());
+        }
+    }
+
+    // paired channels should give the second phase a fixed gap after the
+    // first, within the first channel's period
+    {
+        ChannelBank p;
+        p.setOnOffTime(3, forever, 0);
+        p.setOnOffTime(0, 200, 800);
+        p.pair(0, 3, 50);
+        assert(!p.regular(0) && !p.regular(3));
+        assert(!p.on(3));
+        for (int i = 0; i < 3; ++i) {
+            assert(p.onChannels() == 0x01);
+            assert(p.timeUntilNextStateChange() == 200);
+            p.advanceTime(200);
+            assert(p.onChannels() == 0);
+            assert(p.timeUntilNextStateChange() == 50);
+            p.advanceTime(50);
+            assert(p.onChannels() == 0x08);
+            assert(p.timeUntilNextStateChange() == 200);
+            p.advanceTime(200);
+            assert(p.onChannels() == 0);
+            assert(p.timeUntilNextStateChange() == 550);
+            p.advanceTime(550);
+        }
+
+        // with no gap, the phases change together
+        p.setOnOffTime(1, 10, 90);
+        p.pair(1, 2, 0);
+        p.advanceTime(10);
+        assert(p.on(2) && !p.on(1));
+        p.advanceTime(10);
+        assert(!p.on(2) && !p.on(1));
+        assert(p.timeUntilNextStateChange(1) == 80);
+
+        // a second phase that doesn't fit delays the next pulse
+        p.setOnOffTime(4, 100, 100);
+        p.pair(4, 5, 50);
+        p.advanceTime(200);
+        assert(p.on(5) && p.timeUntilNextStateChange(4) == 50);
+        p.advanceTime(50);
+        assert(p.on(4) && !p.on(5));
+
+        // setting the second channel again ends the pairing
+        p.setOnOffTime(3, 5, 5);
+        assert(p.regular(0) && p.regular(3));
+        p.advanceTime(1000);
+        assert(p.onTime(0) == 200 && p.offTime(0) == 800);
+        assert(p.timeUntilNextStateChange(0) <= 800);
+
+        // channels that aren't pulsing can't be paired
+        p.setOnOffTime(6, forever, 0);
+        p.setOnOffTime(7, 10, 10);
+        p.pair(6, 7, 10);
+        assert(p.regular(7) && p.onTime(7) == 10);
+    }
+
+    // pairing a parked channel should carry on from where its pulses have
+    // got to
+    {
+        ChannelBank p;
+        ChannelBank q;
+        p.setOnOffTime(0, 200, 800);
+        q.setOnOffTime(0, 200, 800);
+        p.park(0);
+        p.advanceTime(2100);
+        q.advanceTime(2100);
+        p.pair(0, 1, 50);
+        q.pair(0, 1, 50);
+        assert(p.on(0) && p.timeUntilNextStateChange(0) == 100);
+        for (int i = 0; i < 12; ++i) {
+            Microseconds dt = q.timeUntilNextStateChange();
+            assert(p.timeUntilNextStateChange() == dt);
+            p.advanceTime(dt);
+            q.advanceTime(dt);
+            assert(p.onChannels() == q.onChannels());
+        }
+    }
+
+    // the random numbers should only depend on the seed
+    {
+        RandomGenerator a;
+        RandomGenerator b;
+        a.seed(12);
+        b.seed(12);
+        uint32_t first = a.next();
+        assert(first == b.next());
+        for (int i = 0; i < 1000; ++i) {
+            assert(a.uniform(20) <= 20);
+            b.uniform(20);
+        }
+        assert(a.next() == b.next());
+        b.seed(13);
+        a.seed(12);
+        assert(a.next() == first);
+        assert(b.next() != first);
+        assert(a.uniform(0) == 0);
+    }
+
+    // exponential times should be within mean / 65536 of the exact ones
+    {
+        RandomGenerator a;
+        RandomGenerator b;
+        const Microseconds mean = 10000000;
+        for (int i = 0; i < 10000; ++i) {
+            double u = ((b.next() >> 8) + 1) / 16777216.;
+            double exact = -log(u) * mean;
+            double time = a.exponential(mean);
+            assert(time >= 1);
+            assert(fabs(time - (exact < 1 ? 1 : exact)) <= mean / 65536 + 1);
+        }
     }
 }
 
@@ -326,12 +692,421 @@ void runPulseStateCommandParsingTests() {
         c.parseFromString("set channel 2 to 30 ms pulses at 100 Hz", &error, NULL);
         assert(error && strcmp(error, "pulse duration longer than total period") == 0);
     }
+    {
+        // the error codes behind the messages
+        PulseStateCommand c;
+        unsigned repeatDepth = 0;
+        assert(c.parseFromString("wait 5", &repeatDepth) ==
+                errorExpectedTime);
+        assert(c.parseFromString("wait 5 Hz", &repeatDepth) ==
+                errorExpectedTime);
+        assert(c.parseFromString("turn up channel 1", &repeatDepth) ==
+                errorExpectedOnOrOff);
+        assert(c.parseFromString("set channel 1 to 5 ms pulses at 5 s",
+                    &repeatDepth) == errorExpectedFrequency);
+        assert(c.parseFromString("set channel 1 to 5 ms pulses for 5 s",
+                    &repeatDepth) == errorExpectedAtOrEvery);
+        assert(c.parseFromString("repeat 2.5 times:", &repeatDepth) ==
+                errorExpectedRepeatCount);
+        assert(c.parseFromString("repeat 0 times:", &repeatDepth) ==
+                errorZeroRepeatCount);
+        assert(c.parseFromString("repeat 2 times", &repeatDepth) ==
+                errorExpectedColon);
+        assert(c.parseFromString("waiting 5 ms", &repeatDepth) ==
+                errorUnrecognizedCommand);
+        assert(c.parseFromString("5 ms", &repeatDepth) ==
+                errorUnrecognizedCommand);
+        assert(repeatDepth == 0);
+
+        assert(c.parseFromString("wait 5ms # comment", &repeatDepth) ==
+                parseOk);
+        assert(c.type == PulseStateCommand::wait);
+        assert(c.waitTime == 5000);
+        assert(c.parseFromString("repeat 2 times:", &repeatDepth) == parseOk);
+        assert(repeatDepth == 1);
+
+        assert(parseErrorMessage(parseOk) == NULL);
+        for (int e = parseOk + 1; e < numParseErrors; ++e) {
+            assert(parseErrorMessage(ParseError(e)) != NULL);
+        }
+    }
+    {
+        // names and arithmetic
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("let width = 15 ms", &state) == parseOk);
+        assert(c.type == PulseStateCommand::noOp);
+        assert(c.parseFromString("let rate = 2 * 10 Hz", &state) == parseOk);
+        assert(c.parseFromString("let n = 3", &state) == parseOk);
+        assert(state.numNames == 3);
+
+        assert(c.parseFromString("wait 2 * width + 500 us", &state) ==
+                parseOk);
+        assert(c.type == PulseStateCommand::wait);
+        assert(c.waitTime == 30500);
+        assert(c.parseFromString("wait (n - 1) * width", &state) == parseOk);
+        assert(c.waitTime == 30000);
+        assert(c.parseFromString("wait 1 / rate", &state) == parseOk);
+        assert(c.waitTime == 50000);
+        assert(c.parseFromString("wait (n + 2) ms", &state) == parseOk);
+        assert(c.waitTime == 5000);
+        assert(c.parseFromString("repeat 2 s * rate / 8 + 1 times:", &state) ==
+                parseOk);
+        assert(c.repeatCount == 6);
+        assert(state.repeatDepth == 1);
+        assert(c.parseFromString("set channel n to width pulses at rate",
+                    &state) == parseOk);
+        assert(c.channel == 3);
+        assert(c.onTime == 15000);
+        assert(c.offTime == 35000);
+        assert(c.parseFromString("end repeat", &state) == parseOk);
+
+        assert(c.parseFromString("let width = 5 ms", &state) ==
+                errorNameAlreadyDefined);
+        assert(c.parseFromString("let channel = 5 ms", &state) ==
+                errorExpectedName);
+        assert(c.parseFromString("let duration = 5 ms", &state) ==
+                errorNameTooLong);
+        assert(c.parseFromString("let x 5 ms", &state) == errorExpectedEquals);
+        assert(c.parseFromString("let x =", &state) == errorExpectedValue);
+        assert(c.parseFromString("let x = y", &state) == errorUnknownName);
+        assert(c.parseFromString("let x = (2 ms", &state) ==
+                errorExpectedCloseParen);
+        assert(c.parseFromString("let x = width + 1", &state) ==
+                errorUnitsDontMatch);
+        assert(c.parseFromString("let x = width * width", &state) ==
+                errorUnitsDontMatch);
+        assert(c.parseFromString("let x = n / (n - 3)", &state) ==
+                errorDivisionByZero);
+        assert(c.parseFromString("wait rate", &state) == errorExpectedTime);
+        assert(c.parseFromString("wait width - 20 ms", &state) ==
+                errorExpectedTime);
+        assert(c.parseFromString("repeat n / 2 times:", &state) ==
+                errorExpectedRepeatCount);
+        assert(c.parseFromString("repeat n - 3 times:", &state) ==
+                errorZeroRepeatCount);
+        assert(c.parseFromString("turn on channel n + 6", &state) ==
+                errorChannelOutOfRange);
+        assert(state.numNames == 3);
+        assert(state.repeatDepth == 0);
+
+        for (int i = 3; i < int(maxNamedValues); ++i) {
+            char line[] = "let a = 1";
+            line[4] = 'a' + i;
+            assert(c.parseFromString(line, &state) == parseOk);
+        }
+        assert(c.parseFromString("let z = 1", &state) == errorTooManyNames);
+
+        state.reset();
+        assert(c.parseFromString("wait width", &state) == errorUnknownName);
+    }
+    {
+        // subroutines
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("wait 1 ms", &state) == parseOk);
+        assert(c.parseFromString("call flash", &state) == errorUnknownName);
+        assert(c.parseFromString("define flash", &state) ==
+                errorExpectedColon);
+        assert(c.parseFromString("define flash:", &state) == parseOk);
+        assert(c.type == PulseStateCommand::defineSubroutine);
+        assert(c.parseFromString("call flash", &state) == errorRecursiveCall);
+        assert(c.parseFromString("define other:", &state) ==
+                errorDefineNotAtTopLevel);
+        assert(c.parseFromString("end program", &state) ==
+                errorEndProgramInDefine);
+        assert(c.parseFromString("repeat 2 times:", &state) == parseOk);
+        assert(c.parseFromString("end define", &state) ==
+                errorEndDefineInRepeat);
+        assert(c.parseFromString("end repeat", &state) == parseOk);
+        assert(c.parseFromString("end define", &state) == parseOk);
+        assert(c.type == PulseStateCommand::endSubroutine);
+        assert(c.parseFromString("end define", &state) ==
+                errorEndDefineWithoutDefine);
+
+        assert(c.parseFromString("call flash", &state) == parseOk);
+        assert(c.type == PulseStateCommand::callSubroutine);
+        assert(c.subroutineStart == 1);
+        assert(state.numCommands == 6);
+        assert(c.parseFromString("wait flash", &state) == errorExpectedValue);
+        assert(c.parseFromString("let width = 1 ms", &state) == parseOk);
+        assert(c.parseFromString("call width", &state) ==
+                errorNotASubroutine);
+        assert(c.parseFromString("call", &state) == errorExpectedName);
+        assert(c.parseFromString("repeat 2 times:", &state) == parseOk);
+        assert(c.parseFromString("define other:", &state) ==
+                errorDefineNotAtTopLevel);
+
+        // flash uses two levels of the stack (its call and its repeat)
+        state.repeatDepth = maxRepeatNesting - 2;
+        assert(c.parseFromString("call flash", &state) == parseOk);
+        state.repeatDepth = maxRepeatNesting - 1;
+        assert(c.parseFromString("call flash", &state) ==
+                errorNestedTooDeeply);
+    }
+    {
+        // random timing
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("wait random 10 ms to 50 ms", &state) ==
+                parseOk);
+        assert(c.type == PulseStateCommand::randomWait);
+        assert(c.waitTime == 10000);
+        assert(c.waitRange == 40000);
+        assert(c.parseFromString("wait random 10 ms", &state) ==
+                errorExpectedTo);
+        assert(c.parseFromString("wait random 10 ms to 5 ms", &state) ==
+                errorRandomRangeBackwards);
+        assert(c.parseFromString("wait random 10 ms to 10 Hz", &state) ==
+                errorExpectedTime);
+
+        assert(c.parseFromString("set channel 2 to 1 ms poisson pulses "
+                    "at 20 Hz", &state) == parseOk);
+        assert(c.type == PulseStateCommand::setChannel);
+        assert(c.poisson);
+        assert(c.onTime == 1000 && c.offTime == 49000);
+        assert(c.parseFromString("set channel 2 to 1 ms pulses at 20 Hz",
+                    &state) == parseOk);
+        assert(!c.poisson);
+
+        assert(c.parseFromString("seed 12", &state) == parseOk);
+        assert(c.type == PulseStateCommand::seedRandom);
+        assert(c.seed == 12);
+        assert(c.parseFromString("seed 1 ms", &state) == errorExpectedSeed);
+        assert(c.parseFromString("seed", &state) == errorExpectedSeed);
+    }
+    {
+        // ramps
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("ramp channel 2 to 100 Hz over 5 s",
+                    &state) == parseOk);
+        assert(c.type == PulseStateCommand::rampChannel);
+        assert(c.channel == 2 && !c.rampWidth);
+        assert(c.rampTarget == 10000 && c.rampTime == 5000000);
+        assert(c.parseFromString("ramp channel 2 to every 4 ms over 1 s",
+                    &state) == parseOk);
+        assert(!c.rampWidth && c.rampTarget == 4000);
+        assert(c.parseFromString("ramp channel 2 to 2 ms pulses over 1 s",
+                    &state) == parseOk);
+        assert(c.rampWidth && c.rampTarget == 2000);
+
+        assert(c.parseFromString("ramp channel 2 to 2 ms over 1 s",
+                    &state) == errorExpectedPulses);
+        assert(c.parseFromString("ramp channel 2 to 3 over 1 s", &state) ==
+                errorExpectedRampTarget);
+        assert(c.parseFromString("ramp channel 2 to over 1 s", &state) ==
+                errorExpectedRampTarget);
+        assert(c.parseFromString("ramp channel 2 to 100 Hz", &state) ==
+                errorExpectedOver);
+        assert(c.parseFromString("ramp channel 2 to 100 Hz over 2 Hz",
+                    &state) == errorExpectedTime);
+        assert(c.parseFromString("ramp channel 2 100 Hz over 1 s", &state) ==
+                errorExpectedTo);
+    }
+    {
+        // bursts
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("burst channel 3 to 4 pulses at 5 Hz",
+                    &state) == parseOk);
+        assert(c.type == PulseStateCommand::burstChannel);
+        assert(c.channel == 3 && c.burstPulses == 4);
+        assert(c.burstPeriod == 200000);
+        assert(c.parseFromString("burst channel 3 to 2 * 2 pulses every 1 s",
+                    &state) == parseOk);
+        assert(c.burstPulses == 4 && c.burstPeriod == 1000000);
+
+        assert(c.parseFromString("burst channel 3 to 0 pulses at 5 Hz",
+                    &state) == errorExpectedBurstCount);
+        assert(c.parseFromString("burst channel 3 to 1.5 pulses at 5 Hz",
+                    &state) == errorExpectedBurstCount);
+        assert(c.parseFromString("burst channel 3 to 100000 pulses at 5 Hz",
+                    &state) == errorExpectedBurstCount);
+        assert(c.parseFromString("burst channel 3 to 4 at 5 Hz", &state) ==
+                errorExpectedPulses);
+        assert(c.parseFromString("burst channel 3 to 4 pulses", &state) ==
+                errorExpectedAtOrEvery);
+        assert(c.parseFromString("burst channel 3 to 4 pulses at 5 ms",
+                    &state) == errorExpectedFrequency);
+    }
+    {
+        // pairs
+        PulseStateCommand c;
+        ParseState state;
+        assert(c.parseFromString("pair channel 1 with channel 2 after 50 us",
+                    &state) == parseOk);
+        assert(c.type == PulseStateCommand::pairChannels);
+        assert(c.channel == 1 && c.pairedChannel == 2 && c.pairGap == 50);
+        assert(c.lastChannel() == 2);
+        assert(c.parseFromString("pair channel 3 with channel 2 after 0 us",
+                    &state) == parseOk);
+        assert(c.lastChannel() == 3);
+
+        assert(c.parseFromString("pair channel 1 channel 2 after 50 us",
+                    &state) == errorExpectedWith);
+        assert(c.parseFromString("pair channel 1 with channel 2 50 us",
+                    &state) == errorExpectedAfter);
+        assert(c.parseFromString("pair channel 1 with channel 1 after 5 us",
+                    &state) == errorPairedWithItself);
+        assert(c.parseFromString("pair channel 1 with 2 after 5 us",
+                    &state) == errorExpectedChannel);
+        assert(c.parseFromString("pair channel 1 with channel 2 after 5 Hz",
+                    &state) == errorExpectedTime);
+    }
     // TODO: tests for other error messages.
 
     // cout << "Error: " << (error ? error : "none") << endl;
 }
 
 
+void runParseProgramTests() {
+    // should parse a whole program, skipping blank lines and comments
+    {
+        const char text[] =
+            "# a comment\n"
+            "turn on channel 1\r\n"
+            "\n"
+            "repeat 2 times:\n"
+            "    wait 5 ms # half of the wait\n"
+            "end repeat\n"
+            "end program";
+        size_t length = strlen(text);
+        int maxCommands = countProgramLines(text, length);
+        assert(maxCommands == 7);
+
+        PulseStateCommand commands[7];
+        uint16_t sourceLines[7];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, length, commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+        assert(numCommands == 4);
+        assert(commands[0].type == PulseStateCommand::setChannel);
+        assert(commands[0].channel == 1);
+        assert(commands[1].type == PulseStateCommand::repeat);
+        assert(commands[1].repeatCount == 2);
+        assert(commands[2].type == PulseStateCommand::wait);
+        assert(commands[2].waitTime == 5000);
+        assert(commands[3].type == PulseStateCommand::endRepeat);
+        const uint16_t expectedLines[] = { 1, 3, 4, 5 };
+        assert(memcmp(sourceLines, expectedLines, sizeof(expectedLines)) == 0);
+    }
+
+    // names should last until the end of the program
+    {
+        const char text[] =
+            "let width = 2 ms\n"
+            "repeat 2 times:\n"
+            "    let gap = 3 * width\n"
+            "end repeat\n"
+            "wait width + gap\n"
+            "end program\n";
+        PulseStateCommand commands[7];
+        uint16_t sourceLines[7];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+        assert(numCommands == 3);
+        assert(commands[2].type == PulseStateCommand::wait);
+        assert(commands[2].waitTime == 8000);
+        assert(sourceLines[2] == 4);
+    }
+
+    // calls should refer to the index of their subroutine's command
+    {
+        const char text[] =
+            "wait 1 s\n"
+            "\n"
+            "define flash:\n"
+            "    let width = 5 ms\n"
+            "    turn on channel 2\n"
+            "    wait width\n"
+            "    turn off channel 2\n"
+            "end define\n"
+            "call flash\n"
+            "end program\n";
+        PulseStateCommand commands[11];
+        uint16_t sourceLines[11];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+        assert(numCommands == 7);
+        assert(commands[1].type == PulseStateCommand::defineSubroutine);
+        assert(commands[6].type == PulseStateCommand::callSubroutine);
+        assert(commands[6].subroutineStart == 1);
+    }
+
+    // shouldn't read past the end of the text (i.e. the "end program" in
+    // the rest of the buffer)
+    {
+        const char text[] = "wait 1 s\nend program";
+        PulseStateCommand commands[2];
+        uint16_t sourceLines[2];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, 9, commands, sourceLines,
+                    &numCommands, &errorLine) == errorMissingEndProgram);
+        assert(parseProgram(text, 15, commands, sourceLines,
+                    &numCommands, &errorLine) == errorExpectedRepeatOrProgram);
+        assert(errorLine == 1);
+    }
+
+    // should report the line of the first error
+    {
+        const char text[] =
+            "wait 1 s\n"
+            "wait 2 Hz\n"
+            "wait 3 s\n"
+            "end program\n";
+        PulseStateCommand commands[5];
+        uint16_t sourceLines[5];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == errorExpectedTime);
+        assert(errorLine == 1);
+    }
+    {
+        const char text[] =
+            "wait 1 s\n"
+            "end program\n"
+            "# comments are fine\n"
+            "wait 3 s\n";
+        PulseStateCommand commands[5];
+        uint16_t sourceLines[5];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == errorCommandAfterEndProgram);
+        assert(errorLine == 3);
+    }
+
+    // a '\0' shouldn't end a line (so the lines stay as counted)
+    {
+        const char text[] =
+            "wait 1 s\n"
+            "wait 2 s\0wait 3 s\0wait 4 s\n"
+            "end program";
+        const int numLines = countProgramLines(text, sizeof(text) - 1);
+        assert(numLines == 3);
+        PulseStateCommand commands[3];
+        uint16_t sourceLines[3];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, sizeof(text) - 1, commands, sourceLines,
+                    &numCommands, &errorLine) == errorTextAfterCommand);
+        assert(errorLine == 1);
+        assert(parseProgram(text + 9, sizeof(text) - 10, commands,
+                    sourceLines, &numCommands, &errorLine) ==
+                errorTextAfterCommand);
+        assert(errorLine == 0);
+    }
+}
+
+
 void runPulseStateCommandExecuteTests() {
     int step;
 
@@ -361,16 +1136,17 @@ void runPulseStateCommandExecuteTests() {
     }
     {
         PulseStateCommand c;
-        PulseChannel p[numChannels];
+        ChannelBank p;
 
         c.type = PulseStateCommand::setChannel;
         c.channel = 1;
+        c.poisson = false;
         c.onTime = 12;
         c.offTime = 10;
 
-        step = c.execute(p, NULL, 0, 0, NULL);
-        assert(p[0].onTime() == 12);
-        assert(p[0].offTime() == 10);
+        step = c.execute(&p, NULL, 0, 0, NULL);
+        assert(p.onTime(0) == 12);
+        assert(p.offTime(0) == 10);
         assert(step == 1);
     }
     {
@@ -391,14 +1167,14 @@ void runPulseStateCommandExecuteTests() {
     }
     {
         PulseStateCommand c;
-        PulseChannel p[numChannels];
+        ChannelBank p;
         RepeatStack stack;
 
         c.type = PulseStateCommand::repeat;
         c.repeatCount = 13;
         stack.pushRepeat(42, 83);
 
-        step = c.execute(p, &stack, 5, 0, NULL);
+        step = c.execute(&p, &stack, 5, 0, NULL);
         assert(step == 1);
         assert(stack.getLoopTarget() == 6);
         stack.pop();
@@ -407,41 +1183,690 @@ void runPulseStateCommandExecuteTests() {
     }
     {
         PulseStateCommand c;
-        PulseChannel p[numChannels];
+        ChannelBank p;
         RepeatStack stack;
 
         c.type = PulseStateCommand::endRepeat;
 
         stack.pushRepeat(23, 83);
-        step = c.execute(p, &stack, 42, 0, NULL);
+        step = c.execute(&p, &stack, 42, 0, NULL);
         assert(step == 23 - 42);
         assert(stack.decrementRepeatCount() == 81);
         assert(stack.getLoopTarget() == 23);
     }
     {
         PulseStateCommand c;
-        PulseChannel p[numChannels];
+        ChannelBank p;
         RepeatStack stack;
 
         c.type = PulseStateCommand::endRepeat;
 
         stack.pushRepeat(42, 83);
         stack.pushRepeat(17, 1);
-        step = c.execute(p, &stack, 23, 0, NULL);
+        step = c.execute(&p, &stack, 23, 0, NULL);
         assert(step == 1);
         assert(stack.decrementRepeatCount() == 82);
         assert(stack.getLoopTarget() == 42);
     }
 }
 
+void runProgramStepperTests() {
+    Microseconds time;
+    ChannelMask state;
+    ChannelMask set;
+
+    // should report each change in the outputs at the exact time it occurs
+    // (other than at the end of the program, when everything turns off)
+    {
+        const char* lines[] = {
+            "set channel 2 to 20 us pulses every 50 us",
+            "wait 60 us",
+            "turn on channel 1",
+            "wait 10 us",
+            "end program"
+        };
+        PulseStateCommand commands[5];
+        const char* error = NULL;
+        unsigned repeatDepth = 0;
+        for (int i = 0; i < 5; ++i) {
+            commands[i].parseFromString(lines[i], &error, &repeatDepth);
+            assert(error == NULL);
+        }
+
+        ProgramStepper program(commands, 5);
+
+        assert(program.step(&time, &state, &set));
+        assert(time == 0 && state == 2 && set == 2);
+        assert(program.step(&time, &state, &set));
+        assert(time == 20 && state == 0 && set == 0);
+        assert(program.step(&time, &state, &set));
+        assert(time == 50 && state == 2 && set == 0);
+        assert(program.step(&time, &state, &set));
+        assert(time == 60 && state == 3 && set == 1);
+        assert(!program.step(&time, &state, &set));
+        assert(time == 70 && state == 0);
+        assert(!program.step(&time, &state, &set));
+    }
+
+    // commands that run at the same moment should only report the final
+    // state, and repeats should be followed
+    {
+        const char* lines[] = {
+            "repeat 3 times:",
+            "turn on channel 3",
+            "turn off channel 3",
+            "wait 5 us",
+            "turn on channel 3",
+            "wait 5 us",
+            "turn off channel 3",
+            "end repeat"
+        };
+        PulseStateCommand commands[8];
+        const char* error = NULL;
+        unsigned repeatDepth = 0;
+        for (int i = 0; i < 8; ++i) {
+            commands[i].parseFromString(lines[i], &error, &repeatDepth);
+            assert(error == NULL);
+        }
+
+        ProgramStepper program(commands, 8);
+
+        assert(program.step(&time, &state, &set));
+        assert(time == 0 && state == 0 && set == 4);
+        for (int i = 0; i < 3; ++i) {
+            assert(program.step(&time, &state, &set));
+            assert(time == Microseconds(10 * i + 5) && state == 4);
+            if (i < 2) {
+                assert(program.step(&time, &state, &set));
+                assert(time == Microseconds(10 * i + 10) && state == 0);
+                assert(set == 4);
+            }
+        }
+        assert(!program.step(&time, &state, &set));
+        assert(time == 30);
+    }
+
+    // subroutines should be skipped where they are defined, and run where
+    // they are called, including from loops and other subroutines
+    {
+        const char text[] =
+            "define flash:\n"
+            "turn on channel 1\n"
+            "wait 10 us\n"
+            "turn off channel 1\n"
+            "end define\n"
+            "define twice:\n"
+            "call flash\n"
+            "wait 5 us\n"
+            "call flash\n"
+            "end define\n"
+            "repeat 2 times:\n"
+            "call twice\n"
+            "wait 20 us\n"
+            "end repeat\n"
+            "end program\n";
+        PulseStateCommand commands[15];
+        uint16_t sourceLines[15];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+
+        ProgramStepper program(commands, numCommands);
+        const Microseconds expectedTimes[] = { 0, 10, 15, 25, 45, 55, 60, 70 };
+        for (int i = 0; i < 8; ++i) {
+            assert(program.step(&time, &state, &set));
+            assert(time == expectedTimes[i]);
+            assert(state == (i % 2 == 0 ? 1 : 0));
+            if (i == 4) {
+                // in flash, called from twice, in the loop
+                assert(program.commandIndex() == 2);
+                assert(program.repeats()->depth() == 3);
+                assert(!program.repeats()->isCall(0));
+                assert(program.repeats()->repeatCount(0) == 1);
+                assert(program.repeats()->isCall(1));
+                assert(program.repeats()->isCall(2));
+            }
+        }
+        assert(!program.step(&time, &state, &set));
+        assert(time == 90);
+    }
+
+    // the phases of paired channels should be reported together when
+    // there's no gap between them
+    {
+        const char text[] =
+            "set channel 1 to 100 us pulses every 1 ms\n"
+            "pair channel 1 with channel 2 after 0 us\n"
+            "wait 2 ms\n"
+            "end program\n";
+        PulseStateCommand commands[4];
+        uint16_t sourceLines[4];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+
+        ProgramStepper program(commands, numCommands);
+        assert(program.step(&time, &state, &set));
+        assert(time == 0 && state == 1 && set == 3);
+        const Microseconds expectedTimes[] = { 100, 200, 1000, 1100, 1200 };
+        const ChannelMask expectedStates[] = { 2, 0, 1, 2, 0 };
+        for (int i = 0; i < 5; ++i) {
+            assert(program.step(&time, &state, &set));
+            assert(time == expectedTimes[i] && state == expectedStates[i]);
+        }
+    }
+
+    // bursts should run without any commands running between them
+    {
+        const char text[] =
+            "set channel 2 to 1 ms pulses at 100 Hz\n"
+            "burst channel 2 to 3 pulses at 10 Hz\n"
+            "wait 1 s\n"
+            "end program\n";
+        PulseStateCommand commands[4];
+        uint16_t sourceLines[4];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+
+        ProgramStepper program(commands, numCommands);
+        assert(program.step(&time, &state, &set));
+        assert(time == 0 && state == 2 && set == 2);
+        const Microseconds expectedTimes[] = { 1000, 10000, 11000, 20000,
+            21000, 100000, 101000 };
+        for (int i = 0; i < 7; ++i) {
+            assert(program.step(&time, &state, &set));
+            assert(time == expectedTimes[i] && set == 0);
+            assert(state == (i % 2 == 0 ? 0 : 2));
+            assert(program.commandIndex() == 2);
+        }
+    }
+
+    // random waits should stay within their range, and the same seed
+    // should give the same times
+    {
+        const char text[] =
+            "seed 7\n"
+            "repeat 50 times:\n"
+            "turn on channel 1\n"
+            "wait 10 us\n"
+            "turn off channel 1\n"
+            "wait random 100 us to 200 us\n"
+            "end repeat\n"
+            "end program\n";
+        PulseStateCommand commands[8];
+        uint16_t sourceLines[8];
+        int numCommands;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+
+        Microseconds times[100];
+        ProgramStepper program(commands, numCommands);
+        Microseconds lastOff = 0;
+        bool varied = false;
+        for (int i = 0; i < 100; ++i) {
+            assert(program.step(&time, &state, &set));
+            assert(state == (i % 2 == 0 ? 1 : 0));
+            times[i] = time;
+            if (i % 2 == 0 && i > 0) {
+                assert(time - lastOff >= 100 && time - lastOff <= 200);
+                varied = varied || time - lastOff != times[2] - times[1];
+            }
+            lastOff = time;
+        }
+        assert(varied);
+
+        ProgramStepper again(commands, numCommands);
+        for (int i = 0; i < 100; ++i) {
+            assert(again.step(&time, &state, &set));
+            assert(time == times[i]);
+        }
+
+        commands[0].seed = 8;
+        ProgramStepper other(commands, numCommands);
+        bool differs = false;
+        for (int i = 0; i < 100; ++i) {
+            assert(other.step(&time, &state, &set));
+            differs = differs || time != times[i];
+        }
+        assert(differs);
+    }
+
+    // empty repeats take no time
+    {
+        const char text[] =
+            "turn on channel 1\n"
+            "repeat 2 times:\n"
+            "repeat 2 times:\n"
+            "end repeat\n"
+            "end repeat\n"
+            "wait 1 ms\n"
+            "end program\n";
+        PulseStateCommand commands[7];
+        uint16_t sourceLines[7];
+        int numCommands;
+        int errorLine;
+        // (the fields "end repeat" doesn't use shouldn't matter)
+        memset((void*)commands, 0x55, sizeof(commands));
+        assert(parseProgram(text, strlen(text), commands, sourceLines,
+                    &numCommands, &errorLine) == parseOk);
+
+        ProgramStepper program(commands, numCommands);
+        assert(program.step(&time, &state, &set));
+        assert(time == 0 && state == 1);
+        assert(!program.step(&time, &state, &set));
+        assert(time == 1000);
+    }
+}
+
+// parses a program, one command per line
+static int parseLines(const char** lines, int numLines,
+        PulseStateCommand* commands) {
+    const char* error = NULL;
+    unsigned repeatDepth = 0;
+    for (int i = 0; i < numLines; ++i) {
+        commands[i].parseFromString(lines[i], &error, &repeatDepth);
+        assert(error == NULL);
+    }
+    return numLines;
+}
+
+
+void runChangeQueueTests() {
+    // a chained program should start when the first one ends, with no
+    // change in between for channels that stay on
+    {
+        const char* first[] = {
+            "turn on channel 1",
+            "wait 100 us",
+        };
+        const char* second[] = {
+            "turn on channel 1",
+            "wait 30 us",
+            "turn on channel 2",
+            "wait 20 us",
+        };
+        PulseStateCommand c1[2];
+        PulseStateCommand c2[4];
+        ChangeQueue queue(c1, parseLines(first, 2, c1), false);
+
+        queue.fill();
+        assert(!queue.canChain());
+        queue.fill();
+        assert(queue.canChain() && !queue.canFill());
+        queue.chain(c2, parseLines(second, 4, c2));
+        while (queue.canFill()) {
+            queue.fill();
+        }
+
+        const Microseconds times[] = { 0, 100, 130, 150 };
+        const ChannelMask states[] = { 1, 1, 3, 0 };
+        const bool starts[] = { false, true, false, false };
+        for (int i = 0; i < 4; ++i) {
+            assert(!queue.finished());
+            const PendingChange& change = queue.next();
+            assert(change.time == times[i] && change.state == states[i]);
+            assert(change.startsProgram == starts[i]);
+            queue.pop();
+        }
+        assert(queue.finished());
+    }
+
+    // if the chained program starts with a wait, the outputs should turn
+    // off when the first program ends
+    {
+        const char* first[] = {
+            "turn on channel 1",
+            "wait 100 us",
+        };
+        const char* second[] = {
+            "wait 30 us",
+            "turn on channel 2",
+            "wait 20 us",
+        };
+        PulseStateCommand c1[2];
+        PulseStateCommand c2[3];
+        ChangeQueue queue(c1, parseLines(first, 2, c1), false);
+
+        queue.fill();
+        queue.fill();
+        queue.chain(c2, parseLines(second, 3, c2));
+        while (queue.canFill()) {
+            queue.fill();
+        }
+
+        const Microseconds times[] = { 0, 100, 130, 150 };
+        const ChannelMask states[] = { 1, 0, 2, 0 };
+        const bool starts[] = { false, true, false, false };
+        for (int i = 0; i < 4; ++i) {
+            assert(!queue.finished());
+            const PendingChange& change = queue.next();
+            assert(change.time == times[i] && change.state == states[i]);
+            assert(change.startsProgram == starts[i]);
+            queue.pop();
+        }
+        assert(queue.finished());
+    }
+}
+
+
+void runClockCorrectionTests() {
+    // with no drift, the board's clock is the reference
+    {
+        ClockCorrection clock(0);
+        assert(clock.exact());
+        assert(clock.correct(0) == 0);
+        assert(clock.correct(123456789) == 123456789);
+    }
+
+    // a clock 0.1% fast (or slow) takes a millisecond more (or less) to
+    // reach a second
+    {
+        ClockCorrection fast(1000000);
+        assert(!fast.exact());
+        assert(fast.correct(1000) == 1000);
+        assert(fast.correct(1001) == 1000);
+        assert(fast.correct(1001000) == 1000000);
+        assert(fast.correct(2002000) == 2000000);
+
+        ClockCorrection slow(-1000000);
+        assert(slow.correct(999000) == 1000000);
+        assert(slow.correct(1998000) == 2000000);
+    }
+
+    // the steps should keep to the exact drift, including when the board
+    // time wraps around
+    {
+        const int32_t drifts[] = { 7, -7, 33333, 6999999, -6999999 };
+        for (int i = 0; i < 5; ++i) {
+            int64_t drift = drifts[i];
+            ClockCorrection clock(drifts[i]);
+            for (uint64_t t = 0; t < 5000000000ULL; t += 9999991) {
+                int64_t offset = int64_t(t) * (drift < 0 ? -drift : drift) /
+                    (1000000000LL + drift);
+                Microseconds expected = Microseconds(
+                        drift > 0 ? t - offset : t + offset);
+                assert(clock.correct(Microseconds(t)) == expected);
+            }
+        }
+    }
+
+    // drifts beyond the limit are corrected as far as the limit
+    {
+        ClockCorrection clock(ClockCorrection::maxDrift * 3);
+        assert(clock.correct(1010000) == 1000000);
+    }
+}
+
+void runOptimizerTests() {
+    // should merge waits and drop blank lines and redundant settings
+    {
+        const char* lines[] = {
+            "turn off channel 2",
+            "",
+            "set channel 1 to 10 us pulses every 20 us",
+            "turn on channel 1",
+            "wait 10 us",
+            "# comment",
+            "wait 5 us",
+            "turn on channel 1",
+            "wait 1 us",
+            "end program"
+        };
+        PulseStateCommand c[10];
+        int n = optimizeProgram(c, parseLines(lines, 10, c));
+
+        assert(n == 3);
+        assert(c[0].type == PulseStateCommand::setChannel);
+        assert(c[0].channel == 1 && c[0].onTime == forever);
+        assert(c[1].type == PulseStateCommand::wait);
+        assert(c[1].waitTime == 16);
+        assert(c[2].type == PulseStateCommand::endProgram);
+    }
+
+    // should keep the setting a ramp starts from
+    {
+        const char* lines[] = {
+            "set channel 1 to 10 us pulses every 20 us",
+            "ramp channel 1 to 10 kHz over 1 ms",
+            "wait 1 ms",
+            "end program"
+        };
+        PulseStateCommand c[4];
+        int n = optimizeProgram(c, parseLines(lines, 4, c));
+
+        assert(n == 4);
+        assert(c[0].type == PulseStateCommand::setChannel);
+        assert(c[1].type == PulseStateCommand::rampChannel);
+    }
+
+    // should turn on/off loops into pulse trains, and move settings that
+    // don't change out of loops
+    {
+        const char* lines[] = {
+            "repeat 10 times:",
+            "turn on channel 2",
+            "repeat 100 times:",
+            "turn on channel 1",
+            "wait 10 us",
+            "turn off channel 1",
+            "wait 40 us",
+            "end repeat",
+            "end repeat",
+            "end program"
+        };
+        PulseStateCommand c[10];
+        int n = optimizeProgram(c, parseLines(lines, 10, c));
+
+        assert(n == 8);
+        assert(c[0].type == PulseStateCommand::setChannel);
+        assert(c[0].channel == 2 && c[0].onTime == forever);
+        assert(c[1].type == PulseStateCommand::repeat);
+        assert(c[1].repeatCount == 10);
+        assert(c[2].type == PulseStateCommand::setChannel);
+        assert(c[2].channel == 1);
+        assert(c[2].onTime == 10 && c[2].offTime == 40);
+        assert(c[3].type == PulseStateCommand::wait);
+        assert(c[3].waitTime == 100 * 50 - 40);
+        assert(c[4].type == PulseStateCommand::setChannel);
+        assert(c[4].channel == 1 && c[4].onTime == 0);
+        assert(c[5].type == PulseStateCommand::wait);
+        assert(c[5].waitTime == 40);
+        assert(c[6].type == PulseStateCommand::endRepeat);
+        assert(c[7].type == PulseStateCommand::endProgram);
+    }
+
+    // should keep the source map in step with the commands
+    {
+        const char* lines[] = {
+            "# a comment",
+            "repeat 10 times:",
+            "turn on channel 2",
+            "repeat 100 times:",
+            "turn on channel 1",
+            "wait 10 us",
+            "turn off channel 1",
+            "wait 40 us",
+            "end repeat",
+            "end repeat",
+            "end program"
+        };
+        PulseStateCommand c[11];
+        uint16_t sourceLines[11];
+        for (uint16_t i = 0; i < 11; ++i) {
+            sourceLines[i] = i;
+        }
+        int n = optimizeProgram(c, parseLines(lines, 11, c), sourceLines);
+
+        const uint16_t expected[] = { 2, 1, 4, 5, 6, 7, 9, 10 };
+        assert(n == 8);
+        for (int i = 0; i < n; ++i) {
+            assert(sourceLines[i] == expected[i]);
+        }
+    }
+
+    // should remove repeats that are empty or only run once
+    {
+        const char* lines[] = {
+            "repeat 1 times:",
+            "wait 3 us",
+            "repeat 5 times:",
+            "turn off channel 3",
+            "end repeat",
+            "end repeat",
+            "wait 4 us",
+            "end program"
+        };
+        PulseStateCommand c[8];
+        int n = optimizeProgram(c, parseLines(lines, 8, c));
+
+        assert(n == 2);
+        assert(c[0].type == PulseStateCommand::wait);
+        assert(c[0].waitTime == 7);
+        assert(c[1].type == PulseStateCommand::endProgram);
+    }
+
+    // should keep calls pointing at their subroutines when commands before
+    // them are removed, and not move settings out of loops with calls
+    {
+        const char text[] =
+            "turn on channel 1\n"
+            "turn on channel 1\n"
+            "wait 0 us\n"
+            "define flash:\n"
+            "turn off channel 2\n"
+            "wait 10 us\n"
+            "end define\n"
+            "repeat 3 times:\n"
+            "turn on channel 2\n"
+            "call flash\n"
+            "end repeat\n"
+            "end program\n";
+        PulseStateCommand c[12];
+        uint16_t lines[12];
+        int n;
+        int errorLine;
+        assert(parseProgram(text, strlen(text), c, lines, &n,
+                    &errorLine) == parseOk);
+        assert(c[9].subroutineStart == 3);
+        n = optimizeProgram(c, n, lines);
+
+        assert(n == 9);
+        assert(c[1].type == PulseStateCommand::defineSubroutine);
+        assert(lines[1] == 3);
+        assert(c[6].type == PulseStateCommand::setChannel);
+        assert(c[6].channel == 2 && c[6].onTime == forever);
+        assert(c[7].type == PulseStateCommand::callSubroutine);
+        assert(c[7].subroutineStart == 1);
+    }
+}
+
+void runTimingAnalysisTests() {
+    // one cycle per microsecond keeps the arithmetic simple
+    const TimingCosts costs = { "test", 1, 10, 2, 5, 1 };
+
+    // slow pulses should be on time
+    {
+        const char* lines[] = {
+            "set channel 1 to 100 us pulses every 1 ms",
+            "wait 10 ms",
+            "end program"
+        };
+        PulseStateCommand c[3];
+        TimingAnalysis analysis;
+        analyzeTiming(c, parseLines(lines, 3, c), costs, 1000, &analysis);
+
+        assert(analysis.numChanges == 20);
+        assert(analysis.maxCommandsPerChange == 1);
+        assert(analysis.minChangeSpacing == 100);
+        assert(analysis.minChangeSpacingAt == 100);
+        assert(analysis.maxError == 12);
+        assert(analysis.lateChanges == 0);
+        assert(!analysis.truncated);
+    }
+
+    // edges closer together than the firmware can handle should be late
+    {
+        const char* lines[] = {
+            "set channel 1 to 5 us pulses every 10 us",
+            "wait 3 us",
+            "set channel 2 to 5 us pulses every 10 us",
+            "wait 1 ms",
+            "end program"
+        };
+        PulseStateCommand c[5];
+        TimingAnalysis analysis;
+        analyzeTiming(c, parseLines(lines, 5, c), costs, 50, &analysis);
+
+        assert(analysis.numChanges == 50);
+        assert(analysis.minChangeSpacing == 2);
+        assert(analysis.lateChanges > 0);
+        assert(analysis.maxError > 12);
+        assert(analysis.truncated);
+    }
+}
+
+void runHashTests() {
+    // should only depend on the commands, not on how they were written
+    {
+        const char* lines1[] = {
+            "set channel 1 to 10 ms pulses at 10 Hz",
+            "wait 1 s",
+            "end program"
+        };
+        const char* lines2[] = {
+            "# the same program",
+            "set channel 1 to 10 ms pulses every 100 ms",
+            "",
+            "wait   1000 ms",
+            "end program"
+        };
+        const char* lines3[] = {
+            "set channel 1 to 10 ms pulses at 10 Hz",
+            "wait 2 s",
+            "end program"
+        };
+        PulseStateCommand c1[3];
+        PulseStateCommand c2[5];
+        PulseStateCommand c3[3];
+        uint32_t hash1 = hashProgram(c1, parseLines(lines1, 3, c1));
+        uint32_t hash2 = hashProgram(c2, parseLines(lines2, 5, c2));
+        uint32_t hash3 = hashProgram(c3, parseLines(lines3, 3, c3));
+
+        assert(hash1 == hash2);
+        assert(hash1 != hash3);
+
+        // the end program command (and anything after it) doesn't count
+        assert(hashProgram(c1, 2) == hash1);
+    }
+}
+
 
 int main() {
-    cout << "running PulseChannel tests\n";
-    runPulseChannelTests();
+    cout << "running ChannelBank tests\n";
+    runChannelBankTests();
     cout << "running PulseStateCommand parsing tests\n";
     runPulseStateCommandParsingTests();
+    cout << "running parseProgram tests\n";
+    runParseProgramTests();
     cout << "running PulseStateCommand execute tests\n";
     runPulseStateCommandExecuteTests();
+    cout << "running ProgramStepper tests\n";
+    runProgramStepperTests();
+    cout << "running ChangeQueue tests\n";
+    runChangeQueueTests();
+    cout << "running ClockCorrection tests\n";
+    runClockCorrectionTests();
+    cout << "running optimizer tests\n";
+    runOptimizerTests();
+    cout << "running timing analysis tests\n";
+    runTimingAnalysisTests();
+    cout << "running hash tests\n";
+    runHashTests();
     cout << "**************** Tests passed! ****************\n";
     return 0;
 }
@@ -0,0 +1,646 @@
+#include <QHBoxLayout>
+#include <QVBoxLayout>
+#include <QHeaderView>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QRegExp>
+#include <qextserialport.h>
+#include <qextserialenumerator.h>
+
+#include "pulseStateMachine.h"
+#include "ProgramGuiWindow.h"
+#include "SessionWindow.h"
+
+const QString runButtonText = "Run on Devices";
+const QString abortButtonText = "Abort";
+
+// how often to read the boards' clocks while measuring, and how long to
+// wait for an answer before asking again (e.g. if the board was still
+// starting up)
+const int measureInterval = 100;            // ms
+const qint64 clockQueryTimeout = 2000000000LL;  // ns
+
+
+SessionDevice::SessionDevice(const QString& portName,
+        const QElapsedTimer* clock, QObject* parent) :
+    QObject(parent), m_unansweredPrompts(0), m_promptSeen(false),
+    m_clock(clock)
+{
+    PortSettings settings = {BAUD9600, DATA_8, PAR_NONE, STOP_1, FLOW_OFF, 10};
+    m_port = new QextSerialPort(portName, settings, QextSerialPort::EventDriven);
+
+    QObject::connect(m_port, SIGNAL(readyRead()), SLOT(onNewSerialData()));
+    m_port->open(QIODevice::ReadWrite);
+
+    // Add a dummy line at the beginning to work around a race condition
+    // when the Arduino resets.
+    m_sendBuffer.push_back("# ArduinoPulseGeneratorGui v1.0");
+}
+
+
+SessionDevice::~SessionDevice() {
+    m_port->close();
+    delete m_port;
+}
+
+
+bool SessionDevice::isOpen() const {
+    return m_port->isOpen();
+}
+
+
+void SessionDevice::send(const QStringList& lines) {
+    m_sendBuffer += lines;
+    sendQueuedLines();
+}
+
+
+void SessionDevice::sendNow(const QString& line) {
+    // (the device prompts again once it has handled the line)
+    m_sendBuffer.clear();
+    m_unansweredPrompts = 0;
+    m_port->write((line + "\n").toUtf8());
+}
+
+
+void SessionDevice::sendQueuedLines() {
+    while (m_unansweredPrompts > 0 && !m_sendBuffer.isEmpty()) {
+        m_port->write((m_sendBuffer.front() + "\n").toUtf8());
+        m_sendBuffer.pop_front();
+        --m_unansweredPrompts;
+    }
+}
+
+
+void SessionDevice::onNewSerialData() {
+    if (!m_port->bytesAvailable()) {
+        return;
+    }
+    qint64 time = m_clock->nsecsElapsed();
+    m_receivedText += QString::fromUtf8(m_port->readAll()).remove('\r');
+
+    // N.B.: the prompt and the line endings must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    QRegExp prompt("^\\d+: ");
+    for (;;) {
+        if (!m_promptSeen && prompt.indexIn(m_receivedText) == 0) {
+            m_promptSeen = true;
+            ++m_unansweredPrompts;
+        }
+
+        int end = m_receivedText.indexOf('\n');
+        if (end == -1) {
+            break;
+        }
+        QString line = m_receivedText.left(end);
+        m_receivedText.remove(0, end + 1);
+        m_promptSeen = false;
+        Q_EMIT lineReceived(line, time);
+    }
+
+    sendQueuedLines();
+}
+
+
+SessionWindow::SessionWindow(QWidget* parent) :
+    QWidget(parent)
+{
+    setWindowTitle("Arduino Pulse Generator - Session");
+
+    // the boards
+    m_tableDevices = new QTableWidget(0, numColumns);
+    m_tableDevices->setHorizontalHeaderLabels(QStringList() << "Port" <<
+            "Program" << "Clock drift" << "Status");
+    m_tableDevices->horizontalHeader()->setStretchLastSection(true);
+    m_tableDevices->setSelectionBehavior(QAbstractItemView::SelectRows);
+    m_tableDevices->setSelectionMode(QAbstractItemView::SingleSelection);
+    m_tableDevices->setEditTriggers(QAbstractItemView::NoEditTriggers);
+
+    // the status box
+    m_texteditStatus = new QTextEdit();
+    m_texteditStatus->setReadOnly(true);
+    m_texteditStatus->setLineWrapMode(QTextEdit::NoWrap);
+
+    // and the buttons
+    m_buttonAdd = new QPushButton("Add Device");
+    m_buttonRemove = new QPushButton("Remove Device");
+    m_buttonProgram = new QPushButton("Choose Program");
+    m_buttonConnect = new QPushButton("Connect");
+    m_labelMeasure = new QLabel("Measure for");
+    m_spinMeasure = new QSpinBox();
+    m_spinMeasure->setRange(10, 600);
+    m_spinMeasure->setValue(60);
+    m_spinMeasure->setSuffix(" s");
+    m_buttonMeasure = new QPushButton("Measure Clock Drift");
+    m_labelStart = new QLabel("Start on");
+    m_comboStart = new QComboBox();
+    m_comboStart->addItem("sync pulse from the first device");
+    m_comboStart->addItem("external trigger");
+    m_buttonRun = new QPushButton(runButtonText);
+
+    // lay out the controls
+    QHBoxLayout* deviceLayout = new QHBoxLayout;
+    deviceLayout->addWidget(m_buttonAdd);
+    deviceLayout->addWidget(m_buttonRemove);
+    deviceLayout->addWidget(m_buttonProgram);
+    deviceLayout->addStretch();
+    deviceLayout->addWidget(m_buttonConnect);
+
+    QHBoxLayout* buttonLayout = new QHBoxLayout;
+    buttonLayout->addWidget(m_labelMeasure);
+    buttonLayout->addWidget(m_spinMeasure);
+    buttonLayout->addWidget(m_buttonMeasure);
+    buttonLayout->addStretch();
+    buttonLayout->addWidget(m_labelStart);
+    buttonLayout->addWidget(m_comboStart);
+    buttonLayout->addWidget(m_buttonRun);
+
+    QVBoxLayout* mainLayout = new QVBoxLayout;
+    mainLayout->addWidget(m_tableDevices);
+    mainLayout->addLayout(deviceLayout);
+    mainLayout->addWidget(m_texteditStatus);
+    mainLayout->addLayout(buttonLayout);
+    setLayout(mainLayout);
+
+    m_measureTimer = new QTimer(this);
+    m_measureTimer->setInterval(measureInterval);
+    m_measureEnd = 0;
+    m_clock.start();
+
+    QObject::connect(m_buttonAdd, SIGNAL(clicked()), this, SLOT(addDevice()));
+    QObject::connect(m_buttonRemove, SIGNAL(clicked()), this, SLOT(removeDevice()));
+    QObject::connect(m_buttonProgram, SIGNAL(clicked()), this, SLOT(chooseProgram()));
+    QObject::connect(m_buttonConnect, SIGNAL(clicked()), this, SLOT(toggleConnection()));
+    QObject::connect(m_buttonMeasure, SIGNAL(clicked()), this, SLOT(measureDrift()));
+    QObject::connect(m_buttonRun, SIGNAL(clicked()), this, SLOT(run()));
+    QObject::connect(m_measureTimer, SIGNAL(timeout()), SLOT(onMeasureTick()));
+
+    addDevice();
+    addDevice();
+    setConnected(false);
+}
+
+
+SessionWindow::~SessionWindow() {
+    qDeleteAll(m_devices);
+}
+
+
+QSize SessionWindow::sizeHint() const {
+    return QSize(700,500);
+}
+
+
+void SessionWindow::addStatus(const QString& text) {
+    m_texteditStatus->moveCursor(QTextCursor::End);
+    m_texteditStatus->insertPlainText(text + "\n");
+}
+
+
+void SessionWindow::setDeviceStatus(int row, const QString& text) {
+    m_tableDevices->item(row, columnStatus)->setText(text);
+}
+
+
+void SessionWindow::setConnected(bool connected) {
+    m_buttonConnect->setText(connected ? "Disconnect" : "Connect");
+    m_buttonAdd->setEnabled(!connected);
+    m_buttonRemove->setEnabled(!connected);
+    m_buttonMeasure->setEnabled(connected);
+    m_buttonRun->setEnabled(connected);
+    for (int row = 0; row < m_tableDevices->rowCount(); ++row) {
+        m_tableDevices->cellWidget(row, columnPort)->setEnabled(!connected);
+    }
+}
+
+
+QString SessionWindow::portName(int row) const {
+    return static_cast<QComboBox*>(
+            m_tableDevices->cellWidget(row, columnPort))->currentText();
+}
+
+
+int SessionWindow::rowOf(QObject* device) const {
+    for (int row = 0; row < m_devices.size(); ++row) {
+        if (m_devices[row] == device) {
+            return row;
+        }
+    }
+    return -1;
+}
+
+
+void SessionWindow::addDevice() {
+    int row = m_tableDevices->rowCount();
+    m_tableDevices->insertRow(row);
+
+    // offer the ports not already chosen for the other devices first
+    QComboBox* comboPort = new QComboBox();
+    comboPort->setEditable(true);
+    Q_FOREACH (QextPortInfo info, QextSerialEnumerator::getPorts()) {
+        comboPort->addItem(info.portName);
+    }
+    comboPort->setCurrentIndex(qMax(0, comboPort->count() - 1 - row));
+    m_tableDevices->setCellWidget(row, columnPort, comboPort);
+
+    m_tableDevices->setItem(row, columnProgram,
+            new QTableWidgetItem("<no program>"));
+    m_tableDevices->setItem(row, columnDrift,
+            new QTableWidgetItem(row == 0 ? "reference" : "not measured"));
+    m_tableDevices->setItem(row, columnStatus, new QTableWidgetItem(""));
+}
+
+
+void SessionWindow::removeDevice() {
+    int row = m_tableDevices->currentRow();
+    if (row < 0) {
+        row = m_tableDevices->rowCount() - 1;
+    }
+    if (row >= 0) {
+        m_tableDevices->removeRow(row);
+    }
+    if (m_tableDevices->rowCount() > 0) {
+        m_tableDevices->item(0, columnDrift)->setText("reference");
+    }
+}
+
+
+void SessionWindow::chooseProgram() {
+    int row = m_tableDevices->currentRow();
+    if (row < 0) {
+        return;
+    }
+
+    QString fileName = QFileDialog::getOpenFileName(this,
+            tr("Open Pulse Sequence"), "",
+            tr("Pulse Sequence (*.psq);;All Files (*)"));
+    if (!fileName.isEmpty()) {
+        QTableWidgetItem* item = m_tableDevices->item(row, columnProgram);
+        item->setText(QFileInfo(fileName).fileName());
+        item->setData(Qt::UserRole, fileName);
+        item->setToolTip(fileName);
+    }
+}
+
+
+void SessionWindow::toggleConnection() {
+    // closing the ports resets the boards, which stops any programs
+    if (!m_devices.isEmpty()) {
+        m_measureTimer->stop();
+        qDeleteAll(m_devices);
+        m_devices.clear();
+        for (int row = 0; row < m_tableDevices->rowCount(); ++row) {
+            setDeviceStatus(row, "");
+        }
+        m_buttonRun->setText(runButtonText);
+        setConnected(false);
+        return;
+    }
+
+    // (the program windows keep their port open between runs)
+    int numDevices = m_tableDevices->rowCount();
+    for (int row = 0; row < numDevices; ++row) {
+        if (!ProgramGuiWindow::releasePort(portName(row))) {
+            addStatus(portName(row) + " is running a program from another "
+                    "window");
+            return;
+        }
+    }
+
+    for (int row = 0; row < numDevices; ++row) {
+        SessionDevice* device = new SessionDevice(portName(row), &m_clock,
+                this);
+        m_devices.push_back(device);
+        QObject::connect(device, SIGNAL(lineReceived(QString, qint64)),
+                SLOT(onLineReceived(QString, qint64)));
+
+        if (!device->isOpen()) {
+            addStatus("Unable to open " + portName(row));
+            qDeleteAll(m_devices);
+            m_devices.clear();
+            return;
+        }
+    }
+    for (int row = 0; row < numDevices; ++row) {
+        setDeviceStatus(row, "connected");
+    }
+
+    // the boards' clocks are corrected once the drift has been measured
+    m_drifts.fill(0, numDevices);
+    m_states.fill(deviceIdle, numDevices);
+    for (int row = 1; row < numDevices; ++row) {
+        m_tableDevices->item(row, columnDrift)->setText("not measured");
+    }
+    setConnected(true);
+}
+
+
+void SessionWindow::measureDrift() {
+    if (m_devices.isEmpty() || m_measureTimer->isActive()) {
+        return;
+    }
+
+    int numDevices = m_devices.size();
+    m_readings.fill(QVector<ClockReading>(), numDevices);
+    m_querySent.fill(0, numDevices);
+    m_measureEnd = m_clock.nsecsElapsed() +
+        qint64(m_spinMeasure->value()) * 1000000000LL;
+    m_measureTimer->start();
+
+    m_buttonMeasure->setEnabled(false);
+    m_buttonRun->setEnabled(false);
+    m_buttonConnect->setEnabled(false);
+    addStatus("Measuring the clocks for " +
+            QString::number(m_spinMeasure->value()) + " s...");
+}
+
+
+void SessionWindow::onMeasureTick() {
+    qint64 now = m_clock.nsecsElapsed();
+    if (now >= m_measureEnd) {
+        finishMeasuring();
+        return;
+    }
+
+    // ask each board for its clock once it has answered the last time
+    // N.B.: this command must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    for (int row = 0; row < m_devices.size(); ++row) {
+        if (m_querySent[row] == 0 ||
+                now - m_querySent[row] > clockQueryTimeout) {
+            m_querySent[row] = m_clock.nsecsElapsed();
+            m_devices[row]->sendNow("clock");
+        }
+    }
+
+    int seconds = int((m_measureEnd - now) / 1000000000LL);
+    for (int row = 0; row < m_devices.size(); ++row) {
+        setDeviceStatus(row, QString("measuring (%1 readings, %2 s left)")
+                .arg(m_readings[row].size()).arg(seconds));
+    }
+}
+
+
+bool SessionWindow::clockRate(const QVector<ClockReading>& readings,
+        double* rate) {
+    // The time each reading was taken is only known to within the time the
+    // query and its answer took, which varies with the USB traffic, so the
+    // quickest reading from the first third of the measurement is compared
+    // with the quickest from the last third.
+    const int minReadings = 6;
+    int numReadings = readings.size();
+    if (numReadings < minReadings) {
+        return false;
+    }
+
+    int first = 0;
+    int last = numReadings - 1;
+    for (int i = 0; i < numReadings / 3; ++i) {
+        const ClockReading& a = readings[i];
+        const ClockReading& b = readings[numReadings - 1 - i];
+        if (a.received - a.sent <
+                readings[first].received - readings[first].sent) {
+            first = i;
+        }
+        if (b.received - b.sent <
+                readings[last].received - readings[last].sent) {
+            last = numReadings - 1 - i;
+        }
+    }
+
+    const ClockReading& a = readings[first];
+    const ClockReading& b = readings[last];
+    double elapsed = ((b.sent + b.received) - (a.sent + a.received)) / 2.;
+    // (the board's clock wraps around, but not during a measurement)
+    uint32_t boardElapsed = b.boardTime - a.boardTime;
+    *rate = boardElapsed * 1000. / elapsed;
+    return true;
+}
+
+
+void SessionWindow::finishMeasuring() {
+    m_measureTimer->stop();
+    m_buttonMeasure->setEnabled(true);
+    m_buttonRun->setEnabled(true);
+    m_buttonConnect->setEnabled(true);
+
+    QVector<double> rates(m_devices.size());
+    for (int row = 0; row < m_devices.size(); ++row) {
+        setDeviceStatus(row, "connected");
+        if (!clockRate(m_readings[row], &rates[row])) {
+            addStatus("Too few clock readings from " + portName(row) +
+                    " (is the pulse generator firmware running?)");
+            return;
+        }
+    }
+
+    // the first board is the reference the others are corrected to
+    for (int row = 1; row < m_devices.size(); ++row) {
+        double drift = (rates[row] / rates[0] - 1) * 1e9;
+        if (qAbs(drift) > ClockCorrection::maxDrift) {
+            addStatus("The clock of device " + QString::number(row + 1) +
+                    " is too far off to correct (" +
+                    QString::number(drift / 1e7, 'f', 2) + "%)");
+            m_drifts[row] = 0;
+            m_tableDevices->item(row, columnDrift)->setText("not measured");
+            continue;
+        }
+        m_drifts[row] = qRound(drift);
+        m_tableDevices->item(row, columnDrift)->setText(
+                QString::number(drift / 1000., 'f', 1) + " ppm");
+    }
+    addStatus("Clock drift measured.");
+}
+
+
+bool SessionWindow::loadProgram(int row, QStringList* lines) {
+    QString fileName = m_tableDevices->item(row, columnProgram)
+        ->data(Qt::UserRole).toString();
+    QFile file(fileName);
+    if (fileName.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        addStatus("Device " + QString::number(row + 1) +
+                ": unable to open the program " + fileName);
+        return false;
+    }
+    QTextStream in(&file);
+
+    // check the program before sending any of it, so that no board is
+    // left armed with half a program
+    lines->clear();
+    ParseState state;
+    PulseStateCommand command;
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        ParseError error = command.parseFromString(
+                line.toUtf8().constData(), &state);
+        if (error != parseOk) {
+            addStatus("Device " + QString::number(row + 1) + ", line " +
+                    QString::number(lines->size() + 1) + ": " +
+                    QString::fromUtf8(parseErrorMessage(error)));
+            return false;
+        }
+        lines->push_back(line);
+        if (command.type == PulseStateCommand::endProgram) {
+            return true;
+        }
+    }
+    lines->push_back("end program");
+    return true;
+}
+
+
+void SessionWindow::sendProgram(int row, bool leader) {
+    // N.B.: these commands must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    QStringList lines;
+    lines.push_back("clock drift " + QString::number(m_drifts[row]) + " ppb");
+    lines.push_back(leader ? "start with sync pulse" : "start on trigger");
+    lines += m_programs[row];
+
+    m_states[row] = deviceLoading;
+    setDeviceStatus(row, "loading");
+    m_devices[row]->send(lines);
+}
+
+
+void SessionWindow::run() {
+    if (m_devices.isEmpty()) {
+        return;
+    }
+
+    // stop every board, if the session is running
+    // N.B.: this command must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    bool running = false;
+    for (int row = 0; row < m_devices.size(); ++row) {
+        running = running || (m_states[row] != deviceIdle &&
+                m_states[row] != deviceFinished);
+    }
+    if (running) {
+        Q_FOREACH (SessionDevice* device, m_devices) {
+            device->sendNow("abort");
+        }
+        return;
+    }
+
+    int numDevices = m_devices.size();
+    m_programs.fill(QStringList(), numDevices);
+    for (int row = 0; row < numDevices; ++row) {
+        if (!loadProgram(row, &m_programs[row])) {
+            return;
+        }
+    }
+
+    m_buttonRun->setText(abortButtonText);
+    m_buttonMeasure->setEnabled(false);
+    m_buttonConnect->setEnabled(false);
+    m_states.fill(deviceIdle, numDevices);
+
+    // With a sync pulse, the first board starts the others, so it is sent
+    // its program once they are all waiting (see onLineReceived).
+    bool syncPulse = m_comboStart->currentIndex() == 0;
+    for (int row = syncPulse ? 1 : 0; row < numDevices; ++row) {
+        sendProgram(row, false);
+    }
+    if (syncPulse && numDevices == 1) {
+        sendProgram(0, true);
+    }
+}
+
+
+void SessionWindow::onLineReceived(const QString& line, qint64 time) {
+    int row = rowOf(sender());
+    if (row < 0) {
+        return;
+    }
+
+    // N.B.: these messages must be kept in sync with
+    // PulseGeneratorFirmware.pde
+    QRegExp clockAnswer("^clock (\\d+)$");
+    if (clockAnswer.indexIn(line) != -1) {
+        if (m_measureTimer->isActive() && m_querySent[row] != 0) {
+            ClockReading reading = { m_querySent[row], time,
+                uint32_t(clockAnswer.cap(1).toULong()) };
+            m_readings[row].push_back(reading);
+            m_querySent[row] = 0;
+        }
+        return;
+    }
+    if (m_measureTimer->isActive()) {
+        // (the echoed queries and the prompts)
+        return;
+    }
+
+    // show the messages for any parse error codes (see
+    // ProgramGuiWindow::translateErrorCodes)
+    QString text = line;
+    QRegExp errorCode(" \\(code (\\d+)\\)");
+    if (errorCode.indexIn(text) != -1) {
+        const char* message =
+            parseErrorMessage(ParseError(errorCode.cap(1).toInt()));
+        text.replace(errorCode, ": " +
+                QString::fromUtf8(message ? message : "unknown error"));
+    }
+    addStatus(QString::number(row + 1) + "> " + text.remove('\07'));
+
+    bool syncPulse = m_comboStart->currentIndex() == 0;
+    if (line.contains("Running program")) {
+        m_states[row] = deviceRunning;
+        setDeviceStatus(row, "running");
+
+        // the boards waiting for the first board's sync pulse start with
+        // it
+        for (int other = 1; syncPulse && row == 0 &&
+                other < m_devices.size(); ++other) {
+            if (m_states[other] == deviceArmed) {
+                m_states[other] = deviceRunning;
+                setDeviceStatus(other, "running");
+            }
+        }
+    } else if (line.contains("waiting for trigger")) {
+        m_states[row] = deviceArmed;
+        setDeviceStatus(row, "waiting for trigger");
+    } else if (line.contains('\07')) {
+        // the end of the run, or an error
+        bool wasLoading = m_states[row] == deviceLoading;
+        m_states[row] = deviceFinished;
+        setDeviceStatus(row, text.left(40));
+
+        // A board that can't take its program would leave the others
+        // waiting, so stop them (and discard the rest of its program).
+        if (wasLoading && !line.contains("aborted")) {
+            for (int other = 0; other < m_devices.size(); ++other) {
+                if (other == row || (m_states[other] != deviceIdle &&
+                            m_states[other] != deviceFinished)) {
+                    m_devices[other]->sendNow("abort");
+                }
+            }
+        }
+    }
+
+    bool allArmed = true;
+    bool allFinished = true;
+    for (int other = 0; other < m_devices.size(); ++other) {
+        if (!(syncPulse && other == 0)) {
+            allArmed = allArmed && m_states[other] == deviceArmed;
+        }
+        allFinished = allFinished && (m_states[other] == deviceFinished ||
+                (syncPulse && other == 0 && m_states[other] == deviceIdle));
+    }
+
+    if (allArmed && line.contains("waiting for trigger")) {
+        if (syncPulse) {
+            sendProgram(0, true);
+        } else {
+            addStatus("All devices are waiting for the external trigger.");
+        }
+    }
+
+    if (allFinished) {
+        m_states.fill(deviceIdle, m_devices.size());
+        m_buttonRun->setText(runButtonText);
+        m_buttonMeasure->setEnabled(true);
+        m_buttonConnect->setEnabled(true);
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef SESSIONWINDOW_H
+#define SESSIONWINDOW_H
+#include <QWidget>
+#include <QPushButton>
+#include <QLabel>
+#include <QTextEdit>
+#include <QComboBox>
+#include <QSpinBox>
+#include <QTableWidget>
+#include <QElapsedTimer>
+#include <QTimer>
+
+#include "pulseStateMachine.h"
+
+class QextSerialPort;
+
+// One of the boards in a session.  Its serial port is kept open for the
+// whole session, since opening the port resets most Arduinos (which would
+// lose the board's clock correction).
+class SessionDevice : public QObject
+{
+    Q_OBJECT
+
+    QextSerialPort* m_port;
+
+    // lines waiting to be sent, one per prompt from the device, and the
+    // prompts that haven't been answered yet
+    QStringList m_sendBuffer;
+    int m_unansweredPrompts;
+
+    // text received since the last complete line, and whether it started
+    // with a prompt (e.g. "12: ")
+    QString m_receivedText;
+    bool m_promptSeen;
+
+    // the session's clock, for timing the lines received
+    const QElapsedTimer* m_clock;
+
+    void sendQueuedLines();
+
+private Q_SLOTS:
+    void onNewSerialData();
+
+public:
+    SessionDevice(const QString& portName, const QElapsedTimer* clock,
+            QObject* parent = NULL);
+    ~SessionDevice();
+
+    // true if the port could be opened
+    bool isOpen() const;
+
+    // queues lines to send as the device asks for them
+    void send(const QStringList& lines);
+
+    // sends a line straight away (e.g. "abort", or "clock" while the device
+    // is waiting for a program), discarding any queued lines
+    void sendNow(const QString& line);
+
+Q_SIGNALS:
+    // a line of text from the device (without the line ending), and the
+    // session clock's time when it arrived, in nanoseconds
+    void lineReceived(const QString& line, qint64 time);
+};
+
+
+// A window for running programs on several boards together, as if they
+// were one large pulse generator.  Each board is given its own program, and
+// the programs are started together either by an external trigger wired to
+// every board's trigger pin, or by the sync pin of the first board, wired
+// to the trigger pins of the others (see pulseGeneratorBoards.h).  The
+// drift of each board's clock from the first board's is measured over the
+// serial ports beforehand, and corrected for by the boards, so that they
+// stay together for the whole run.
+class SessionWindow : public QWidget
+{
+    Q_OBJECT
+
+    // one row per board
+    enum Column { columnPort, columnProgram, columnDrift, columnStatus,
+        numColumns };
+    QTableWidget* m_tableDevices;
+
+    QTextEdit* m_texteditStatus;
+
+    QPushButton* m_buttonAdd;
+    QPushButton* m_buttonRemove;
+    QPushButton* m_buttonProgram;
+    QPushButton* m_buttonConnect;
+    QLabel* m_labelMeasure;
+    QSpinBox* m_spinMeasure;
+    QPushButton* m_buttonMeasure;
+    QLabel* m_labelStart;
+    QComboBox* m_comboStart;
+    QPushButton* m_buttonRun;
+
+    // the boards' connections (empty when disconnected), in the order of
+    // the rows
+    QList<SessionDevice*> m_devices;
+
+    // the session's clock, which the boards' clocks are measured against
+    QElapsedTimer m_clock;
+
+    // A reading of a board's clock: the session's time when the "clock"
+    // query was sent and when the answer arrived, and the board's clock
+    // (in microseconds, wrapping around every 71 minutes) in between.
+    struct ClockReading {
+        qint64 sent;
+        qint64 received;
+        uint32_t boardTime;
+    };
+
+    // the readings taken so far while measuring, the time each board's
+    // last query was sent (0 if none is outstanding), and the measured
+    // drifts (in parts per billion, relative to the first board)
+    QVector<QVector<ClockReading> > m_readings;
+    QVector<qint64> m_querySent;
+    QVector<int32_t> m_drifts;
+    QTimer* m_measureTimer;
+    qint64 m_measureEnd;
+
+    // the boards' progress through a run
+    enum DeviceState { deviceIdle, deviceLoading, deviceArmed,
+        deviceRunning, deviceFinished };
+    QVector<DeviceState> m_states;
+
+    // the programs waiting to be sent, as lines (see loadProgram)
+    QVector<QStringList> m_programs;
+
+    void addStatus(const QString& text);
+    void setDeviceStatus(int row, const QString& text);
+    void setConnected(bool connected);
+
+    // the port chosen for a row
+    QString portName(int row) const;
+
+    // the row of a device, or -1
+    int rowOf(QObject* device) const;
+
+    // Reads a program file into the lines to send to a board (up to and
+    // including "end program"), returning false, after reporting the
+    // problem, if it can't be read or has an error.
+    bool loadProgram(int row, QStringList* lines);
+
+    // Works out how fast a board's clock runs (in board microseconds per
+    // microsecond of the session's clock) from its readings, returning
+    // false if there are too few.
+    static bool clockRate(const QVector<ClockReading>& readings,
+            double* rate);
+
+    void finishMeasuring();
+
+    // sends a program to a board, to start as the session starts
+    void sendProgram(int row, bool leader);
+
+private Q_SLOTS:
+    void addDevice();
+    void removeDevice();
+    void chooseProgram();
+    void toggleConnection();
+    void measureDrift();
+    void run();
+
+    void onLineReceived(const QString& line, qint64 time);
+    void onMeasureTick();
+
+public:
+    SessionWindow(QWidget* parent = NULL);
+    ~SessionWindow();
+
+    virtual QSize sizeHint() const;
+};
+
+#endif /* SESSIONWINDOW_H */